@@ -14,6 +14,7 @@
 #include "snac.h"
 
 #include <sys/wait.h>
+#include <pthread.h>
 
 const char *public_address = "https:/" "/www.w3.org/ns/activitystreams#Public";
 
@@ -701,6 +702,98 @@ int is_msg_for_me(snac *snac, const xs_dict *c_msg)
 }
 
 
+static void _add_local_user(xs_set *uids, const char *url)
+/* adds the uid of a local user if url is one of our own */
+{
+    if (xs_type(url) == XSTYPE_STRING && xs_startswith(url, srv_baseurl)) {
+        xs *l = xs_split_n(url + strlen(srv_baseurl), "/", 2);
+        const char *uid = xs_list_get(l, 1);
+
+        if (uid && *uid)
+            xs_set_add(uids, uid);
+    }
+}
+
+
+static void _add_related_users(xs_set *uids, const char *actor)
+/* adds the uids of the local users related to actor */
+{
+    if (xs_type(actor) == XSTYPE_STRING) {
+        xs *list = relation_list(actor);
+        const char *uid;
+
+        xs_list_foreach(list, uid)
+            xs_set_add(uids, uid);
+    }
+}
+
+
+xs_list *msg_candidate_users(const xs_dict *c_msg)
+/* returns the uids of the local users for which is_msg_for_me()
+   may return true, or NULL if all of them should be checked */
+{
+    const char *type  = xs_dict_get(c_msg, "type");
+    const char *actor = xs_dict_get(c_msg, "actor");
+    const xs_val *object = xs_dict_get(c_msg, "object");
+    xs_set uids;
+
+    if (xs_type(type) != XSTYPE_STRING)
+        return NULL;
+
+    xs_set_init(&uids);
+
+    /* all the types below, at least, need the actor to be related */
+    _add_related_users(&uids, actor);
+
+    if (xs_match(type, "Like|Announce|EmojiReact")) {
+        if (xs_type(object) == XSTYPE_DICT)
+            object = xs_dict_get(object, "id");
+
+        _add_local_user(&uids, object);
+    }
+    else
+    if (xs_match(type, "Undo|Accept")) {
+        /* nothing else */
+    }
+    else
+    if (xs_match(type, "Follow")) {
+        _add_local_user(&uids, object);
+    }
+    else
+    if (xs_match(type, "Ping")) {
+        _add_local_user(&uids, xs_dict_get(c_msg, "to"));
+    }
+    else
+    if (xs_match(type, "Create|Update")) {
+        xs *rcpts = recipient_list(NULL, object, 0);
+        const char *v;
+
+        xs_list_foreach(rcpts, v) {
+            _add_local_user(&uids, v);
+            _add_related_users(&uids, v);
+        }
+
+        _add_related_users(&uids, get_atto(object));
+
+        /* the author of the replied message */
+        const char *irt = get_in_reply_to(object);
+        if (!xs_is_null(irt)) {
+            xs *r_msg = NULL;
+
+            if (valid_status(object_get(irt, &r_msg)))
+                _add_related_users(&uids, get_atto(r_msg));
+        }
+    }
+    else {
+        /* any other type is allowed as is */
+        xs_set_free(&uids);
+        return NULL;
+    }
+
+    return xs_set_result(&uids);
+}
+
+
 xs_str *process_tags(snac *snac, const char *content, xs_list **tag)
 /* parses mentions and tags from content */
 {
@@ -1671,7 +1764,7 @@ int update_question(snac *user, const char *id)
     while (xs_list_iter(&p, &v)) {
         xs *obj = NULL;
 
-        if (!valid_status(object_get_by_md5(v, &obj)))
+        if (!valid_status(object_get_by_md5_fields(v, &obj, "name", "attributedTo")))
             continue;
 
         const char *name = xs_dict_get(obj, "name");
@@ -1758,6 +1851,88 @@ int update_question(snac *user, const char *id)
 }
 
 
+/** inbound de-duplication **/
+
+/* the same activity usually arrives several times (through the shared inbox,
+   personal inboxes or relays); a bounded, time-windowed set of the recently
+   verified ones allows acknowledging the copies without processing them */
+
+typedef struct {
+    char key[MD5_HEX_SIZE];     /* md5 of the target inbox, signer and activity id */
+    char chk[MD5_HEX_SIZE];     /* md5 of the payload */
+    time_t t;                   /* arrival time */
+} dedupe_item;
+
+#define DEDUPE_PROBES 8
+
+static pthread_mutex_t dedupe_mutex = PTHREAD_MUTEX_INITIALIZER;
+static dedupe_item *dedupe_tbl = NULL;
+static int dedupe_size = 0;
+
+
+static int inbox_seen(const char *key, const char *chk, int add)
+/* checks if an activity was recently accepted (add == 0) or marks it (add == 1) */
+{
+    int secs = xs_number_get(xs_dict_get_def(srv_config, "inbox_dedupe_seconds", "600"));
+    time_t t = time(NULL);
+    dedupe_item *slot = NULL;
+    int ret = 0;
+    int n;
+
+    if (secs <= 0)
+        return 0;
+
+    pthread_mutex_lock(&dedupe_mutex);
+
+    if (dedupe_tbl == NULL) {
+        dedupe_size = xs_number_get(xs_dict_get_def(srv_config, "inbox_dedupe_entries", "8192"));
+
+        if (dedupe_size < DEDUPE_PROBES)
+            dedupe_size = DEDUPE_PROBES;
+
+        int arena = xs_arena_suspend();
+        dedupe_tbl = xs_realloc(NULL, dedupe_size * sizeof(dedupe_item));
+        xs_arena_resume(arena);
+
+        memset(dedupe_tbl, '\0', dedupe_size * sizeof(dedupe_item));
+    }
+
+    unsigned int h = xs_hash_func(key, MD5_HEX_SIZE - 1);
+
+    for (n = 0; n < DEDUPE_PROBES; n++) {
+        dedupe_item *di = &dedupe_tbl[(h + n) % dedupe_size];
+
+        if (strcmp(di->key, key) == 0) {
+            /* same activity: it's a duplicate if the payload is the same */
+            ret = di->t + secs >= t && strcmp(di->chk, chk) == 0;
+            slot = di;
+            break;
+        }
+
+        /* otherwise, the best slot is the oldest one */
+        if (slot == NULL || di->t < slot->t)
+            slot = di;
+    }
+
+    if (add) {
+        memcpy(slot->key, key, MD5_HEX_SIZE);
+        memcpy(slot->chk, chk, MD5_HEX_SIZE);
+        slot->t = t;
+    }
+    else
+    if (p_state != NULL) {
+        p_state->inbox_dedupe_checked++;
+
+        if (ret)
+            p_state->inbox_dedupe_hits++;
+    }
+
+    pthread_mutex_unlock(&dedupe_mutex);
+
+    return ret;
+}
+
+
 /** queues **/
 
 int process_input_message(snac *snac, const xs_dict *msg, const xs_dict *req)
@@ -1781,7 +1956,7 @@ int process_input_message(snac *snac, const xs_dict *msg, const xs_dict *req)
         type = "Note";
 
     /* reject uninteresting messages right now */
-    if (xs_match(type, "Add|View|Reject|Read|Remove")) {
+    if (xs_match(type, IGNORED_ACTIVITY_TYPE)) {
         srv_debug(0, xs_fmt("Ignored message of type '%s'", type));
         return -1;
     }
@@ -2415,7 +2590,18 @@ void process_user_queue_item(snac *snac, xs_dict *q_item)
         if (xs_is_null(msg))
             return;
 
-        if (!process_input_message(snac, msg, req)) {
+        int r = process_input_message(snac, msg, req);
+
+        if (r == 1) {
+            /* the signature was good: copies of it can be dropped now */
+            const char *dd_key = xs_dict_get(q_item, "dedupe_key");
+            const char *dd_chk = xs_dict_get(q_item, "dedupe_chk");
+
+            if (dd_key && dd_chk)
+                inbox_seen(dd_key, dd_chk, 1);
+        }
+        else
+        if (r == 0) {
             if (retries > queue_retry_max)
                 snac_log(snac, xs_fmt("input giving up"));
             else {
@@ -2667,63 +2853,81 @@ void process_queue_item(xs_dict *q_item)
         const xs_dict *msg = xs_dict_get(q_item, "message");
         const xs_dict *req = xs_dict_get(q_item, "req");
         int retries  = xs_number_get(xs_dict_get(q_item, "retries"));
+        const char *uid = xs_dict_get(q_item, "uid");
 
-        /* do some instance-level checks */
-        int r = process_input_message(NULL, msg, req);
+        if (uid != NULL) {
+            /* an input message posted directly from a user inbox */
+            snac user;
 
-        if (r == 0) {
-            /* transient error? retry */
-            if (retries > queue_retry_max)
-                srv_log(xs_fmt("shared input giving up"));
-            else {
-                /* reenqueue */
-                enqueue_shared_input(msg, req, retries + 1);
-                srv_log(xs_fmt("shared input requeue #%d", retries + 1));
+            if (user_open(&user, uid)) {
+                process_user_queue_item(&user, q_item);
+                user_free(&user);
             }
         }
-        else
-        if (r == 2) {
-            /* redistribute the input message to all users */
-            const char *ntid = xs_dict_get(q_item, "ntid");
-            xs *tmpfn  = xs_fmt("%s/tmp/%s.json", srv_basedir, ntid);
-            FILE *f;
-
-            if ((f = fopen(tmpfn, "w")) != NULL) {
-                xs_json_dump(q_item, 4, f);
-                fclose(f);
+        else {
+            /* do some instance-level checks */
+            int r = process_input_message(NULL, msg, req);
+
+            if (r == 0) {
+                /* transient error? retry */
+                if (retries > queue_retry_max)
+                    srv_log(xs_fmt("shared input giving up"));
+                else {
+                    /* reenqueue */
+                    enqueue_shared_input(msg, req, retries + 1);
+                    srv_log(xs_fmt("shared input requeue #%d", retries + 1));
+                }
             }
+            else
+            if (r == 2) {
+                /* redistribute the input message to all users */
+                const char *ntid = xs_dict_get(q_item, "ntid");
+                xs *tmpfn  = xs_fmt("%s/tmp/%s.json", srv_basedir, ntid);
+                FILE *f;
+
+                if ((f = fopen(tmpfn, "w")) != NULL) {
+                    storage_dump(q_item, f);
+                    fclose(f);
+                }
 
-            xs *users = user_list();
-            xs_list *p = users;
-            const char *v;
-            int cnt = 0;
+                /* only check the users that can be interested in it */
+                xs *users = msg_candidate_users(msg);
+                const char *v;
+                int cnt = 0;
 
-            while (xs_list_iter(&p, &v)) {
-                snac user;
+                if (users == NULL)
+                    users = user_list();
 
-                if (user_open(&user, v)) {
-                    if (is_msg_for_me(&user, msg)) {
-                        xs *fn = xs_fmt("%s/queue/%s.json", user.basedir, ntid);
+                xs_list *p = users;
+                while (xs_list_iter(&p, &v)) {
+                    snac user;
 
-                        snac_debug(&user, 1,
-                            xs_fmt("enqueue_input (from shared inbox) %s", xs_dict_get(msg, "id")));
+                    if (user_open(&user, v)) {
+                        if (is_msg_for_me(&user, msg)) {
+                            xs *fn = xs_fmt("%s/queue/%s.json", user.basedir, ntid);
 
-                        if (link(tmpfn, fn) < 0)
-                            srv_log(xs_fmt("link(%s, %s) error", tmpfn, fn));
+                            snac_debug(&user, 1,
+                                xs_fmt("enqueue_input (from shared inbox) %s", xs_dict_get(msg, "id")));
 
-                        cnt++;
-                    }
+                            if (link(tmpfn, fn) < 0)
+                                srv_log(xs_fmt("link(%s, %s) error", tmpfn, fn));
+
+                            cnt++;
+                        }
 
-                    user_free(&user);
+                        user_free(&user);
+                    }
                 }
-            }
 
-            unlink(tmpfn);
+                unlink(tmpfn);
 
-            if (cnt == 0) {
-                srv_debug(1, xs_fmt("no valid recipients for %s", xs_dict_get(msg, "id")));
+                if (cnt == 0) {
+                    srv_debug(1, xs_fmt("no valid recipients for %s", xs_dict_get(msg, "id")));
+                }
             }
         }
+
+        input_journal_done(q_item);
     }
     else
         srv_log(xs_fmt("unexpected q_item type '%s'", type));
@@ -2740,12 +2944,20 @@ int process_queue(void)
     const xs_str *fn;
 
     while (xs_list_iter(&p, &fn)) {
-        xs *q_item = dequeue(fn);
+        xs *q_item = queue_get(fn);
 
-        if (q_item != NULL) {
-            job_post(q_item, 0);
-            cnt++;
+        if (q_item == NULL) {
+            /* unreadable: just delete it */
+            unlink(fn);
+            continue;
         }
+
+        /* if the job fifo is full, leave the rest for the next round */
+        if (!job_post(q_item, 0))
+            break;
+
+        unlink(fn);
+        cnt++;
     }
 
     return cnt;
@@ -2807,7 +3019,7 @@ int migrate_account(snac *user)
 /** HTTP handlers */
 
 int activitypub_get_handler(const xs_dict *req, const char *q_path,
-                            char **body, int *b_size, char **ctype)
+                            char **body, int *b_size, char **ctype, xs_str **etag)
 {
     int status = HTTP_STATUS_OK;
     const char *accept = xs_dict_get(req, "accept");
@@ -2837,15 +3049,33 @@ int activitypub_get_handler(const xs_dict *req, const char *q_path,
     *ctype  = "application/activity+json";
 
     int show_contact_metrics = xs_is_true(xs_dict_get(snac.config, "show_contact_metrics"));
+    const char *inm = xs_dict_get(req, "if-none-match");
 
     if (p_path == NULL) {
         /* if there was no component after the user, it's an actor request */
-        msg = msg_actor(&snac);
+        xs *fns = xs_list_new();
+        xs *fn1 = xs_fmt("%s/user.json", snac.basedir);
+        xs *fn2 = xs_fmt("%s/user_o.json", snac.basedir);
+        xs *fn3 = xs_fmt("%s/key.json", snac.basedir);
+
+        fns = xs_list_append(fns, fn1, fn2, fn3);
+        *etag = files_etag(fns, NULL, "actor");
+
         *ctype = "application/ld+json; profile=\"https://www.w3.org/ns/activitystreams\"";
 
         const char *ua = xs_dict_get(req, "user-agent");
 
-        snac_debug(&snac, 0, xs_fmt("serving actor [%s]", ua ? ua : "No UA"));
+        if (!xs_is_null(inm) && strcmp(inm, *etag) == 0) {
+            /* the requester already has the newest version */
+            status = HTTP_STATUS_NOT_MODIFIED;
+
+            snac_debug(&snac, 1, xs_fmt("actor not modified [%s]", ua ? ua : "No UA"));
+        }
+        else {
+            msg = msg_actor(&snac);
+
+            snac_debug(&snac, 0, xs_fmt("serving actor [%s]", ua ? ua : "No UA"));
+        }
     }
     else
     if (strcmp(p_path, "outbox") == 0 || strcmp(p_path, "featured") == 0) {
@@ -2857,7 +3087,16 @@ int activitypub_get_handler(const xs_dict *req, const char *q_path,
         /* get the public outbox or the pinned list */
         xs *elems = *p_path == 'o' ? timeline_simple_list(&snac, "public", 0, 20) : pinned_list(&snac);
 
-        while (xs_list_next(elems, &v, &tc)) {
+        /* the etag covers the index and the listed objects */
+        xs *fns = xs_list_new();
+        xs *ifn = user_index_fn(&snac, *p_path == 'o' ? "public" : "pinned");
+        fns = xs_list_append(fns, ifn);
+        *etag = files_etag(fns, elems, p_path);
+
+        if (!xs_is_null(inm) && strcmp(inm, *etag) == 0)
+            status = HTTP_STATUS_NOT_MODIFIED;
+
+        while (status == HTTP_STATUS_OK && xs_list_next(elems, &v, &tc)) {
             xs *i = NULL;
 
             if (valid_status(object_get_by_md5(v, &i))) {
@@ -2871,9 +3110,11 @@ int activitypub_get_handler(const xs_dict *req, const char *q_path,
             }
         }
 
-        /* replace the 'orderedItems' with the latest posts */
-        msg = msg_collection(&snac, id, xs_list_len(list));
-        msg = xs_dict_set(msg, "orderedItems", list);
+        if (status == HTTP_STATUS_OK) {
+            /* replace the 'orderedItems' with the latest posts */
+            msg = msg_collection(&snac, id, xs_list_len(list));
+            msg = xs_dict_set(msg, "orderedItems", list);
+        }
     }
     else
     if (strcmp(p_path, "followers") == 0) {
@@ -2953,11 +3194,10 @@ int activitypub_post_handler(const xs_dict *req, const char *q_path,
         xs_str_in(i_ctype, "application/ld+json") == -1)
         return 0;
 
-    /* decode the message */
-    xs *msg = xs_json_loads(payload);
-    const char *id = xs_dict_get(msg, "id");
+    /* peek into the fields needed for triage before decoding the full message */
+    xs *hdr = xs_json_loads_fields(payload, "id", "type", "actor");
 
-    if (msg == NULL) {
+    if (hdr == NULL) {
         srv_log(xs_fmt("activitypub_post_handler JSON error %s", q_path));
 
         srv_archive_error("activitypub_post_handler", "JSON error", req, payload);
@@ -2967,7 +3207,9 @@ int activitypub_post_handler(const xs_dict *req, const char *q_path,
         return HTTP_STATUS_BAD_REQUEST;
     }
 
-    if (id && is_instance_blocked(id)) {
+    const char *id = xs_dict_get(hdr, "id");
+
+    if (xs_type(id) == XSTYPE_STRING && is_instance_blocked(id)) {
         srv_debug(1, xs_fmt("full instance block for %s", id));
 
         *body  = xs_str_new("blocked");
@@ -2977,57 +3219,120 @@ int activitypub_post_handler(const xs_dict *req, const char *q_path,
 
     /* get the user and path */
     xs *l = xs_split_n(q_path, "/", 2);
+    int shared = xs_list_len(l) == 2 && strcmp(xs_list_get(l, 1), "shared-inbox") == 0;
 
-    if (xs_list_len(l) == 2 && strcmp(xs_list_get(l, 1), "shared-inbox") == 0) {
-        enqueue_shared_input(msg, req, 0);
-        return HTTP_STATUS_ACCEPTED;
-    }
-
-    if (xs_list_len(l) != 3 || strcmp(xs_list_get(l, 2), "inbox") != 0) {
+    if (!shared && (xs_list_len(l) != 3 || strcmp(xs_list_get(l, 2), "inbox") != 0)) {
         /* strange q_path */
         srv_debug(1, xs_fmt("activitypub_post_handler unsupported path %s", q_path));
         return HTTP_STATUS_NOT_FOUND;
     }
 
     const char *uid = xs_list_get(l, 1);
-    if (!user_open(&snac, uid)) {
+
+    if (!shared && !user_open(&snac, uid)) {
         /* invalid user */
         srv_debug(1, xs_fmt("activitypub_post_handler bad user %s", uid));
         return HTTP_STATUS_NOT_FOUND;
     }
 
-    /* if it has a digest, check it now, because
-       later the payload won't be exactly the same */
-    if ((v = xs_dict_get(req, "digest")) != NULL) {
-        xs *s1 = xs_sha256_base64(payload, p_size);
-        xs *s2 = xs_fmt("SHA-256=%s", s1);
+    /* uninteresting messages are accepted and dropped right now */
+    const char *type = xs_dict_get(hdr, "type");
 
-        if (strcmp(s2, v) != 0) {
-            srv_log(xs_fmt("digest check FAILED"));
+    if (xs_type(type) == XSTYPE_STRING && xs_match(type, IGNORED_ACTIVITY_TYPE)) {
+        srv_debug(1, xs_fmt("activitypub_post_handler ignored message of type '%s'", type));
 
-            *body  = xs_str_new("bad digest");
-            *ctype = "text/plain";
-            status = HTTP_STATUS_BAD_REQUEST;
+        if (!shared)
+            user_free(&snac);
+
+        return HTTP_STATUS_ACCEPTED;
+    }
+
+    /* has this same activity already been verified in this inbox? */
+    xs *dd_key = NULL;
+    xs *dd_chk = NULL;
+
+    if (xs_type(id) == XSTYPE_STRING) {
+        const char *sig = xs_dict_get(req, "signature");
+        const char *signer = "";
+        xs *keyid = NULL;
+
+        if (xs_type(sig) == XSTYPE_STRING && (v = strstr(sig, "keyId=\"")) != NULL) {
+            const char *e = strchr(v + 7, '"');
+
+            if (e != NULL)
+                signer = keyid = xs_str_new_sz(v + 7, e - v - 7);
+        }
+
+        xs *s = xs_fmt("%s %s %s", uid, signer, id);
+        dd_key = xs_md5_hex(s, strlen(s));
+        dd_chk = xs_md5_hex(payload, p_size);
+
+        if (inbox_seen(dd_key, dd_chk, 0)) {
+            srv_debug(1, xs_fmt("activitypub_post_handler duplicated %s", id));
+
+            if (!shared)
+                user_free(&snac);
+
+            return HTTP_STATUS_ACCEPTED;
         }
     }
 
-    /* if the message is from a muted actor, reject it right now */
-    if (!xs_is_null(v = xs_dict_get(msg, "actor")) && *v) {
-        if (is_muted(&snac, v)) {
-            snac_log(&snac, xs_fmt("rejected message from MUTEd actor %s", v));
+    if (!shared) {
+        /* if it has a digest, check it now, because
+           later the payload won't be exactly the same */
+        if ((v = xs_dict_get(req, "digest")) != NULL) {
+            xs *s1 = xs_sha256_base64(payload, p_size);
+            xs *s2 = xs_fmt("SHA-256=%s", s1);
 
-            *body  = xs_str_new("rejected");
-            *ctype = "text/plain";
-            status = HTTP_STATUS_FORBIDDEN;
+            if (strcmp(s2, v) != 0) {
+                srv_log(xs_fmt("digest check FAILED"));
+
+                *body  = xs_str_new("bad digest");
+                *ctype = "text/plain";
+                status = HTTP_STATUS_BAD_REQUEST;
+            }
+        }
+
+        /* if the message is from a muted actor, reject it right now */
+        if (xs_type(v = xs_dict_get(hdr, "actor")) == XSTYPE_STRING && *v) {
+            if (is_muted(&snac, v)) {
+                snac_log(&snac, xs_fmt("rejected message from MUTEd actor %s", v));
+
+                *body  = xs_str_new("rejected");
+                *ctype = "text/plain";
+                status = HTTP_STATUS_FORBIDDEN;
+            }
         }
     }
 
     if (valid_status(status)) {
-        enqueue_input(&snac, msg, req, 0);
-        *ctype = "application/activity+json";
+        /* decode the full message */
+        xs *msg = xs_json_loads(payload);
+
+        if (msg == NULL) {
+            srv_log(xs_fmt("activitypub_post_handler JSON error %s", q_path));
+
+            srv_archive_error("activitypub_post_handler", "JSON error", req, payload);
+
+            *body  = xs_str_new("JSON error");
+            *ctype = "text/plain";
+            status = HTTP_STATUS_BAD_REQUEST;
+        }
+        else
+        if (!enqueue_input_raw(shared ? NULL : &snac, msg, req, payload, p_size, dd_key, dd_chk)) {
+            /* too busy: the sender will retry later */
+            *body  = xs_str_new("busy");
+            *ctype = "text/plain";
+            status = HTTP_STATUS_SERVICE_UNAVAILABLE;
+        }
+        else {
+            if (!shared)
+                *ctype = "application/activity+json";
+        }
     }
 
-    user_free(&snac);
+    if (!shared)
+        user_free(&snac);
 
     return status;
 }
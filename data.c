@@ -5,14 +5,17 @@
 #include "xs_hex.h"
 #include "xs_io.h"
 #include "xs_json.h"
+#include "xs_bin.h"
 #include "xs_openssl.h"
 #include "xs_glob.h"
 #include "xs_set.h"
+#include "xs_hmap.h"
 #include "xs_time.h"
 #include "xs_regex.h"
 #include "xs_match.h"
 #include "xs_unicode.h"
 #include "xs_random.h"
+#include "xs_zlib.h"
 
 #include "snac.h"
 
@@ -22,11 +25,55 @@
 #include <sys/time.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <sys/mman.h>
 
-double disk_layout = 2.7;
+double disk_layout = 2.8;
 
-/* storage serializer */
-pthread_mutex_t data_mutex = {0};
+/* storage serializer (shared with the other processes in multi-process mode) */
+static pthread_mutex_t _data_mutex = {0};
+static pthread_mutex_t *data_mutex = &_data_mutex;
+
+static void data_lock(void)
+{
+#ifdef __linux__
+    /* the owner was a process that died; take it over */
+    if (pthread_mutex_lock(data_mutex) == EOWNERDEAD)
+        pthread_mutex_consistent(data_mutex);
+#else
+    pthread_mutex_lock(data_mutex);
+#endif
+}
+
+
+static void data_unlock(void)
+{
+    pthread_mutex_unlock(data_mutex);
+}
+
+
+int data_mutex_share(void)
+/* moves the storage serializer to memory shared with forked processes */
+{
+    pthread_mutex_t *m = mmap(NULL, sizeof(*m), PROT_READ | PROT_WRITE,
+                              MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+
+    if (m == MAP_FAILED)
+        return 0;
+
+    pthread_mutexattr_t attr;
+
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+#ifdef __linux__
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+#endif
+    pthread_mutex_init(m, &attr);
+    pthread_mutexattr_destroy(&attr);
+
+    data_mutex = m;
+
+    return 1;
+}
 
 int snac_upgrade(xs_str **error);
 
@@ -39,13 +86,19 @@ int srv_open(const char *basedir, int auto_upgrade)
     FILE *f;
     xs_str *error = NULL;
 
-    pthread_mutex_init(&data_mutex, NULL);
+    pthread_mutex_init(data_mutex, NULL);
 
     srv_basedir = xs_str_new(basedir);
 
     if (xs_endswith(srv_basedir, "/"))
         srv_basedir = xs_crop_i(srv_basedir, 0, -1);
 
+    /* keep the hash key, so that the dicts in binary storage
+       don't need to be rehashed after a restart (this must
+       be done before building any dict) */
+    xs *hk_file = xs_fmt("%s/hash.key", srv_basedir);
+    xs_hash_key_file(hk_file);
+
     cfg_file = xs_fmt("%s/server.json", basedir);
 
     if ((f = fopen(cfg_file, "r")) == NULL)
@@ -108,6 +161,9 @@ int srv_open(const char *basedir, int auto_upgrade)
     xs *tmpdir = xs_fmt("%s/tmp", srv_basedir);
     mkdirx(tmpdir);
 
+    xs *reldir = xs_fmt("%s/relation", srv_basedir);
+    mkdirx(reldir);
+
 #ifdef __APPLE__
 /* Apple uses st_atimespec instead of st_atim etc */
 #define st_atim st_atimespec
@@ -183,7 +239,7 @@ void srv_free(void)
     xs_free(srv_config);
     xs_free(srv_baseurl);
 
-    pthread_mutex_destroy(&data_mutex);
+    pthread_mutex_destroy(data_mutex);
 }
 
 
@@ -449,7 +505,7 @@ int index_add_md5(const char *fn, const char *md5)
         return HTTP_STATUS_BAD_REQUEST;
     }
 
-    pthread_mutex_lock(&data_mutex);
+    data_lock();
 
     if ((f = fopen(fn, "a")) != NULL) {
         flock(fileno(f), LOCK_EX);
@@ -463,7 +519,7 @@ int index_add_md5(const char *fn, const char *md5)
     else
         status = HTTP_STATUS_INTERNAL_SERVER_ERROR;
 
-    pthread_mutex_unlock(&data_mutex);
+    data_unlock();
 
     return status;
 }
@@ -483,7 +539,7 @@ int index_del_md5(const char *fn, const char *md5)
     int status = HTTP_STATUS_NOT_FOUND;
     FILE *f;
 
-    pthread_mutex_lock(&data_mutex);
+    data_lock();
 
     if ((f = fopen(fn, "r+")) != NULL) {
         char line[256];
@@ -508,7 +564,7 @@ int index_del_md5(const char *fn, const char *md5)
     else
         status = HTTP_STATUS_GONE;
 
-    pthread_mutex_unlock(&data_mutex);
+    data_unlock();
 
     return status;
 }
@@ -528,7 +584,7 @@ int index_gc(const char *fn)
     FILE *i, *o;
     int gc = -1;
 
-    pthread_mutex_lock(&data_mutex);
+    data_lock();
 
     if ((i = fopen(fn, "r")) != NULL) {
         xs *nfn = xs_fmt("%s.new", fn);
@@ -558,7 +614,7 @@ int index_gc(const char *fn)
         fclose(i);
     }
 
-    pthread_mutex_unlock(&data_mutex);
+    data_unlock();
 
     return gc;
 }
@@ -724,6 +780,36 @@ xs_list *index_list_desc(const char *fn, int skip, int show)
 }
 
 
+/** storage format **/
+
+xs_val *storage_load(FILE *f, const char *fields[])
+/* loads a stored value, either in binary or JSON format
+   (JSON ones are only decoded for fields, if set) */
+{
+    int c = fgetc(f);
+
+    if (c == EOF)
+        return NULL;
+
+    ungetc(c, f);
+
+    if (c == (XS_BIN_MAGIC[0] & 0xff))
+        return xs_bin_load(f);
+
+    return fields ? _xs_json_load_fields(f, fields) : xs_json_load(f);
+}
+
+
+int storage_dump(const xs_val *data, FILE *f)
+/* stores a value, in binary format if so configured */
+{
+    if (xs_is_true(xs_dict_get(srv_config, "binary_storage")))
+        return xs_bin_dump(data, f);
+
+    return xs_json_dump(data, 0, f);
+}
+
+
 /** objects **/
 
 static xs_str *_object_fn_by_md5(const char *md5, const char *func)
@@ -783,7 +869,28 @@ int object_get_by_md5(const char *md5, xs_dict **obj)
     FILE *f;
 
     if ((f = fopen(fn, "r")) != NULL) {
-        *obj = xs_json_load(f);
+        *obj = storage_load(f, NULL);
+        fclose(f);
+
+        if (*obj)
+            status = HTTP_STATUS_OK;
+    }
+    else
+        *obj = NULL;
+
+    return status;
+}
+
+
+int _object_get_by_md5_fields(const char *md5, xs_dict **obj, const char *fields[])
+/* like object_get_by_md5(), but only decoding some top level fields */
+{
+    int status = HTTP_STATUS_NOT_FOUND;
+    xs *fn     = _object_fn_by_md5(md5, "object_get_by_md5_fields");
+    FILE *f;
+
+    if ((f = fopen(fn, "r")) != NULL) {
+        *obj = storage_load(f, fields);
         fclose(f);
 
         if (*obj)
@@ -824,7 +931,7 @@ int _object_add(const char *id, const xs_dict *obj, int ow)
     if ((f = fopen(fn, "w")) != NULL) {
         flock(fileno(f), LOCK_EX);
 
-        xs_json_dump(obj, 4, f);
+        storage_dump(obj, f);
         fclose(f);
 
         /* does this object has a parent? */
@@ -1151,6 +1258,8 @@ int follower_add(snac *snac, const char *actor)
 {
     int ret = object_user_cache_add(snac, actor, "followers");
 
+    relation_add(snac, actor);
+
     snac_debug(snac, 2, xs_fmt("follower_add %s", actor));
 
     return ret == -1 ? HTTP_STATUS_INTERNAL_SERVER_ERROR : HTTP_STATUS_OK;
@@ -1162,6 +1271,8 @@ int follower_del(snac *snac, const char *actor)
 {
     int ret = object_user_cache_del(snac, actor, "followers");
 
+    relation_del(snac, actor);
+
     snac_debug(snac, 2, xs_fmt("follower_del %s", actor));
 
     return ret == -1 ? HTTP_STATUS_NOT_FOUND : HTTP_STATUS_OK;
@@ -1188,7 +1299,7 @@ xs_list *follower_list(snac *snac)
     while (xs_list_iter(&p, &v)) {
         xs *a_obj = NULL;
 
-        if (valid_status(object_get_by_md5(v, &a_obj))) {
+        if (valid_status(object_get_by_md5_fields(v, &a_obj, "id"))) {
             const char *actor = xs_dict_get(a_obj, "id");
 
             if (!xs_is_null(actor)) {
@@ -1220,7 +1331,7 @@ int pending_add(snac *user, const char *actor, const xs_dict *msg)
     if ((f = fopen(fn, "w")) == NULL)
         return -1;
 
-    xs_json_dump(msg, 4, f);
+    xs_json_dump(msg, 0, f);
     fclose(f);
 
     return 0;
@@ -1351,7 +1462,7 @@ int timeline_get_by_md5(snac *snac, const char *md5, xs_dict **msg)
     xs *fn = timeline_fn_by_md5(snac, md5);
 
     if (fn != NULL && (f = fopen(fn, "r")) != NULL) {
-        *msg = xs_json_load(f);
+        *msg = storage_load(f, NULL);
         fclose(f);
 
         if (*msg != NULL)
@@ -1436,10 +1547,12 @@ int timeline_admire(snac *snac, const char *id, const char *admirer, int like)
 xs_list *timeline_top_level(snac *snac, const xs_list *list)
 /* returns the top level md5 entries from this index */
 {
-    xs_set seen;
+    xs_list *r = xs_list_new();
+    xs_hmap seen;
     const xs_str *v;
 
-    xs_set_init(&seen);
+    /* keyed by the md5 text, without the terminator */
+    xs_hmap_init(&seen, MD5_HEX_SIZE - 1, 0);
 
     int c = 0;
     while (xs_list_next(list, &v, &c)) {
@@ -1462,10 +1575,14 @@ xs_list *timeline_top_level(snac *snac, const xs_list *list)
             strncpy(line, line2, sizeof(line));
         }
 
-        xs_set_add(&seen, line);
+        /* keep it if it's new */
+        if (xs_hmap_add(&seen, line))
+            r = xs_list_append(r, line);
     }
 
-    return xs_set_result(&seen);
+    xs_hmap_free(&seen);
+
+    return r;
 }
 
 
@@ -1552,7 +1669,7 @@ int following_add(snac *snac, const char *actor, const xs_dict *msg)
     }
 
     if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(msg, 4, f);
+        xs_json_dump(msg, 0, f);
         fclose(f);
 
         /* get the filename of the actor object */
@@ -1561,6 +1678,8 @@ int following_add(snac *snac, const char *actor, const xs_dict *msg)
         /* increase its reference count */
         fn = xs_replace_i(fn, ".json", "_a.json");
         link(actor_fn, fn);
+
+        relation_add(snac, actor);
     }
     else
         ret = HTTP_STATUS_INTERNAL_SERVER_ERROR;
@@ -1584,6 +1703,8 @@ int following_del(snac *snac, const char *actor)
     fn = xs_replace_i(fn, ".json", "_a.json");
     unlink(fn);
 
+    relation_del(snac, actor);
+
     return HTTP_STATUS_OK;
 }
 
@@ -1661,6 +1782,88 @@ xs_list *following_list(snac *snac)
 }
 
 
+/** relations **/
+
+/* an instance-wide reverse index from remote actors to the local users
+   that follow them or are followed by them, used to avoid opening
+   every user when redistributing messages from the shared inbox */
+
+xs_str *_relation_dir(const char *actor)
+{
+    xs *md5 = xs_md5_hex(actor, strlen(actor));
+    return xs_fmt("%s/relation/%s", srv_basedir, md5);
+}
+
+
+void relation_add(snac *user, const char *actor)
+/* marks this user as related to actor */
+{
+    xs *dir = _relation_dir(actor);
+    xs *fn  = xs_fmt("%s/%s", dir, user->uid);
+    FILE *f;
+
+    data_lock();
+
+    mkdirx(dir);
+
+    if ((f = fopen(fn, "w")) != NULL)
+        fclose(f);
+
+    data_unlock();
+}
+
+
+void relation_del(snac *user, const char *actor)
+/* unmarks this user as related to actor, unless still following or followed */
+{
+    xs *dir = _relation_dir(actor);
+    xs *fn  = xs_fmt("%s/%s", dir, user->uid);
+
+    data_lock();
+
+    /* checked with the lock held, so that a concurrent
+       relation_add() is not undone */
+    if (!follower_check(user, actor) && !following_check(user, actor)) {
+        unlink(fn);
+
+        /* fails if other users are still related */
+        rmdir(dir);
+    }
+
+    data_unlock();
+}
+
+
+void relation_purge(snac *user)
+/* unmarks this user as related to anyone (when it's deleted) */
+{
+    xs *spec = xs_fmt("%s/relation/" "*/%s", srv_basedir, user->uid);
+    xs *list = xs_glob(spec, 0, 0);
+    const char *fn;
+
+    data_lock();
+
+    xs_list_foreach(list, fn) {
+        xs *dir = xs_fmt("%.*s", (int)(strrchr(fn, '/') - fn), fn);
+
+        unlink(fn);
+        rmdir(dir);
+    }
+
+    data_unlock();
+}
+
+
+xs_list *relation_list(const char *actor)
+/* returns the list of uids of the local users related to actor */
+{
+    xs *dir  = _relation_dir(actor);
+    xs *spec = xs_fmt("%s/" "*", dir);
+
+    return xs_glob(spec, 1, 0);
+}
+
+
 xs_str *_muted_fn(snac *snac, const char *actor)
 {
     xs *md5 = xs_md5_hex(actor, strlen(actor));
@@ -1878,7 +2081,7 @@ void hide(snac *snac, const char *id)
             xs *co = NULL;
 
             /* resolve to get the id */
-            if (valid_status(object_get_by_md5(v, &co))) {
+            if (valid_status(object_get_by_md5_fields(v, &co, "id"))) {
                 const char *id = xs_dict_get(co, "id");
                 if (id != NULL)
                     hide(snac, id);
@@ -2299,8 +2502,8 @@ void list_distribute(snac *user, const char *who, const xs_dict *post)
 /** static data **/
 
 static int _load_raw_file(const char *fn, xs_val **data, int *size,
-                        const char *inm, xs_str **etag)
-/* loads a cached file */
+                        const char *inm, xs_str **etag, xs_str **file)
+/* loads a cached file (or just returns its name, if file is set) */
 {
     int status = HTTP_STATUS_NOT_FOUND;
 
@@ -2316,6 +2519,12 @@ static int _load_raw_file(const char *fn, xs_val **data, int *size,
                 /* client has the newest version */
                 status = HTTP_STATUS_NOT_MODIFIED;
             }
+            else
+            if (file != NULL) {
+                /* newer or never downloaded; the caller will send it */
+                *file  = xs_dup(fn);
+                status = HTTP_STATUS_OK;
+            }
             else {
                 /* newer or never downloaded; read the full file */
                 FILE *f;
@@ -2341,6 +2550,67 @@ static int _load_raw_file(const char *fn, xs_val **data, int *size,
 }
 
 
+xs_str *files_etag(const xs_list *fns, const xs_list *md5s, const char *extra)
+/* builds a weak etag from the mtimes and sizes of a set of files
+   and of the objects in md5s, with their like, announce and
+   children indexes (either can be NULL) */
+{
+    const char *sfxs[] = { ".json", "_l.idx", "_a.idx", "_c.idx", NULL };
+    xs *s = xs_fmt("%ld %s", p_state ? (long)p_state->srv_start_time : 0L, extra ? extra : "");
+    const char *v;
+    struct stat st;
+
+    xs_list_foreach(fns, v) {
+        if (stat(v, &st) == 0) {
+            xs *t = xs_fmt(" %ld.%09ld:%ld", (long)st.st_mtim.tv_sec,
+                            (long)st.st_mtim.tv_nsec, (long)st.st_size);
+            s = xs_str_cat(s, t);
+        }
+        else
+            s = xs_str_cat(s, " -");
+    }
+
+    xs_list_foreach(md5s, v) {
+        xs *o_fn = _object_fn_by_md5(v, "files_etag");
+        int n;
+
+        for (n = 0; sfxs[n]; n++) {
+            xs *fn = xs_replace(o_fn, ".json", sfxs[n]);
+
+            if (stat(fn, &st) == 0) {
+                xs *t = xs_fmt(" %ld.%09ld", (long)st.st_mtim.tv_sec, (long)st.st_mtim.tv_nsec);
+                s = xs_str_cat(s, t);
+            }
+            else
+                s = xs_str_cat(s, " -");
+        }
+    }
+
+    xs *md5 = xs_md5_hex(s, strlen(s));
+    return xs_fmt("W/\"snac-%s\"", md5);
+}
+
+
+xs_str *object_etag(const char *id, const xs_list *fns, const char *extra)
+/* builds a weak etag from an object, its like, announce
+   and children indexes and, optionally, other files */
+{
+    const char *sfxs[] = { ".json", "_l.idx", "_a.idx", "_c.idx", NULL };
+    xs *l = xs_list_new();
+    int n;
+
+    for (n = 0; sfxs[n]; n++) {
+        xs *fn = _object_index_fn(id, sfxs[n]);
+        l = xs_list_append(l, fn);
+    }
+
+    if (fns != NULL)
+        l = xs_list_cat(l, fns);
+
+    return files_etag(l, NULL, extra);
+}
+
+
 xs_str *_static_fn(snac *snac, const char *id)
 /* gets the filename for a static file */
 {
@@ -2357,7 +2627,17 @@ int static_get(snac *snac, const char *id, xs_val **data, int *size,
 {
     xs *fn = _static_fn(snac, id);
 
-    return _load_raw_file(fn, data, size, inm, etag);
+    return _load_raw_file(fn, data, size, inm, etag, NULL);
+}
+
+
+int static_file(snac *snac, const char *id, xs_str **file,
+                const char *inm, xs_str **etag)
+/* returns the file name of static content, to be sent as is */
+{
+    xs *fn = _static_fn(snac, id);
+
+    return _load_raw_file(fn, NULL, NULL, inm, etag, file);
 }
 
 
@@ -2452,6 +2732,18 @@ void history_add(snac *snac, const char *id, const char *content, int size,
             double tm = mtime(fn);
             *etag = xs_fmt("W/\"snac-%.0lf\"", tm);
         }
+
+        /* store a gzipped copy alongside, so that it's compressed only once */
+        xs *gz_fn = xs_fmt("%s.gz", fn);
+        int z_size;
+        xs *z = xs_zlib_deflate(content, size, 1, &z_size);
+
+        if (z != NULL && (f = fopen(gz_fn, "w")) != NULL) {
+            fwrite(z, z_size, 1, f);
+            fclose(f);
+        }
+        else
+            unlink(gz_fn);
     }
 }
 
@@ -2461,7 +2753,102 @@ int history_get(snac *snac, const char *id, xs_str **content, int *size,
 {
     xs *fn = _history_fn(snac, id);
 
-    return _load_raw_file(fn, content, size, inm, etag);
+    return _load_raw_file(fn, content, size, inm, etag, NULL);
+}
+
+
+int history_file(snac *snac, const char *id, xs_str **file,
+                const char *inm, xs_str **etag)
+/* returns the file name of a history entry, to be sent as is */
+{
+    xs *fn = _history_fn(snac, id);
+
+    return _load_raw_file(fn, NULL, NULL, inm, etag, file);
+}
+
+
+/* history entries being regenerated right now */
+#define HISTORY_REGEN_MAX 16
+
+static pthread_mutex_t history_regen_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t history_regen_cond   = PTHREAD_COND_INITIALIZER;
+static char history_regen_keys[HISTORY_REGEN_MAX][MD5_HEX_SIZE];
+
+static int _history_regen_find(const char *md5)
+{
+    int n;
+
+    for (n = 0; n < HISTORY_REGEN_MAX; n++) {
+        if (strcmp(history_regen_keys[n], md5) == 0)
+            return n;
+    }
+
+    return -1;
+}
+
+
+int history_regen_start(snac *snac, const char *id)
+/* marks a history entry as being regenerated. Returns 1 if the caller
+   must rebuild it, or 0 if another thread is already doing it; in that
+   case, if there is no previous version to serve, waits until it's done */
+{
+    xs *fn = _history_fn(snac, id);
+
+    if (fn == NULL)
+        return 1;
+
+    xs *md5 = xs_md5_hex(fn, strlen(fn));
+    int ret = 1;
+
+    pthread_mutex_lock(&history_regen_mutex);
+
+    if (_history_regen_find(md5) != -1) {
+        ret = 0;
+
+        if (mtime(fn) == 0.0) {
+            struct timespec ts;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 10;
+
+            while (_history_regen_find(md5) != -1 &&
+                   pthread_cond_timedwait(&history_regen_cond, &history_regen_mutex, &ts) == 0);
+        }
+    }
+    else {
+        /* take a free slot; if there is none, just don't coordinate */
+        int n = _history_regen_find("");
+
+        if (n != -1)
+            strcpy(history_regen_keys[n], md5);
+    }
+
+    pthread_mutex_unlock(&history_regen_mutex);
+
+    return ret;
+}
+
+
+void history_regen_end(snac *snac, const char *id)
+/* the history entry is rebuilt; wakes up the waiters */
+{
+    xs *fn = _history_fn(snac, id);
+
+    if (fn == NULL)
+        return;
+
+    xs *md5 = xs_md5_hex(fn, strlen(fn));
+
+    pthread_mutex_lock(&history_regen_mutex);
+
+    int n = _history_regen_find(md5);
+
+    if (n != -1) {
+        history_regen_keys[n][0] = '\0';
+        pthread_cond_broadcast(&history_regen_cond);
+    }
+
+    pthread_mutex_unlock(&history_regen_mutex);
 }
 
 
@@ -2469,8 +2856,12 @@ int history_del(snac *snac, const char *id)
 {
     xs *fn = _history_fn(snac, id);
 
-    if (fn)
+    if (fn) {
+        xs *gz_fn = xs_fmt("%s.gz", fn);
+        unlink(gz_fn);
+
         return unlink(fn);
+    }
     else
         return -1;
 }
@@ -2731,7 +3122,9 @@ xs_list *content_search(snac *user, const char *regex,
 
         xs *post = NULL;
 
-        if (!valid_status(object_get_by_md5(md5, &post)))
+        /* the searchable fields only */
+        if (!valid_status(object_get_by_md5_fields(md5, &post,
+                "type", "id", "content", "name", "attachment")))
             continue;
 
         if (!xs_match(xs_dict_get_def(post, "type", "-"), POSTLIKE_OBJECT_TYPE))
@@ -2851,7 +3244,7 @@ void notify_add(snac *snac, const char *type, const char *utype,
         noti = xs_dict_append(noti, "objid", objid);
 
     if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(noti, 4, f);
+        xs_json_dump(noti, 0, f);
         fclose(f);
     }
 
@@ -2859,14 +3252,14 @@ void notify_add(snac *snac, const char *type, const char *utype,
     xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
 
     if (mtime(idx) != 0.0) {
-        pthread_mutex_lock(&data_mutex);
+        data_lock();
 
         if ((f = fopen(idx, "a")) != NULL) {
             fprintf(f, "%-32s\n", ntid);
             fclose(f);
         }
 
-        pthread_mutex_unlock(&data_mutex);
+        data_unlock();
     }
 }
 
@@ -2902,7 +3295,7 @@ xs_list *notify_list(snac *snac, int skip, int show)
         /* create the index from scratch */
         FILE *f;
 
-        pthread_mutex_lock(&data_mutex);
+        data_lock();
 
         if ((f = fopen(idx, "w")) != NULL) {
             xs *spec = xs_fmt("%s/notify/" "*.json", snac->basedir);
@@ -2921,7 +3314,7 @@ xs_list *notify_list(snac *snac, int skip, int show)
             fclose(f);
         }
 
-        pthread_mutex_unlock(&data_mutex);
+        data_unlock();
     }
 
     return index_list_desc(idx, skip, show);
@@ -2966,9 +3359,9 @@ void notify_clear(snac *snac)
     xs *idx = xs_fmt("%s/notify.idx", snac->basedir);
 
     if (mtime(idx) != 0.0) {
-        pthread_mutex_lock(&data_mutex);
+        data_lock();
         truncate(idx, 0);
-        pthread_mutex_unlock(&data_mutex);
+        data_unlock();
     }
 }
 
@@ -2982,7 +3375,7 @@ static xs_dict *_enqueue_put(const char *fn, xs_dict *msg)
     FILE *f;
 
     if ((f = fopen(tfn, "w")) != NULL) {
-        xs_json_dump(msg, 4, f);
+        storage_dump(msg, f);
         fclose(f);
 
         rename(tfn, fn);
@@ -3040,6 +3433,290 @@ void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries)
 }
 
 
+/** input journal **/
+
+/* input messages just received from the inboxes are not written to the
+   disk queue, but posted as jobs with the message already parsed; to
+   survive crashes, the raw payload and the request are first appended
+   to a journal, which is replayed on startup. Journals are organized in
+   segments that are truncated or deleted when all their messages are done;
+   meanwhile, the offsets of the done ones are appended to a side file,
+   so that a replay skips them */
+
+#define JOURNAL_SEGMENTS 8
+#define JOURNAL_SEGMENT_SIZE (4 * 1024 * 1024)
+
+static pthread_mutex_t journal_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int journal_fd  = -1;
+static int journal_seq = 0;
+static int journal_pending[JOURNAL_SEGMENTS] = {0};
+
+
+static xs_str *_journal_fn(int seq)
+{
+    /* the pid avoids clashes with other processes in multi-process mode */
+    return xs_fmt("%s/queue/input_%d_%d.jnl", srv_basedir, (int)getpid(), seq);
+}
+
+
+static void _journal_mark_done(const char *fn, int off)
+/* records the message at this offset of a segment as done */
+{
+    xs *d_fn = xs_replace(fn, ".jnl", ".done");
+    xs *line = xs_fmt("%d\n", off);
+    int fd;
+
+    if ((fd = open(d_fn, O_WRONLY | O_CREAT | O_APPEND, 0660)) != -1) {
+        write(fd, line, strlen(line));
+        close(fd);
+    }
+}
+
+
+static int _journal_replay(const char *fn)
+/* moves the messages left in a journal segment to the disk queue */
+{
+    xs *d_fn = xs_replace(fn, ".jnl", ".done");
+    xs_hmap done;
+    FILE *f, *f2;
+    int cnt = 0;
+
+    if ((f = fopen(fn, "r")) == NULL)
+        return 0;
+
+    /* load the offsets of the messages already done */
+    xs_hmap_init(&done, sizeof(int), 0);
+
+    if ((f2 = fopen(d_fn, "r")) != NULL) {
+        int off;
+
+        while (fscanf(f2, "%d", &off) == 1)
+            xs_hmap_add(&done, &off);
+
+        fclose(f2);
+    }
+
+    for (;;) {
+        int off = ftell(f);
+        xs *hdr = xs_strip_i(xs_readline(f));
+        xs *l   = xs_split(hdr, " ");
+
+        if (xs_list_len(l) != 3)
+            break;
+
+        int jsz = atoi(xs_list_get(l, 1));
+        int psz = atoi(xs_list_get(l, 2));
+        int rj  = jsz;
+        int rp  = psz + 1;
+        xs *j   = xs_read(f, &rj);
+        xs *pl  = xs_read(f, &rp);
+
+        /* truncated record? */
+        if (rj != jsz || rp != psz + 1)
+            break;
+
+        pl[psz] = '\0';
+
+        if (xs_hmap_get(&done, &off))
+            continue;
+
+        xs *req = xs_json_loads(j);
+        xs *msg = xs_json_loads(pl);
+
+        if (req == NULL || msg == NULL)
+            continue;
+
+        const char *uid = xs_list_get(l, 0);
+        snac user;
+
+        if (strcmp(uid, "shared-inbox") == 0)
+            enqueue_shared_input(msg, req, 0);
+        else
+        if (user_open(&user, uid)) {
+            enqueue_input(&user, msg, req, 0);
+            user_free(&user);
+        }
+
+        /* a crash in the middle of the replay must not repeat it */
+        _journal_mark_done(fn, off);
+
+        cnt++;
+    }
+
+    xs_hmap_free(&done);
+
+    fclose(f);
+    unlink(fn);
+    unlink(d_fn);
+
+    return cnt;
+}
+
+
+static int _journal_write(const char *uid, const xs_dict *req, const char *payload, int p_size,
+                          int *off)
+/* appends an input message to the journal; returns its segment
+   (and its offset inside it), or -1 */
+{
+    xs *j   = xs_json_dumps(req, 0);
+    xs *hdr = xs_fmt("%s %d %d\n", uid, (int)strlen(j), p_size);
+    int hsz = strlen(hdr);
+    int jsz = strlen(j);
+    int sz  = hsz + jsz + p_size + 1;
+    int seq = -1;
+
+    /* build the full record, to write it at once */
+    xs *rec = xs_realloc(NULL, sz);
+    memcpy(rec, hdr, hsz);
+    memcpy(rec + hsz, j, jsz);
+    memcpy(rec + hsz + jsz, payload, p_size);
+    rec[sz - 1] = '\n';
+
+    pthread_mutex_lock(&journal_mutex);
+
+    /* too big? start a new segment */
+    if (journal_fd != -1 && lseek(journal_fd, 0, SEEK_END) > JOURNAL_SEGMENT_SIZE) {
+        close(journal_fd);
+        journal_fd = -1;
+        journal_seq++;
+    }
+
+    /* open the segment, unless its slot is still busy with an old one */
+    if (journal_fd == -1 && journal_pending[journal_seq % JOURNAL_SEGMENTS] == 0) {
+        xs *fn = _journal_fn(journal_seq);
+
+        /* if it's there, it was left by a dead process with the same pid */
+        if ((journal_fd = open(fn, O_WRONLY | O_CREAT | O_APPEND | O_EXCL, 0660)) == -1 &&
+            errno == EEXIST) {
+            srv_log(xs_fmt("_journal_write %d messages recovered from %s",
+                _journal_replay(fn), fn));
+
+            journal_fd = open(fn, O_WRONLY | O_CREAT | O_APPEND | O_EXCL, 0660);
+        }
+    }
+
+    if (journal_fd != -1 && (*off = lseek(journal_fd, 0, SEEK_END)) != -1 &&
+        write(journal_fd, rec, sz) == sz) {
+        seq = journal_seq;
+        journal_pending[seq % JOURNAL_SEGMENTS]++;
+    }
+
+    pthread_mutex_unlock(&journal_mutex);
+
+    return seq;
+}
+
+
+void input_journal_done(const xs_dict *q_item)
+/* marks a journaled input message as processed */
+{
+    const char *v = xs_dict_get(q_item, "journal");
+
+    if (xs_type(v) != XSTYPE_NUMBER)
+        return;
+
+    int seq = xs_number_get(v);
+    int off = xs_number_get(xs_dict_get(q_item, "journal_off"));
+    xs *fn  = _journal_fn(seq);
+    xs *d_fn = xs_replace(fn, ".jnl", ".done");
+
+    pthread_mutex_lock(&journal_mutex);
+
+    if (--journal_pending[seq % JOURNAL_SEGMENTS] == 0) {
+        if (seq == journal_seq) {
+            /* current segment: just empty it */
+            if (journal_fd != -1)
+                ftruncate(journal_fd, 0);
+        }
+        else
+            unlink(fn);
+
+        unlink(d_fn);
+    }
+    else
+        _journal_mark_done(fn, off);
+
+    pthread_mutex_unlock(&journal_mutex);
+}
+
+
+int input_journal_replay(int pid)
+/* moves the messages left in the journal to the disk queue
+   (only those of a dead process, if pid is set) */
+{
+    xs *spec = pid ? xs_fmt("%s/queue/input_%d_" "*.jnl", srv_basedir, pid) :
+                     xs_fmt("%s/queue/" "*.jnl", srv_basedir);
+    xs *list = xs_glob(spec, 0, 0);
+    const char *fn;
+    int cnt = 0;
+
+    xs_list_foreach(list, fn)
+        cnt += _journal_replay(fn);
+
+    if (cnt)
+        srv_log(xs_fmt("input_journal_replay %d messages recovered", cnt));
+
+    return cnt;
+}
+
+
+int enqueue_input_raw(snac *user, const xs_dict *msg, const xs_dict *req,
+                      const char *payload, int p_size,
+                      const char *dd_key, const char *dd_chk)
+/* enqueues a just received input message (user is NULL for the shared inbox);
+   dd_key and dd_chk, if set, go along to mark it as seen once verified */
+/* returns 0 if the job fifo is full and the message must be rejected */
+{
+    int seq = -1;
+    int off = 0;
+
+    /* only the running server can process jobs */
+    if (p_state != NULL)
+        seq = _journal_write(user ? user->uid : "shared-inbox", req, payload, p_size, &off);
+
+    if (seq == -1) {
+        /* use the disk queue */
+        if (user)
+            enqueue_input(user, msg, req, 0);
+        else
+            enqueue_shared_input(msg, req, 0);
+
+        return 1;
+    }
+
+    xs *qmsg = _new_qmsg("input", msg, 0);
+    xs *ns   = xs_number_new(seq);
+    xs *no   = xs_number_new(off);
+
+    qmsg = xs_dict_append(qmsg, "req", req);
+    qmsg = xs_dict_append(qmsg, "journal", ns);
+    qmsg = xs_dict_append(qmsg, "journal_off", no);
+
+    if (dd_key && dd_chk) {
+        qmsg = xs_dict_append(qmsg, "dedupe_key", dd_key);
+        qmsg = xs_dict_append(qmsg, "dedupe_chk", dd_chk);
+    }
+
+    if (user)
+        qmsg = xs_dict_append(qmsg, "uid", user->uid);
+
+    if (!job_post(qmsg, 0)) {
+        /* no room: forget the journal record */
+        input_journal_done(qmsg);
+
+        srv_debug(1, xs_fmt("enqueue_input_raw %s %s rejected (job fifo full)",
+            user ? user->uid : "shared-inbox", xs_dict_get(msg, "id")));
+
+        return 0;
+    }
+
+    srv_debug(1, xs_fmt("enqueue_input_raw %s %s",
+        user ? user->uid : "shared-inbox", xs_dict_get(msg, "id")));
+
+    return 1;
+}
+
+
 void enqueue_output_raw(const char *keyid, const char *seckey,
                         const xs_dict *msg, const xs_str *inbox,
                         int retries, int p_status)
@@ -3056,9 +3733,10 @@ void enqueue_output_raw(const char *keyid, const char *seckey,
     qmsg = xs_dict_append(qmsg, "keyid",  keyid);
     qmsg = xs_dict_append(qmsg, "seckey", seckey);
 
-    /* if it's to be sent right now, bypass the disk queue and post the job */
-    if (retries == 0 && p_state != NULL)
-        job_post(qmsg, 0);
+    /* if it's to be sent right now, bypass the disk queue and post the job
+       (unless the job fifo is full, in which case it goes to disk anyway) */
+    if (retries == 0 && p_state != NULL && job_post(qmsg, 0))
+        srv_debug(2, xs_fmt("enqueue_output (job) %s", inbox));
     else {
         qmsg = _enqueue_put(fn, qmsg);
         srv_debug(1, xs_fmt("enqueue_output %s %s %d", inbox, fn, retries));
@@ -3222,7 +3900,7 @@ int was_question_voted(snac *user, const char *id)
     while (xs_list_iter(&p, &md5)) {
         xs *obj = NULL;
 
-        if (valid_status(object_get_by_md5(md5, &obj))) {
+        if (valid_status(object_get_by_md5_fields(md5, &obj, "attributedTo", "name"))) {
             const char *atto = get_atto(obj);
             if (atto && strcmp(atto, user->actor) == 0 &&
                 !xs_is_null(xs_dict_get(obj, "name"))) {
@@ -3301,7 +3979,7 @@ xs_dict *queue_get(const char *fn)
     xs_dict *obj = NULL;
 
     if ((f = fopen(fn, "r")) != NULL) {
-        obj = xs_json_load(f);
+        obj = storage_load(f, NULL);
         fclose(f);
     }
 
@@ -3566,101 +4244,477 @@ void purge_all(void)
 
 /** archive **/
 
+/* if the archive/ directory exists, the exchanges are appended as binary
+   records to archive/traffic.log; the threads only copy them into a ring
+   and a writer thread does the I/O. See srv_archive_extract(). */
+
+typedef struct {
+    char magic[4];          /* "SNAR" */
+    int size;               /* full record size */
+    double t;               /* time */
+    char dir[8];            /* "RECV" or "SEND" */
+    int status;
+    int url_size;           /* the sizes of what follows, in this order */
+    int req_size;           /* (req and headers are raw xs dicts) */
+    int p_size;
+    int h_size;
+    int b_size;
+} archive_hdr;
+
+#define ARCHIVE_RING_SIZE 1024
+
+static pthread_mutex_t archive_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t archive_cond = PTHREAD_COND_INITIALIZER;
+static char *archive_ring[ARCHIVE_RING_SIZE];
+static unsigned int archive_head = 0;   /* next slot to fill */
+static unsigned int archive_tail = 0;   /* next slot to write */
+static int archive_running = 0;
+static pthread_t archive_thread;
+static unsigned int archive_count = 0;  /* for sampling */
+static time_t archive_checked = 0;
+static int archive_on = 0;
+
+
+static xs_str *_archive_fn(int n)
+/* returns the name of the archive log (or of its n-th rotated copy) */
+{
+    if (n == 0)
+        return xs_fmt("%s/archive/traffic.log", srv_basedir);
+    else
+        return xs_fmt("%s/archive/traffic.log.%d", srv_basedir, n);
+}
+
+
+static void _archive_append(int *fd, const char *r)
+/* appends a record to the log, rotating it when it's too big */
+{
+    const archive_hdr *h = (const archive_hdr *)r;
+    xs *fn = _archive_fn(0);
+    off_t max = (off_t)xs_number_get(xs_dict_get_def(srv_config, "archive_max_size", "64")) * 1024 * 1024;
+    struct stat st;
+
+    if (*fd == -1 && (*fd = open(fn, O_WRONLY | O_APPEND | O_CREAT, 0660)) == -1)
+        return;
+
+    if (max > 0 && fstat(*fd, &st) == 0 && st.st_size > 0 && st.st_size + h->size > max) {
+        int keep = xs_number_get(xs_dict_get_def(srv_config, "archive_keep", "4"));
+        struct stat st2;
+        int n;
+
+        data_lock();
+
+        /* rotate it only if no other process has already done it */
+        if (stat(fn, &st2) == 0 && st2.st_ino == st.st_ino) {
+            for (n = keep - 1; n > 0; n--) {
+                xs *o = _archive_fn(n);
+                xs *d = _archive_fn(n + 1);
+                rename(o, d);
+            }
+
+            if (keep > 0) {
+                xs *d = _archive_fn(1);
+                rename(fn, d);
+            }
+            else
+                unlink(fn);
+        }
+
+        data_unlock();
+
+        close(*fd);
+
+        if ((*fd = open(fn, O_WRONLY | O_APPEND | O_CREAT, 0660)) == -1)
+            return;
+    }
+
+    /* one write, so that records from other processes don't interleave */
+    if (write(*fd, r, h->size) != h->size)
+        srv_debug(1, xs_fmt("_archive_append write error (%s)", strerror(errno)));
+}
+
+
+static void *archive_writer(void *arg)
+/* writes the archive records as the threads leave them in the ring */
+{
+    char *batch[ARCHIVE_RING_SIZE];
+    int fd = -1;
+
+    (void)arg;
+
+    for (;;) {
+        int n = 0, i, running;
+
+        pthread_mutex_lock(&archive_mutex);
+
+        while (archive_head == archive_tail && archive_running)
+            pthread_cond_wait(&archive_cond, &archive_mutex);
+
+        while (archive_tail != archive_head)
+            batch[n++] = archive_ring[archive_tail++ % ARCHIVE_RING_SIZE];
+
+        running = archive_running;
+
+        pthread_mutex_unlock(&archive_mutex);
+
+        for (i = 0; i < n; i++) {
+            _archive_append(&fd, batch[i]);
+            xs_free(batch[i]);
+        }
+
+        if (!running && n == 0)
+            break;
+    }
+
+    if (fd != -1)
+        close(fd);
+
+    return NULL;
+}
+
+
+void srv_archive_start(void)
+/* starts the archive writer thread */
+{
+    archive_running = 1;
+
+    if (pthread_create(&archive_thread, NULL, archive_writer, NULL) != 0)
+        archive_running = 0;
+}
+
+
+void srv_archive_stop(void)
+/* stops the archive writer thread, after writing the pending records */
+{
+    pthread_mutex_lock(&archive_mutex);
+
+    int running = archive_running;
+    archive_running = 0;
+
+    pthread_cond_signal(&archive_cond);
+    pthread_mutex_unlock(&archive_mutex);
+
+    if (running)
+        pthread_join(archive_thread, NULL);
+}
+
+
 void srv_archive(const char *direction, const char *url, xs_dict *req,
                  const char *payload, int p_size,
                  int status, xs_dict *headers,
                  const char *body, int b_size)
-/* archives a connection */
+/* archives an exchange */
+{
+    const xs_list *paths = xs_dict_get(srv_config, "archive_paths");
+    int min_status = xs_number_get(xs_dict_get(srv_config, "archive_min_status"));
+    int sample = xs_number_get(xs_dict_get(srv_config, "archive_sample"));
+    time_t t = time(NULL);
+    int take;
+
+    /* the directory is checked from time to time, not on every call */
+    pthread_mutex_lock(&archive_mutex);
+
+    if (t - archive_checked > 5) {
+        xs *dir = xs_fmt("%s/archive", srv_basedir);
+        archive_on = mtime(dir) > 0.0;
+        archive_checked = t;
+    }
+
+    take = archive_on;
+
+    pthread_mutex_unlock(&archive_mutex);
+
+    if (!take || status < min_status)
+        return;
+
+    if (xs_type(paths) == XSTYPE_LIST) {
+        /* only the exchanges with these path or url prefixes */
+        const char *path = url ? url : xs_dict_get(req, "path");
+        const char *v;
+
+        take = 0;
+
+        xs_list_foreach(paths, v) {
+            if (path && xs_type(v) == XSTYPE_STRING && xs_startswith(path, v)) {
+                take = 1;
+                break;
+            }
+        }
+
+        if (!take)
+            return;
+    }
+
+    if (sample > 1) {
+        pthread_mutex_lock(&archive_mutex);
+        take = archive_count++ % sample == 0;
+        pthread_mutex_unlock(&archive_mutex);
+
+        if (!take)
+            return;
+    }
+
+    /* build the record (just copies) */
+    archive_hdr h = {
+        .magic    = "SNAR",
+        .t        = ftime(),
+        .status   = status,
+        .url_size = url ? strlen(url) + 1 : 0,
+        .req_size = req ? xs_size(req) : 0,
+        .p_size   = payload ? p_size : 0,
+        .h_size   = headers ? xs_size(headers) : 0,
+        .b_size   = body ? b_size : 0,
+    };
+
+    strncpy(h.dir, direction, sizeof(h.dir) - 1);
+    h.size = sizeof(h) + h.url_size + h.req_size + h.p_size + h.h_size + h.b_size;
+
+    /* the record outlives any arena of this thread */
+    int arena = xs_arena_suspend();
+    char *r = xs_realloc(NULL, h.size);
+    xs_arena_resume(arena);
+
+    char *p = r + sizeof(h);
+
+    memcpy(r, &h, sizeof(h));
+    memcpy(p, url, h.url_size);
+    p += h.url_size;
+    memcpy(p, req, h.req_size);
+    p += h.req_size;
+    memcpy(p, payload, h.p_size);
+    p += h.p_size;
+    memcpy(p, headers, h.h_size);
+    p += h.h_size;
+    memcpy(p, body, h.b_size);
+
+    pthread_mutex_lock(&archive_mutex);
+
+    if (archive_running) {
+        if (archive_head - archive_tail < ARCHIVE_RING_SIZE) {
+            archive_ring[archive_head++ % ARCHIVE_RING_SIZE] = r;
+            pthread_cond_signal(&archive_cond);
+            r = NULL;
+        }
+        else
+        if (p_state != NULL)
+            p_state->archive_dropped++;
+
+        pthread_mutex_unlock(&archive_mutex);
+    }
+    else {
+        /* no writer thread (not the httpd): write it right now */
+        int fd = -1;
+
+        _archive_append(&fd, r);
+
+        pthread_mutex_unlock(&archive_mutex);
+
+        if (fd != -1)
+            close(fd);
+    }
+
+    xs_free(r);
+}
+
+
+static void _archive_dump(const char *dir, const char *direction, const char *url,
+                          const xs_dict *req, const char *payload, int p_size,
+                          int status, const xs_dict *headers,
+                          const char *body, int b_size)
+/* dumps an exchange into a directory, one file for each part */
 {
-    /* obsessive archiving */
-    xs *date = tid(0);
-    xs *dir  = xs_fmt("%s/archive/%s_%s", srv_basedir, date, direction);
     FILE *f;
 
-    if (mkdirx(dir) != -1) {
-        xs *meta_fn = xs_fmt("%s/_META", dir);
+    xs *meta_fn = xs_fmt("%s/_META", dir);
+
+    if ((f = fopen(meta_fn, "w")) != NULL) {
+        xs *j1 = xs_json_dumps(req, 4);
+        xs *j2 = xs_json_dumps(headers, 4);
+
+        fprintf(f, "dir: %s\n", direction);
+
+        if (url)
+            fprintf(f, "url: %s\n", url);
+
+        fprintf(f, "req: %s\n", j1);
+        fprintf(f, "p_size: %d\n", p_size);
+        fprintf(f, "status: %d\n", status);
+        fprintf(f, "response: %s\n", j2);
+        fprintf(f, "b_size: %d\n", b_size);
+        fclose(f);
+    }
+
+    if (p_size && payload) {
+        xs *payload_fn = NULL;
+        xs *payload_fn_raw = NULL;
+        const char *v = xs_dict_get(req, "content-type");
 
-        if ((f = fopen(meta_fn, "w")) != NULL) {
-            xs *j1 = xs_json_dumps(req, 4);
-            xs *j2 = xs_json_dumps(headers, 4);
+        if (v && xs_str_in(v, "json") != -1) {
+            payload_fn = xs_fmt("%s/payload.json", dir);
 
-            fprintf(f, "dir: %s\n", direction);
+            if ((f = fopen(payload_fn, "w")) != NULL) {
+                xs *v1 = xs_json_loads(payload);
+                xs *j1 = NULL;
 
-            if (url)
-                fprintf(f, "url: %s\n", url);
+                if (v1 != NULL)
+                    j1 = xs_json_dumps(v1, 4);
 
-            fprintf(f, "req: %s\n", j1);
-            fprintf(f, "p_size: %d\n", p_size);
-            fprintf(f, "status: %d\n", status);
-            fprintf(f, "response: %s\n", j2);
-            fprintf(f, "b_size: %d\n", b_size);
+                if (j1 != NULL)
+                    fwrite(j1, strlen(j1), 1, f);
+                else
+                    fwrite(payload, p_size, 1, f);
+
+                fclose(f);
+            }
+        }
+
+        payload_fn_raw = xs_fmt("%s/payload", dir);
+
+        if ((f = fopen(payload_fn_raw, "w")) != NULL) {
+            fwrite(payload, p_size, 1, f);
             fclose(f);
         }
+    }
 
-        if (p_size && payload) {
-            xs *payload_fn = NULL;
-            xs *payload_fn_raw = NULL;
-            const char *v = xs_dict_get(req, "content-type");
+    if (b_size && body) {
+        xs *body_fn = NULL;
+        const char *v = xs_dict_get(headers, "content-type");
 
-            if (v && xs_str_in(v, "json") != -1) {
-                payload_fn = xs_fmt("%s/payload.json", dir);
+        if (v && xs_str_in(v, "json") != -1) {
+            body_fn = xs_fmt("%s/body.json", dir);
 
-                if ((f = fopen(payload_fn, "w")) != NULL) {
-                    xs *v1 = xs_json_loads(payload);
-                    xs *j1 = NULL;
+            if ((f = fopen(body_fn, "w")) != NULL) {
+                xs *v1 = xs_json_loads(body);
+                xs *j1 = NULL;
 
-                    if (v1 != NULL)
-                        j1 = xs_json_dumps(v1, 4);
+                if (v1 != NULL)
+                    j1 = xs_json_dumps(v1, 4);
 
-                    if (j1 != NULL)
-                        fwrite(j1, strlen(j1), 1, f);
-                    else
-                        fwrite(payload, p_size, 1, f);
+                if (j1 != NULL)
+                    fwrite(j1, strlen(j1), 1, f);
+                else
+                    fwrite(body, b_size, 1, f);
 
-                    fclose(f);
-                }
+                fclose(f);
             }
+        }
+        else {
+            body_fn = xs_fmt("%s/body", dir);
 
-            payload_fn_raw = xs_fmt("%s/payload", dir);
-
-            if ((f = fopen(payload_fn_raw, "w")) != NULL) {
-                fwrite(payload, p_size, 1, f);
+            if ((f = fopen(body_fn, "w")) != NULL) {
+                fwrite(body, b_size, 1, f);
                 fclose(f);
             }
         }
+    }
+}
 
-        if (b_size && body) {
-            xs *body_fn = NULL;
-            const char *v = xs_dict_get(headers, "content-type");
 
-            if (v && xs_str_in(v, "json") != -1) {
-                body_fn = xs_fmt("%s/body.json", dir);
+int srv_archive_extract(int num)
+/* lists the archived exchanges (num == -1) or extracts the num-th
+   into a directory under the current one */
+{
+    int n, k, ret = 1;
 
-                if ((f = fopen(body_fn, "w")) != NULL) {
-                    xs *v1 = xs_json_loads(body);
-                    xs *j1 = NULL;
+    /* find the oldest rotated log */
+    for (k = 1; ; k++) {
+        xs *fn = _archive_fn(k);
 
-                    if (v1 != NULL)
-                        j1 = xs_json_dumps(v1, 4);
+        if (mtime(fn) == 0.0)
+            break;
+    }
 
-                    if (j1 != NULL)
-                        fwrite(j1, strlen(j1), 1, f);
-                    else
-                        fwrite(body, b_size, 1, f);
+    for (n = 0, k--; k >= 0; k--) {
+        xs *fn = _archive_fn(k);
+        FILE *f;
+        struct stat st;
+        archive_hdr h;
+        off_t left;
 
-                    fclose(f);
-                }
+        if ((f = fopen(fn, "r")) == NULL)
+            continue;
+
+        left = fstat(fileno(f), &st) == 0 ? st.st_size : 0;
+
+        /* a torn record at the end (from a crash) is just ignored */
+        while (left >= (off_t)sizeof(h) && fread(&h, sizeof(h), 1, f) == 1) {
+            int size = h.size - sizeof(h);
+
+            left -= sizeof(h);
+            h.dir[sizeof(h.dir) - 1] = '\0';
+
+            if (memcmp(h.magic, "SNAR", 4) != 0 || h.size < (int)sizeof(h)
+                || h.url_size < 0 || h.req_size < 0 || h.p_size < 0
+                || h.h_size < 0 || h.b_size < 0
+                || (long long)h.url_size + h.req_size + h.p_size + h.h_size + h.b_size != size) {
+                fprintf(stderr, "%s: corrupted record\n", fn);
+                break;
             }
-            else {
-                body_fn = xs_fmt("%s/body", dir);
 
-                if ((f = fopen(body_fn, "w")) != NULL) {
-                    fwrite(body, b_size, 1, f);
-                    fclose(f);
+            if (size > left) {
+                fprintf(stderr, "%s: truncated record\n", fn);
+                break;
+            }
+
+            left -= size;
+
+            if (num == -1 || num == n) {
+                xs *data = xs_realloc(NULL, size + 1);
+
+                if (fread(data, size, 1, f) != 1)
+                    break;
+
+                const char *url = h.url_size ? data : NULL;
+                xs_dict *req    = h.req_size ? data + h.url_size : NULL;
+                xs_dict *hdrs   = h.h_size ? data + h.url_size + h.req_size + h.p_size : NULL;
+
+                /* the dicts are raw: check them and rebuild their search
+                   trees, as the hash of the process that wrote them differs */
+                if ((url && memchr(url, '\0', h.url_size) == NULL)
+                    || (req && (xs_type(req) != XSTYPE_DICT || !xs_bin_check(req, h.req_size)))
+                    || (hdrs && (xs_type(hdrs) != XSTYPE_DICT || !xs_bin_check(hdrs, h.h_size)))) {
+                    fprintf(stderr, "%s: corrupted record\n", fn);
+                    break;
+                }
+
+                if (req)
+                    xs_rehash(req);
+                if (hdrs)
+                    xs_rehash(hdrs);
+
+                xs *payload = xs_str_new_sz(data + h.url_size + h.req_size, h.p_size);
+                xs *body    = xs_str_new_sz(data + size - h.b_size, h.b_size);
+                xs *ts      = xs_str_utctime((time_t)h.t, ISO_DATE_SPEC);
+
+                if (num == -1) {
+                    const char *method = req ? xs_dict_get(req, "method") : NULL;
+                    const char *path   = req ? xs_dict_get(req, "path") : NULL;
+
+                    printf("%d %s %s %s %s %d %d %d\n", n, ts, h.dir,
+                        method ? method : "-", url ? url : path ? path : "-",
+                        h.status, h.p_size, h.b_size);
+                }
+                else {
+                    xs *dir = xs_fmt("%.6f_%s", h.t, h.dir);
+
+                    mkdirx(dir);
+
+                    _archive_dump(dir, h.dir, url, req, h.p_size ? payload : NULL, h.p_size,
+                        h.status, hdrs, h.b_size ? body : NULL, h.b_size);
+
+                    printf("%s\n", dir);
+                    ret = 0;
                 }
             }
+            else
+                fseek(f, size, SEEK_CUR);
+
+            n++;
         }
+
+        fclose(f);
     }
+
+    return num == -1 ? 0 : ret;
 }
 
 
@@ -3723,8 +4777,11 @@ t_announcement *announcement(const double after)
         .timestamp = 0.0,
     };
     static xs_str *fn = NULL;
-    if (fn == NULL)
+    if (fn == NULL) {
+        int arena = xs_arena_suspend();
         fn = xs_fmt("%s/announcement.txt", srv_basedir);
+        xs_arena_resume(arena);
+    }
 
     const double ts = mtime(fn);
 
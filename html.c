@@ -2868,7 +2868,7 @@ xs_str *html_notifications(snac *user, int skip, int show)
 
 int html_get_handler(const xs_dict *req, const char *q_path,
                      char **body, int *b_size, char **ctype,
-                     xs_str **etag, xs_str **last_modified)
+                     xs_str **etag, xs_str **last_modified, xs_str **file)
 {
     const char *accept = xs_dict_get(req, "accept");
     int status = HTTP_STATUS_NOT_FOUND;
@@ -2949,6 +2949,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
 
     if (p_path == NULL) { /** public timeline **/
         xs *h = xs_str_localtime(0, "%Y-%m.html");
+        int owner = 0;
 
         if (xs_type(xs_dict_get(snac.config, "private")) == XSTYPE_TRUE) {
             /** empty public timeline for private users **/
@@ -2960,9 +2961,16 @@ int html_get_handler(const xs_dict *req, const char *q_path,
         if (cache && history_mtime(&snac, h) > timeline_mtime(&snac)) {
             snac_debug(&snac, 1, xs_fmt("serving cached local timeline"));
 
-            status = history_get(&snac, h, body, b_size,
+            status = history_file(&snac, h, file,
                         xs_dict_get(req, "if-none-match"), etag);
         }
+        else
+        if (cache && save && (owner = history_regen_start(&snac, h)) == 0 &&
+            (status = history_file(&snac, h, file,
+                        xs_dict_get(req, "if-none-match"), etag)) != HTTP_STATUS_NOT_FOUND) {
+            /* another thread is rebuilding it; serve the previous version */
+            snac_debug(&snac, 1, xs_fmt("serving cached local timeline (being rebuilt)"));
+        }
         else {
             xs *list = NULL;
             xs *next = NULL;
@@ -2984,8 +2992,13 @@ int html_get_handler(const xs_dict *req, const char *q_path,
             *b_size = strlen(*body);
             status  = HTTP_STATUS_OK;
 
-            if (save)
+            if (save) {
                 history_add(&snac, h, *body, *b_size, etag);
+
+                /* only release the mark if this request took it */
+                if (owner)
+                    history_regen_end(&snac, h);
+            }
         }
     }
     else
@@ -3094,7 +3107,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                 if (cache && t > timeline_mtime(&snac) && t > p_state->srv_start_time) {
                     snac_debug(&snac, 1, xs_fmt("serving cached timeline"));
 
-                    status = history_get(&snac, "timeline.html_", body, b_size,
+                    status = history_file(&snac, "timeline.html_", file,
                                 xs_dict_get(req, "if-none-match"), etag);
                 }
                 else {
@@ -3269,16 +3282,13 @@ int html_get_handler(const xs_dict *req, const char *q_path,
     if (xs_startswith(p_path, "s/")) { /** a static file **/
         xs *l    = xs_split(p_path, "/");
         const char *id = xs_list_get(l, 1);
-        int sz;
 
         if (id && *id) {
-            status = static_get(&snac, id, body, &sz,
+            status = static_file(&snac, id, file,
                         xs_dict_get(req, "if-none-match"), etag);
 
-            if (valid_status(status)) {
-                *b_size = sz;
-                *ctype  = (char *)xs_mime_by_ext(id);
-            }
+            if (valid_status(status))
+                *ctype = (char *)xs_mime_by_ext(id);
         }
     }
     else
@@ -3299,7 +3309,7 @@ int html_get_handler(const xs_dict *req, const char *q_path,
                 status = HTTP_STATUS_NOT_FOUND;
             }
             else
-                status = history_get(&snac, id, body, b_size,
+                status = history_file(&snac, id, file,
                             xs_dict_get(req, "if-none-match"), etag);
         }
     }
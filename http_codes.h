@@ -33,6 +33,8 @@ HTTP_STATUS(407, PROXY_AUTHENTICATION_REQUIRED, Proxy Authentication Required)
 HTTP_STATUS(408, REQUEST_TIMEOUT, Request Timeout)
 HTTP_STATUS(409, CONFLICT, Conflict)
 HTTP_STATUS(410, GONE, Gone)
+HTTP_STATUS(413, CONTENT_TOO_LARGE, Content Too Large)
+HTTP_STATUS(416, RANGE_NOT_SATISFIABLE, Range Not Satisfiable)
 HTTP_STATUS(421, MISDIRECTED_REQUEST, Misdirected Request)
 HTTP_STATUS(422, UNPROCESSABLE_CONTENT, Unprocessable Content)
 HTTP_STATUS(499, CLIENT_CLOSED_REQUEST, Client Closed Request)
@@ -12,16 +12,19 @@
 #include "xs_openssl.h"
 #include "xs_fcgi.h"
 #include "xs_html.h"
+#include "xs_zlib.h"
 
 #include "snac.h"
 
 #include <setjmp.h>
 #include <pthread.h>
-#include <semaphore.h>
 #include <fcntl.h>
 #include <stdint.h>
+#include <limits.h>
+#include <sys/stat.h>
 
 #include <sys/resource.h> // for getrlimit()
+#include <sys/wait.h>
 
 #include <sys/mman.h>
 
@@ -29,6 +32,16 @@
 #include <poll.h>
 #endif
 
+#if defined(__linux__) && !defined(WITHOUT_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#ifndef USE_POLL_FOR_SLEEP
+#include <poll.h>
+#endif
+#endif
+
 /** server state **/
 srv_state *p_state = NULL;
 
@@ -38,16 +51,61 @@ srv_state *p_state = NULL;
 /* mutex to access the lists of jobs */
 static pthread_mutex_t job_mutex;
 
-/* semaphore to trigger job processing */
-static sem_t *job_sem;
+/* conditions to trigger job processing (by any thread or by reserved ones) */
+static pthread_cond_t job_cond;
+static pthread_cond_t job_reserved_cond;
+
+/* number of threads waiting on each condition */
+static int job_idle = 0;
+static int job_reserved_idle = 0;
 
 typedef struct job_fifo_item {
     struct job_fifo_item *next;
     xs_val *job;
 } job_fifo_item;
 
-static job_fifo_item *job_fifo_first = NULL;
-static job_fifo_item *job_fifo_last  = NULL;
+/* job classes: connections (and control messages) and queue items */
+enum { JOB_CLASS_CONN, JOB_CLASS_QUEUE, JOB_CLASSES };
+
+typedef struct {
+    job_fifo_item *first;
+    job_fifo_item *last;
+    int size;               /* current number of items */
+    int max;                /* maximum number of items (0, unlimited) */
+} job_fifo;
+
+static job_fifo job_fifos[JOB_CLASSES] = {0};
+
+/* a connection job: this header, followed by the data already read */
+typedef struct {
+    FILE *f;
+    int n_reqs;             /* requests already served in this connection */
+    int r_size;             /* size of the request (0, to be read from f) */
+    struct fcgi_conn *fc;   /* multiplexed FastCGI connection (or NULL) */
+    int fcgi_id;            /* ... and the id of this request */
+    int fcgi_keep;          /* ... and if the connection is to be kept */
+} httpd_job;
+
+/* keep-alive settings */
+static int keep_alive_timeout  = 0;
+static int keep_alive_requests = 0;
+static int keep_alive_max      = 0;
+
+/* maximum size of a request body */
+static int max_request_size = 0;
+
+#ifdef USE_EPOLL
+/* kept-alive connections waiting in the event loop (conn_mutex) */
+static int keep_alive_conns = 0;
+
+static void httpd_conn_resume(FILE *f, int n_reqs, const char *left, int l_size);
+static void httpd_fcgi_respond(const httpd_job *hj, int status, xs_dict *headers,
+                               xs_str *body, int b_size);
+#endif
+
+
+/* seconds to wait when asking clients to retry later */
+#define RETRY_AFTER_SECS "60"
 
 
 /** other global data **/
@@ -265,500 +323,2427 @@ int server_get_handler(xs_dict *req, const char *q_path,
 }
 
 
-void httpd_connection(FILE *f)
-/* the connection processor */
-{
-    xs *req;
-    const char *method;
-    int status   = 0;
-    xs_str *body = NULL;
-    int b_size   = 0;
-    char *ctype  = NULL;
-    xs *headers  = xs_dict_new();
-    xs *q_path   = NULL;
-    xs *payload  = NULL;
-    xs *etag     = NULL;
-    xs *last_modified = NULL;
-    int p_size   = 0;
-    const char *p;
-    int fcgi_id;
-
-    if (p_state->use_fcgi)
-        req = xs_fcgi_request(f, &payload, &p_size, &fcgi_id);
-    else
-        req = xs_httpd_request(f, &payload, &p_size);
-
-    if (req == NULL) {
-        /* probably because a timeout */
-        fclose(f);
-        return;
-    }
+/** request router **/
 
-    if (!(method = xs_dict_get(req, "method")) || !(p = xs_dict_get(req, "path"))) {
-        /* missing needed headers; discard */
-        fclose(f);
-        return;
-    }
+/* methods (HEAD is routed as GET) */
+enum { ROUTE_GET, ROUTE_POST, ROUTE_PUT, ROUTE_PATCH, ROUTE_DELETE, ROUTE_METHODS };
 
-    q_path = xs_dup(p);
+/* request handlers */
+enum {
+    H_NONE,
+    H_SERVER_GET,
+    H_WEBFINGER_GET,
+    H_ACTIVITYPUB_GET,
+    H_HTML_GET,
+    H_ACTIVITYPUB_POST,
+    H_HTML_POST,
+#ifndef NO_MASTODON_API
+    H_OAUTH_GET,
+    H_MASTOAPI_GET,
+    H_OAUTH_POST,
+    H_MASTOAPI_POST,
+    H_MASTOAPI_PUT,
+    H_MASTOAPI_PATCH,
+    H_MASTOAPI_DELETE,
+#endif
+};
+
+#define ROUTE_MAX_HANDLERS 3
+
+typedef struct {
+    int method;
+    const char *path;       /* full path, or prefix if it ends with / * */
+    int handlers[ROUTE_MAX_HANDLERS]; /* tried in order until one answers */
+} httpd_route;
+
+static const httpd_route httpd_routes[] = {
+    { ROUTE_GET,    "",                       { H_SERVER_GET } },
+    { ROUTE_GET,    "/susie.png",             { H_SERVER_GET } },
+    { ROUTE_GET,    "/favicon.ico",           { H_SERVER_GET } },
+    { ROUTE_GET,    "/robots.txt",            { H_SERVER_GET } },
+    { ROUTE_GET,    "/nodeinfo_2_0",          { H_SERVER_GET } },
+    { ROUTE_GET,    "/.well-known/nodeinfo",  { H_SERVER_GET } },
+    { ROUTE_GET,    "/.well-known/host-meta", { H_SERVER_GET } },
+    { ROUTE_GET,    "/.well-known/webfinger", { H_WEBFINGER_GET } },
+#ifndef NO_MASTODON_API
+    { ROUTE_GET,    "/oauth/*",               { H_OAUTH_GET } },
+    { ROUTE_GET,    "/api/v1/*",              { H_MASTOAPI_GET } },
+    { ROUTE_GET,    "/api/v2/*",              { H_MASTOAPI_GET } },
+    { ROUTE_POST,   "/oauth/*",               { H_OAUTH_POST, H_ACTIVITYPUB_POST, H_HTML_POST } },
+    { ROUTE_POST,   "/api/v1/*",              { H_MASTOAPI_POST, H_ACTIVITYPUB_POST, H_HTML_POST } },
+    { ROUTE_POST,   "/api/v2/*",              { H_MASTOAPI_POST, H_ACTIVITYPUB_POST, H_HTML_POST } },
+    { ROUTE_PUT,    "/api/v1/*",              { H_MASTOAPI_PUT } },
+    { ROUTE_PUT,    "/api/v2/*",              { H_MASTOAPI_PUT } },
+    { ROUTE_PATCH,  "/api/v1/*",              { H_MASTOAPI_PATCH } },
+    { ROUTE_DELETE, "/api/v1/*",              { H_MASTOAPI_DELETE } },
+    { ROUTE_DELETE, "/api/v2/*",              { H_MASTOAPI_DELETE } },
+#endif
+    /* everything else is about users */
+    { ROUTE_GET,    "/*",                     { H_ACTIVITYPUB_GET, H_HTML_GET } },
+    { ROUTE_POST,   "/*",                     { H_ACTIVITYPUB_POST, H_HTML_POST } },
+};
 
-    /* crop the q_path from leading / and the prefix */
-    if (xs_endswith(q_path, "/"))
-        q_path = xs_crop_i(q_path, 0, -1);
+#define N_ROUTES (int)(sizeof(httpd_routes) / sizeof(httpd_routes[0]))
 
-    p = xs_dict_get(srv_config, "prefix");
-    if (xs_startswith(q_path, p))
-        q_path = xs_crop_i(q_path, strlen(p), 0);
+/* the routes, compiled as a tree of path segments */
+typedef struct route_node {
+    struct route_node *child;
+    struct route_node *next;
+    const char *seg;
+    int s_size;
+    short exact[ROUTE_METHODS];     /* route for this exact path (+ 1) */
+    short below[ROUTE_METHODS];     /* route for anything below (+ 1) */
+} route_node;
 
-    if (strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0) {
-        /* cascade through */
-        if (status == 0)
-            status = server_get_handler(req, q_path, &body, &b_size, &ctype);
+static route_node route_root = {0};
 
-        if (status == 0)
-            status = webfinger_get_handler(req, q_path, &body, &b_size, &ctype);
+static pthread_mutex_t route_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-        if (status == 0)
-            status = activitypub_get_handler(req, q_path, &body, &b_size, &ctype);
 
-#ifndef NO_MASTODON_API
-        if (status == 0)
-            status = oauth_get_handler(req, q_path, &body, &b_size, &ctype);
+static int httpd_route_method(const char *method)
+/* returns the route method for a request method (-1 if not routed) */
+{
+    const char *methods[] = { "GET", "POST", "PUT", "PATCH", "DELETE" };
+    int n;
 
-        if (status == 0)
-            status = mastoapi_get_handler(req, q_path, &body, &b_size, &ctype);
-#endif /* NO_MASTODON_API */
+    if (strcmp(method, "HEAD") == 0)
+        return ROUTE_GET;
 
-        if (status == 0)
-            status = html_get_handler(req, q_path, &body, &b_size, &ctype, &etag, &last_modified);
+    for (n = 0; n < ROUTE_METHODS; n++) {
+        if (strcmp(method, methods[n]) == 0)
+            return n;
     }
-    else
-    if (strcmp(method, "POST") == 0) {
 
-#ifndef NO_MASTODON_API
-        if (status == 0)
-            status = oauth_post_handler(req, q_path,
-                        payload, p_size, &body, &b_size, &ctype);
-
-        if (status == 0)
-            status = mastoapi_post_handler(req, q_path,
-                        payload, p_size, &body, &b_size, &ctype);
-#endif
-
-        if (status == 0)
-            status = activitypub_post_handler(req, q_path,
-                        payload, p_size, &body, &b_size, &ctype);
+    return -1;
+}
 
-        if (status == 0)
-            status = html_post_handler(req, q_path,
-                        payload, p_size, &body, &b_size, &ctype);
-    }
-    else
-    if (strcmp(method, "PUT") == 0) {
 
-#ifndef NO_MASTODON_API
-        if (status == 0)
-            status = mastoapi_put_handler(req, q_path,
-                        payload, p_size, &body, &b_size, &ctype);
-#endif
+const char *httpd_route_name(int n)
+/* returns a printable name for a route */
+{
+    const char *methods[] = { "GET", "POST", "PUT", "PATCH", "DELETE" };
+    static char name[64];
 
-    }
-    else
-    if (strcmp(method, "PATCH") == 0) {
+    if (n < 0 || n >= N_ROUTES)
+        return "?";
 
-#ifndef NO_MASTODON_API
-        if (status == 0)
-            status = mastoapi_patch_handler(req, q_path,
-                        payload, p_size, &body, &b_size, &ctype);
-#endif
+    snprintf(name, sizeof(name), "%s %s", methods[httpd_routes[n].method],
+        *httpd_routes[n].path ? httpd_routes[n].path : "/");
 
-    }
-    else
-    if (strcmp(method, "OPTIONS") == 0) {
-        const char *methods = "OPTIONS, GET, HEAD, POST, PUT, DELETE";
-        headers = xs_dict_append(headers, "allow", methods);
-        headers = xs_dict_append(headers, "access-control-allow-methods", methods);
-        status = HTTP_STATUS_OK;
-    }
-    else
-    if (strcmp(method, "DELETE") == 0) {
-#ifndef NO_MASTODON_API
-        if (status == 0)
-            status = mastoapi_delete_handler(req, q_path,
-                    payload, p_size, &body, &b_size, &ctype);
-#endif
-    }
+    return name;
+}
 
-    /* unattended? it's an error */
-    if (status == 0) {
-        srv_archive_error("unattended_method", "unattended method", req, payload);
-        srv_debug(1, xs_fmt("httpd_connection unattended %s %s", method, q_path));
-        status = HTTP_STATUS_NOT_FOUND;
-    }
 
-    if (status == HTTP_STATUS_FORBIDDEN)
-        body = xs_str_new("<h1>403 Forbidden</h1>");
+static void httpd_router_init(void)
+/* compiles the route table */
+{
+    int n;
 
-    if (status == HTTP_STATUS_NOT_FOUND)
-        body = xs_str_new("<h1>404 Not Found</h1>");
+    for (n = 0; n < N_ROUTES && n < MAX_ROUTES; n++) {
+        const httpd_route *r = &httpd_routes[n];
+        route_node *node = &route_root;
+        const char *p = r->path;
+        int below = 0;
 
-    if (status == HTTP_STATUS_BAD_REQUEST && body != NULL)
-        body = xs_str_new("<h1>400 Bad Request</h1>");
+        while (*p == '/') {
+            const char *s = p + 1;
+            const char *e = strchr(s, '/');
 
-    if (status == HTTP_STATUS_SEE_OTHER)
-        headers = xs_dict_append(headers, "location", body);
+            if (e == NULL)
+                e = s + strlen(s);
 
-    if (status == HTTP_STATUS_UNAUTHORIZED && body) {
-        xs *www_auth = xs_fmt("Basic realm=\"@%s@%s snac login\"",
-                                body, xs_dict_get(srv_config, "host"));
+            if (e - s == 1 && *s == '*') {
+                below = 1;
+                break;
+            }
 
-        headers = xs_dict_append(headers, "WWW-Authenticate", www_auth);
-        headers = xs_dict_append(headers, "Cache-Control", "no-cache, must-revalidate, max-age=0");
-    }
+            route_node *c;
 
-    if (ctype == NULL)
-        ctype = "text/html; charset=utf-8";
+            for (c = node->child; c; c = c->next) {
+                if (c->s_size == e - s && memcmp(c->seg, s, e - s) == 0)
+                    break;
+            }
 
-    headers = xs_dict_append(headers, "content-type", ctype);
-    headers = xs_dict_append(headers, "x-creator",    USER_AGENT);
+            if (c == NULL) {
+                c = xs_realloc(NULL, sizeof(route_node));
+                *c = (route_node){ .next = node->child, .seg = s, .s_size = e - s };
+                node->child = c;
+            }
 
-    if (!xs_is_null(etag))
-        headers = xs_dict_append(headers, "etag", etag);
-    if (!xs_is_null(last_modified))
-        headers = xs_dict_append(headers, "last-modified", last_modified);
+            node = c;
+            p    = e;
+        }
 
-    /* if there are any additional headers, add them */
-    const xs_dict *more_headers = xs_dict_get(srv_config, "http_headers");
-    if (xs_type(more_headers) == XSTYPE_DICT) {
-        const char *k, *v;
-        int c = 0;
-        while (xs_dict_next(more_headers, &k, &v, &c))
-            headers = xs_dict_set(headers, k, v);
+        if (below)
+            node->below[r->method] = n + 1;
+        else
+            node->exact[r->method] = n + 1;
     }
 
-    if (b_size == 0 && body != NULL)
-        b_size = strlen(body);
+    p_state->n_routes = n;
+}
 
-    /* if it was a HEAD, no body will be sent */
-    if (strcmp(method, "HEAD") == 0)
-        body = xs_free(body);
 
-    headers = xs_dict_append(headers, "access-control-allow-origin", "*");
-    headers = xs_dict_append(headers, "access-control-allow-headers", "*");
+static const httpd_route *httpd_route_find(const char *method, const char *q_path, int *idx)
+/* finds the route for a request (NULL if there is none) */
+{
+    int m = httpd_route_method(method);
+    const route_node *node = &route_root;
+    const char *p = q_path;
+    int r = 0;
 
-    if (p_state->use_fcgi)
-        xs_fcgi_response(f, status, headers, body, b_size, fcgi_id);
-    else
-        xs_httpd_response(f, status, http_status_text(status), headers, body, b_size);
+    if (m == -1)
+        return NULL;
 
-    fclose(f);
+    while (node != NULL && *p == '/') {
+        const char *s = p + 1;
+        const char *e = strchr(s, '/');
+        const route_node *c;
 
-    srv_archive("RECV", NULL, req, payload, p_size, status, headers, body, b_size);
+        if (e == NULL)
+            e = s + strlen(s);
 
-    /* JSON validation check */
-    if (!xs_is_null(body) && strcmp(ctype, "application/json") == 0) {
-        xs *j = xs_json_loads(body);
+        /* the deepest prefix route wins */
+        if (node->below[m])
+            r = node->below[m];
 
-        if (j == NULL) {
-            srv_log(xs_fmt("bad JSON"));
-            srv_archive_error("bad_json", "bad JSON", req, body);
+        for (c = node->child; c; c = c->next) {
+            if (c->s_size == e - s && memcmp(c->seg, s, e - s) == 0)
+                break;
         }
+
+        node = c;
+        p    = e;
     }
 
-    xs_free(body);
+    if (node != NULL && *p == '\0' && node->exact[m])
+        r = node->exact[m];
+
+    *idx = r - 1;
+
+    return r ? &httpd_routes[r - 1] : NULL;
 }
 
 
-void job_post(const xs_val *job, int urgent)
-/* posts a job for the threads to process it */
+static void httpd_route_count(int idx, double t)
+/* updates the counters of a route */
 {
-    if (job != NULL) {
-        /* lock the mutex */
-        pthread_mutex_lock(&job_mutex);
+    pthread_mutex_lock(&route_mutex);
 
-        job_fifo_item *i = xs_realloc(NULL, sizeof(job_fifo_item));
-        *i = (job_fifo_item){ NULL, xs_dup(job) };
+    p_state->route_hits[idx]++;
+    p_state->route_time[idx] += t;
 
-        if (job_fifo_first == NULL)
-            job_fifo_first = job_fifo_last = i;
-        else
-        if (urgent) {
-            /* prepend */
-            i->next = job_fifo_first;
-            job_fifo_first = i;
-        }
-        else {
-            /* append */
-            job_fifo_last->next = i;
-            job_fifo_last = i;
-        }
+    pthread_mutex_unlock(&route_mutex);
+}
 
-        p_state->job_fifo_size++;
 
-        if (p_state->job_fifo_size > p_state->peak_job_fifo_size)
-            p_state->peak_job_fifo_size = p_state->job_fifo_size;
+/* bodies smaller than this are not worth compressing */
+#define HTTPD_MIN_COMPRESS_SIZE 1024
 
-        /* unlock the mutex */
-        pthread_mutex_unlock(&job_mutex);
+/* compressed bodies cache, so that repeated ones
+   (actors, collections, etc.) are compressed only once */
+#define ZCACHE_ENTRIES 32
+#define ZCACHE_MAX_SIZE (256 * 1024)
 
-        /* ask for someone to attend it */
-        sem_post(job_sem);
-    }
-}
+typedef struct {
+    char md5[MD5_HEX_SIZE];     /* md5 of the original body */
+    const char *enc;            /* its encoding */
+    xs_str *z;
+    int z_size;
+} zcache_item;
 
+static zcache_item zcache[ZCACHE_ENTRIES];
+static pthread_mutex_t zcache_mutex = PTHREAD_MUTEX_INITIALIZER;
 
-void job_wait(xs_val **job)
-/* waits for an available job */
+
+static int httpd_compressible(const char *ctype)
+/* returns true if this content type is worth compressing */
 {
-    *job = NULL;
+    return xs_startswith(ctype, "text/") || strstr(ctype, "json") ||
+        strstr(ctype, "xml") || strstr(ctype, "javascript");
+}
 
-    if (sem_wait(job_sem) == 0) {
-        /* lock the mutex */
-        pthread_mutex_lock(&job_mutex);
 
-        /* dequeue */
-        job_fifo_item *i = job_fifo_first;
+static const char *httpd_encoding(const char *accept_encoding)
+/* returns the preferred content encoding from an Accept-Encoding header */
+{
+    const char *enc = NULL;
 
-        if (i != NULL) {
-            job_fifo_first = i->next;
+    if (accept_encoding != NULL) {
+        xs *ae = xs_tolower_i(xs_dup(accept_encoding));
+        xs *l  = xs_split(ae, ",");
+        const char *v;
 
-            if (job_fifo_first == NULL)
-                job_fifo_last = NULL;
+        xs_list_foreach(l, v) {
+            xs *e  = xs_strip_i(xs_dup(v));
+            xs *p  = xs_split_n(e, ";", 1);
+            xs *n  = xs_strip_i(xs_dup(xs_list_get(p, 0)));
+            const char *q = xs_list_get(p, 1);
 
-            *job = i->job;
-            xs_free(i);
+            /* explicitly refused? */
+            if (q != NULL && strstr(q, "q=0") && atof(strstr(q, "q=0") + 2) == 0.0)
+                continue;
 
-            p_state->job_fifo_size--;
-        }
+            if (strcmp(n, "gzip") == 0)
+                return "gzip";
 
-        /* unlock the mutex */
-        pthread_mutex_unlock(&job_mutex);
+            if (strcmp(n, "deflate") == 0)
+                enc = "deflate";
+        }
     }
+
+    return enc;
 }
 
 
-static void *job_thread(void *arg)
-/* job thread */
+static xs_dict *httpd_inm_strip(xs_dict *req, const char **enc)
+/* strips the content coding suffix from the If-None-Match etag,
+   as the handlers only know the etags of the plain bodies */
 {
-    int pid = (int)(uintptr_t)arg;
+    const char *encs[] = { "gzip", "deflate", NULL };
+    const char *inm = xs_dict_get(req, "if-none-match");
+    int n;
 
-    srv_debug(1, xs_fmt("job thread %d started", pid));
+    for (n = 0; inm && encs[n]; n++) {
+        xs *sfx = xs_fmt("-%s\"", encs[n]);
 
-    for (;;) {
-        xs *job = NULL;
+        if (xs_endswith(inm, sfx)) {
+            xs *v = xs_fmt("%.*s\"", (int)(strlen(inm) - strlen(sfx)), inm);
 
-        p_state->th_state[pid] = THST_WAIT;
+            req  = xs_dict_set(req, "if-none-match", v);
+            *enc = encs[n];
+            break;
+        }
+    }
 
-        job_wait(&job);
+    return req;
+}
 
-        if (job == NULL) /* corrupted message? */
-            continue;
 
-        if (xs_type(job) == XSTYPE_FALSE) /* special message: exit */
-            break;
-        else
-        if (xs_type(job) == XSTYPE_DATA) {
-            /* it's a socket */
-            FILE *f = NULL;
+static xs_str *httpd_compress(const char *body, int b_size, const char *enc, int *z_size)
+/* compresses a body with the encoding (gzip or deflate) */
+{
+    xs_str *z = NULL;
 
-            p_state->th_state[pid] = THST_IN;
+    if (b_size > ZCACHE_MAX_SIZE)
+        return xs_zlib_deflate(body, b_size, strcmp(enc, "gzip") == 0, z_size);
 
-            xs_data_get(&f, job);
+    xs *md5 = xs_md5_hex(body, b_size);
 
-            if (f != NULL)
-                httpd_connection(f);
-        }
-        else {
-            /* it's a q_item */
-            p_state->th_state[pid] = THST_QUEUE;
+    zcache_item *zi = &zcache[(xs_hash_func(md5, strlen(md5)) + *enc) % ZCACHE_ENTRIES];
 
-            process_queue_item(job);
-        }
+    pthread_mutex_lock(&zcache_mutex);
+
+    if (zi->z != NULL && zi->enc == enc && strcmp(zi->md5, md5) == 0) {
+        /* hit */
+        *z_size = zi->z_size;
+        z = xs_realloc(NULL, zi->z_size + 1);
+        memcpy(z, zi->z, zi->z_size + 1);
     }
 
-    p_state->th_state[pid] = THST_STOP;
+    pthread_mutex_unlock(&zcache_mutex);
 
-    srv_debug(1, xs_fmt("job thread %d stopped", pid));
+    if (z == NULL && (z = xs_zlib_deflate(body, b_size, strcmp(enc, "gzip") == 0, z_size)) != NULL) {
+        int arena = xs_arena_suspend();
+        xs_str *c = xs_realloc(NULL, *z_size + 1);
+        xs_arena_resume(arena);
 
-    return NULL;
-}
+        memcpy(c, z, *z_size + 1);
 
-/* background thread sleep control */
-static pthread_mutex_t sleep_mutex;
-static pthread_cond_t  sleep_cond;
+        pthread_mutex_lock(&zcache_mutex);
 
-static void *background_thread(void *arg)
-/* background thread (queue management and other things) */
-{
-    time_t purge_time;
+        xs_free(zi->z);
+        strcpy(zi->md5, md5);
+        zi->enc    = enc;
+        zi->z      = c;
+        zi->z_size = *z_size;
 
-    (void)arg;
+        pthread_mutex_unlock(&zcache_mutex);
+    }
 
-    /* first purge time */
-    purge_time = time(NULL) + 10 * 60;
+    return z;
+}
 
-    srv_log(xs_fmt("background thread started"));
 
-    while (p_state->srv_running) {
-        time_t t;
-        int cnt = 0;
+/* full responses cache, for the pages and objects of single posts */
+#define RCACHE_ENTRIES 1024
 
-        p_state->th_state[0] = THST_QUEUE;
+typedef struct {
+    char md5[MD5_HEX_SIZE];     /* md5 of the key */
+    xs_str *etag;               /* the etag of the contents */
+    xs_str *ctype;
+    xs_str *body;
+    int b_size;
+    time_t atime;               /* last access time */
+} rcache_item;
 
-        {
-            xs *list = user_list();
-            char *p;
-            const char *uid;
+static rcache_item rcache[RCACHE_ENTRIES];
+static pthread_mutex_t rcache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static int rcache_size     = 0;
+static int rcache_max_size = 0;
 
-            /* process queues for all users */
-            p = list;
-            while (xs_list_iter(&p, &uid)) {
-                snac snac;
 
-                if (user_open(&snac, uid)) {
-                    cnt += process_user_queue(&snac);
-                    user_free(&snac);
-                }
-            }
-        }
+static xs_str *httpd_rcache_key(const xs_dict *req, const char *method,
+                                const char *q_path, xs_str **etag)
+/* returns the response cache key of a request (NULL if it's not
+   cacheable) and sets the etag of its current contents */
+{
+    const char *k, *v;
+    int c = 0;
 
-        /* global queue */
-        cnt += process_queue();
+    if (rcache_max_size == 0)
+        return NULL;
 
-        /* time to purge? */
-        if ((t = time(NULL)) > purge_time) {
-            /* next purge time is tomorrow */
-            purge_time = t + 24 * 60 * 60;
+    if (strcmp(method, "GET") != 0 && strcmp(method, "HEAD") != 0)
+        return NULL;
 
-            xs *q_item = xs_dict_new();
-            q_item = xs_dict_append(q_item, "type", "purge");
-            job_post(q_item, 0);
-        }
+    /* requests with arguments are not cached */
+    if (xs_dict_next(xs_dict_get(req, "q_vars"), &k, &v, &c))
+        return NULL;
 
-        if (cnt == 0) {
-            /* sleep 3 seconds */
+    /* only /{uid}/p/{id} */
+    xs *l = xs_split(q_path, "/");
 
-            p_state->th_state[0] = THST_WAIT;
+    if (xs_list_len(l) != 4 || strcmp(xs_list_get(l, 2), "p") != 0)
+        return NULL;
 
-#ifdef USE_POLL_FOR_SLEEP
-            poll(NULL, 0, 3 * 1000);
-#else
-            struct timespec ts;
+    const char *uid = xs_list_get(l, 1);
 
-            clock_gettime(CLOCK_REALTIME, &ts);
-            ts.tv_sec += 3;
+    if (!validate_uid(uid))
+        return NULL;
 
-            pthread_mutex_lock(&sleep_mutex);
-            while (pthread_cond_timedwait(&sleep_cond, &sleep_mutex, &ts) == 0);
-            pthread_mutex_unlock(&sleep_mutex);
-#endif
-        }
-    }
+    /* the same test as activitypub_get_handler() */
+    const char *accept = xs_dict_get(req, "accept");
+    int ap = accept && (xs_str_in(accept, "application/activity+json") != -1 ||
+                        xs_str_in(accept, "application/ld+json") != -1);
 
-    p_state->th_state[0] = THST_STOP;
+    xs *id   = xs_fmt("%s%s", srv_baseurl, q_path);
+    xs *fns  = xs_list_new();
+    xs *u_fn = xs_fmt("%s/user/%s/user.json", srv_basedir, uid);
+    xs *o_fn = xs_fmt("%s/user/%s/user_o.json", srv_basedir, uid);
+    xs *c_fn = xs_fmt("%s/style.css", srv_basedir);
 
-    srv_log(xs_fmt("background thread stopped"));
+    fns = xs_list_append(fns, u_fn, o_fn, c_fn);
 
-    return NULL;
-}
+    xs_str *key = xs_fmt("%s %s", ap ? "ap" : "html", q_path);
+
+    *etag = object_etag(id, fns, key);
+
+    return key;
+}
+
+
+static int httpd_rcache_get(const char *key, const char *etag, const char *inm,
+                            xs_str **body, int *b_size, xs_str **ctype)
+/* gets a response from the cache (0 if not there) */
+{
+    int status = 0;
+
+    /* the client already has it */
+    if (!xs_is_null(inm) && strcmp(inm, etag) == 0)
+        return HTTP_STATUS_NOT_MODIFIED;
+
+    xs *md5 = xs_md5_hex(key, strlen(key));
+    rcache_item *ri = &rcache[xs_hash_func(md5, strlen(md5)) % RCACHE_ENTRIES];
+
+    pthread_mutex_lock(&rcache_mutex);
+
+    if (ri->body != NULL && strcmp(ri->md5, md5) == 0 && strcmp(ri->etag, etag) == 0) {
+        *body   = xs_str_new_sz(ri->body, ri->b_size);
+        *b_size = ri->b_size;
+        *ctype  = xs_dup(ri->ctype);
+        ri->atime = time(NULL);
+
+        p_state->rcache_hits++;
+        status = HTTP_STATUS_OK;
+    }
+    else
+        p_state->rcache_misses++;
+
+    pthread_mutex_unlock(&rcache_mutex);
+
+    return status;
+}
+
+
+static void httpd_rcache_free(rcache_item *ri)
+/* frees a response cache entry (with the mutex locked) */
+{
+    rcache_size -= ri->b_size;
+
+    xs_free(ri->etag);
+    xs_free(ri->ctype);
+    xs_free(ri->body);
+
+    *ri = (rcache_item){0};
+}
+
+
+static void httpd_rcache_put(const char *key, const char *etag,
+                             const char *body, int b_size, const char *ctype)
+/* stores a response into the cache */
+{
+    /* don't let a single response take a big chunk of the budget */
+    if (b_size > rcache_max_size / 16)
+        return;
+
+    xs *md5 = xs_md5_hex(key, strlen(key));
+    rcache_item *ri = &rcache[xs_hash_func(md5, strlen(md5)) % RCACHE_ENTRIES];
+
+    int arena = xs_arena_suspend();
+    xs_str *c_etag  = xs_dup(etag);
+    xs_str *c_ctype = xs_str_new(ctype);
+    xs_str *c_body  = xs_str_new_sz(body, b_size);
+    xs_arena_resume(arena);
+
+    pthread_mutex_lock(&rcache_mutex);
+
+    httpd_rcache_free(ri);
+
+    /* make room by dropping the least recently used entries */
+    while (rcache_size + b_size > rcache_max_size) {
+        rcache_item *lru = NULL;
+        int n;
+
+        for (n = 0; n < RCACHE_ENTRIES; n++) {
+            if (rcache[n].body != NULL && (lru == NULL || rcache[n].atime < lru->atime))
+                lru = &rcache[n];
+        }
+
+        if (lru == NULL)
+            break;
+
+        httpd_rcache_free(lru);
+    }
+
+    strcpy(ri->md5, md5);
+    ri->etag   = c_etag;
+    ri->ctype  = c_ctype;
+    ri->body   = c_body;
+    ri->b_size = b_size;
+    ri->atime  = time(NULL);
+
+    rcache_size += b_size;
+
+    pthread_mutex_unlock(&rcache_mutex);
+}
+
+
+static int httpd_range(const char *range, int size, int *start, int *end)
+/* parses a Range header for a body of size bytes; returns 1 if it's
+   a valid range, 0 if unsatisfiable, or -1 if it must be ignored */
+{
+    char *p;
+    long a, b;
+
+    /* only single byte ranges are supported */
+    if (!xs_startswith(range, "bytes=") || strchr(range, ',') != NULL)
+        return -1;
+
+    range += 6;
+
+    if (*range == '-') {
+        /* suffix: the last bytes */
+        b = strtol(range + 1, &p, 10);
+
+        if (*p != '\0' || b < 0)
+            return -1;
+
+        if (b == 0 || size == 0)
+            return 0;
+
+        a = b > size ? 0 : size - b;
+        b = size - 1;
+    }
+    else {
+        a = strtol(range, &p, 10);
+
+        if (*p != '-' || a < 0)
+            return -1;
+
+        if (p[1] == '\0')
+            b = size - 1;
+        else {
+            b = strtol(p + 1, &p, 10);
+
+            if (*p != '\0' || b < a)
+                return -1;
+
+            if (b >= size)
+                b = size - 1;
+        }
+
+        if (a >= size)
+            return 0;
+    }
+
+    *start = a;
+    *end   = b;
+
+    return 1;
+}
+
+
+static xs_str *httpd_read_fd(int fd, off_t offset, int size)
+/* reads size bytes from a file */
+{
+    xs_str *data = xs_realloc(NULL, size + 1);
+    int n = 0;
+
+    while (n < size) {
+        ssize_t r = pread(fd, data + n, size - n, offset + n);
+
+        if (r <= 0)
+            break;
+
+        n += r;
+    }
+
+    data[n] = '\0';
+
+    return data;
+}
+
+
+void httpd_connection(const httpd_job *hj, const char *data, int d_size)
+/* the connection processor (data holds the request, if already read) */
+{
+    FILE *f = hj->f;
+    int keep = 0;
+    xs *req;
+    const char *method;
+    int status   = 0;
+    xs_str *body = NULL;
+    int b_size   = 0;
+    xs *i_body   = NULL;
+    int i_size   = 0;
+    char *ctype  = NULL;
+    xs *headers  = xs_dict_new();
+    xs *q_path   = NULL;
+    xs *payload  = NULL;
+    xs *etag     = NULL;
+    xs *last_modified = NULL;
+    xs *rc_key   = NULL;
+    xs *rc_ctype = NULL;
+    int p_size   = 0;
+    xs *b_file   = NULL;
+    int b_fd     = -1;
+    off_t b_off  = 0;
+    const char *enc = NULL;
+    const char *inm_enc = NULL;
+    const char *p;
+    int fcgi_id;
+
+#ifdef USE_EPOLL
+    if (hj->fc != NULL)
+        req = xs_fcgi_request_buf(data, hj->r_size, data + hj->r_size,
+                                  d_size - hj->r_size, &payload, &p_size);
+    else
+#endif
+    if (p_state->use_fcgi)
+        req = xs_fcgi_request(f, &payload, &p_size, &fcgi_id);
+    else
+    if (hj->r_size)
+        req = xs_httpd_request_buf(data, hj->r_size, &payload, &p_size);
+    else
+        req = xs_httpd_request(f, &payload, &p_size);
+
+    if (req != NULL)
+        req = httpd_inm_strip(req, &inm_enc);
+
+    if (req == NULL || !(method = xs_dict_get(req, "method")) || !(p = xs_dict_get(req, "path"))) {
+        /* timeout or missing needed headers; discard */
+#ifdef USE_EPOLL
+        if (hj->fc != NULL)
+            httpd_fcgi_respond(hj, HTTP_STATUS_BAD_REQUEST, headers, NULL, 0);
+        else
+#endif
+            fclose(f);
+
+        return;
+    }
+
+    q_path = xs_dup(p);
+
+    /* crop the q_path from leading / and the prefix */
+    if (xs_endswith(q_path, "/"))
+        q_path = xs_crop_i(q_path, 0, -1);
+
+    p = xs_dict_get(srv_config, "prefix");
+    if (xs_startswith(q_path, p))
+        q_path = xs_crop_i(q_path, strlen(p), 0);
+
+    const httpd_route *route;
+    int r_idx;
+
+    if (strcmp(method, "OPTIONS") == 0) {
+        const char *methods = "OPTIONS, GET, HEAD, POST, PUT, DELETE";
+        headers = xs_dict_append(headers, "allow", methods);
+        headers = xs_dict_append(headers, "access-control-allow-methods", methods);
+        status = HTTP_STATUS_OK;
+    }
+    else
+    if ((rc_key = httpd_rcache_key(req, method, q_path, &etag)) != NULL &&
+        (status = httpd_rcache_get(rc_key, etag, xs_dict_get(req, "if-none-match"),
+                                   &body, &b_size, &rc_ctype)) != 0) {
+        /* served from the response cache */
+        ctype = rc_ctype;
+    }
+    else
+    if ((route = httpd_route_find(method, q_path, &r_idx)) != NULL) {
+        double t = ftime();
+        int n;
+
+        for (n = 0; status == 0 && n < ROUTE_MAX_HANDLERS; n++) {
+            switch (route->handlers[n]) {
+            case H_SERVER_GET:
+                status = server_get_handler(req, q_path, &body, &b_size, &ctype);
+                break;
+
+            case H_WEBFINGER_GET:
+                status = webfinger_get_handler(req, q_path, &body, &b_size, &ctype);
+                break;
+
+            case H_ACTIVITYPUB_GET:
+                status = activitypub_get_handler(req, q_path, &body, &b_size, &ctype, &etag);
+                break;
+
+            case H_HTML_GET:
+                status = html_get_handler(req, q_path, &body, &b_size, &ctype,
+                            &etag, &last_modified, &b_file);
+                break;
+
+            case H_ACTIVITYPUB_POST:
+                status = activitypub_post_handler(req, q_path,
+                            payload, p_size, &body, &b_size, &ctype);
+                break;
+
+            case H_HTML_POST:
+                status = html_post_handler(req, q_path,
+                            payload, p_size, &body, &b_size, &ctype);
+                break;
+
+#ifndef NO_MASTODON_API
+            case H_OAUTH_GET:
+                status = oauth_get_handler(req, q_path, &body, &b_size, &ctype);
+                break;
+
+            case H_MASTOAPI_GET:
+                status = mastoapi_get_handler(req, q_path, &body, &b_size, &ctype, &etag);
+                break;
+
+            case H_OAUTH_POST:
+                status = oauth_post_handler(req, q_path,
+                            payload, p_size, &body, &b_size, &ctype);
+                break;
+
+            case H_MASTOAPI_POST:
+                status = mastoapi_post_handler(req, q_path,
+                            payload, p_size, &body, &b_size, &ctype);
+                break;
+
+            case H_MASTOAPI_PUT:
+                status = mastoapi_put_handler(req, q_path,
+                            payload, p_size, &body, &b_size, &ctype);
+                break;
+
+            case H_MASTOAPI_PATCH:
+                status = mastoapi_patch_handler(req, q_path,
+                            payload, p_size, &body, &b_size, &ctype);
+                break;
+
+            case H_MASTOAPI_DELETE:
+                status = mastoapi_delete_handler(req, q_path,
+                            payload, p_size, &body, &b_size, &ctype);
+                break;
+#endif /* NO_MASTODON_API */
+
+            default:
+                n = ROUTE_MAX_HANDLERS;
+                break;
+            }
+        }
+
+        httpd_route_count(r_idx, ftime() - t);
+    }
+
+    /* unattended? it's an error */
+    if (status == 0) {
+        srv_archive_error("unattended_method", "unattended method", req, payload);
+        srv_debug(1, xs_fmt("httpd_connection unattended %s %s", method, q_path));
+        status = HTTP_STATUS_NOT_FOUND;
+    }
+
+    if (status == HTTP_STATUS_FORBIDDEN)
+        body = xs_str_new("<h1>403 Forbidden</h1>");
+
+    if (status == HTTP_STATUS_NOT_FOUND)
+        body = xs_str_new("<h1>404 Not Found</h1>");
+
+    if (status == HTTP_STATUS_BAD_REQUEST && body != NULL)
+        body = xs_str_new("<h1>400 Bad Request</h1>");
+
+    if (status == HTTP_STATUS_SEE_OTHER)
+        headers = xs_dict_append(headers, "location", body);
+
+    if (status == HTTP_STATUS_SERVICE_UNAVAILABLE)
+        headers = xs_dict_append(headers, "retry-after", RETRY_AFTER_SECS);
+
+    if (status == HTTP_STATUS_UNAUTHORIZED && body) {
+        xs *www_auth = xs_fmt("Basic realm=\"@%s@%s snac login\"",
+                                body, xs_dict_get(srv_config, "host"));
+
+        headers = xs_dict_append(headers, "WWW-Authenticate", www_auth);
+        headers = xs_dict_append(headers, "Cache-Control", "no-cache, must-revalidate, max-age=0");
+    }
+
+    if (ctype == NULL)
+        ctype = "text/html; charset=utf-8";
+
+    headers = xs_dict_append(headers, "content-type", ctype);
+    headers = xs_dict_append(headers, "x-creator",    USER_AGENT);
+
+    if (!xs_is_null(last_modified))
+        headers = xs_dict_append(headers, "last-modified", last_modified);
+
+    /* if there are any additional headers, add them */
+    const xs_dict *more_headers = xs_dict_get(srv_config, "http_headers");
+    if (xs_type(more_headers) == XSTYPE_DICT) {
+        const char *k, *v;
+        int c = 0;
+        while (xs_dict_next(more_headers, &k, &v, &c))
+            headers = xs_dict_set(headers, k, v);
+    }
+
+    if (b_size == 0 && body != NULL)
+        b_size = strlen(body);
+
+    if (rc_key != NULL && rc_ctype == NULL && status == HTTP_STATUS_OK &&
+        body != NULL && b_file == NULL)
+        httpd_rcache_put(rc_key, etag, body, b_size, ctype);
+
+    if ((status == HTTP_STATUS_OK || status == HTTP_STATUS_NOT_MODIFIED) &&
+        httpd_compressible(ctype)) {
+        /* the body depends on what the client accepts */
+        headers = xs_dict_append(headers, "vary", "accept-encoding");
+        enc = httpd_encoding(xs_dict_get(req, "accept-encoding"));
+    }
+
+    if (b_file != NULL) {
+        struct stat st;
+
+        /* use the gzipped copy, if there is a fresh one
+           (but not for ranges, that apply to the original) */
+        if (enc && strcmp(enc, "gzip") == 0 && xs_dict_get(req, "range") == NULL) {
+            xs *gz_fn = xs_fmt("%s.gz", b_file);
+
+            if (mtime(gz_fn) >= mtime(b_file) && (b_fd = open(gz_fn, O_RDONLY)) != -1)
+                headers = xs_dict_append(headers, "content-encoding", enc);
+        }
+
+        if (b_fd == -1)
+            b_fd = open(b_file, O_RDONLY);
+
+        if (b_fd != -1 && fstat(b_fd, &st) != -1)
+            b_size = st.st_size;
+        else {
+            srv_log(xs_fmt("httpd_connection cannot open %s", b_file));
+
+            if (b_fd != -1) {
+                close(b_fd);
+                b_fd = -1;
+            }
+
+            status = HTTP_STATUS_NOT_FOUND;
+            b_size = 0;
+        }
+    }
+    else
+    if (enc && body != NULL && b_size >= HTTPD_MIN_COMPRESS_SIZE) {
+        int z_size;
+        xs_str *z = httpd_compress(body, b_size, enc, &z_size);
+
+        if (z != NULL) {
+            /* the identity body is kept for the archive and the checks */
+            i_body = body;
+            i_size = b_size;
+
+            body   = z;
+            b_size = z_size;
+
+            headers = xs_dict_append(headers, "content-encoding", enc);
+        }
+    }
+
+    if (!xs_is_null(etag)) {
+        /* each content coding is a different representation, so it
+           has its own etag (a 304 is for the one the client has) */
+        const char *e_enc = status == HTTP_STATUS_NOT_MODIFIED ?
+            inm_enc : xs_dict_get(headers, "content-encoding");
+
+        if (e_enc && xs_endswith(etag, "\"")) {
+            xs *e = xs_fmt("%.*s-%s\"", (int)strlen(etag) - 1, etag, e_enc);
+            headers = xs_dict_append(headers, "etag", e);
+        }
+        else
+            headers = xs_dict_append(headers, "etag", etag);
+    }
+
+    if (b_fd != -1 && xs_dict_get(headers, "content-encoding") == NULL) {
+        /* the body is a file: byte ranges can be served */
+        const char *range    = xs_dict_get(req, "range");
+        const char *if_range = xs_dict_get(req, "if-range");
+
+        headers = xs_dict_append(headers, "accept-ranges", "bytes");
+
+        /* ranges only apply if the client's copy is still valid */
+        if (range && (if_range == NULL || (etag && strcmp(if_range, etag) == 0))) {
+            int start, end;
+            int r = httpd_range(range, b_size, &start, &end);
+
+            if (r == 1) {
+                xs *cr = xs_fmt("bytes %d-%d/%d", start, end, b_size);
+                headers = xs_dict_append(headers, "content-range", cr);
+
+                status = HTTP_STATUS_PARTIAL_CONTENT;
+                b_off  = start;
+                b_size = end - start + 1;
+            }
+            else
+            if (r == 0) {
+                xs *cr = xs_fmt("bytes */%d", b_size);
+                headers = xs_dict_append(headers, "content-range", cr);
+
+                status = HTTP_STATUS_RANGE_NOT_SATISFIABLE;
+                b_size = 0;
+                close(b_fd);
+                b_fd = -1;
+            }
+        }
+
+    }
+
+    if (b_fd != -1 && p_state->use_fcgi) {
+        /* FastCGI has no direct path to the socket: read it */
+        body = httpd_read_fd(b_fd, b_off, b_size);
+        close(b_fd);
+        b_fd = -1;
+    }
+
+    /* if it was a HEAD, no body will be sent */
+    if (strcmp(method, "HEAD") == 0) {
+        body   = xs_free(body);
+        i_body = xs_free(i_body);
+
+        if (b_fd != -1) {
+            close(b_fd);
+            b_fd = -1;
+        }
+    }
+
+    headers = xs_dict_append(headers, "access-control-allow-origin", "*");
+    headers = xs_dict_append(headers, "access-control-allow-headers", "*");
+
+#ifdef USE_EPOLL
+    /* only the connections read by the event loop can be kept alive */
+    keep = hj->r_size && hj->fc == NULL && keep_alive_timeout > 0 &&
+        hj->n_reqs + 1 < keep_alive_requests && xs_httpd_keep_alive(req);
+
+    /* too many of them are already waiting? close this one
+       (the count is read unlocked: it's only a limit) */
+    if (keep && keep_alive_conns >= keep_alive_max)
+        keep = 0;
+#endif
+
+#ifdef USE_EPOLL
+    if (hj->fc != NULL)
+        httpd_fcgi_respond(hj, status, headers, body, b_size);
+    else
+#endif
+    if (p_state->use_fcgi)
+        xs_fcgi_response(f, status, headers, body, b_size, fcgi_id);
+    else {
+        headers = xs_dict_append(headers, "connection", keep ? "keep-alive" : "close");
+
+        if (b_fd != -1)
+            xs_httpd_response_fd(f, status, http_status_text(status), headers, b_fd, b_off, b_size);
+        else
+            xs_httpd_response(f, status, http_status_text(status), headers, body, b_size);
+    }
+
+    if (b_fd != -1)
+        close(b_fd);
+
+#ifdef USE_EPOLL
+    if (keep) {
+        /* give it back to the event loop, with any pipelined data */
+        fflush(f);
+        httpd_conn_resume(f, hj->n_reqs + 1, data + hj->r_size, d_size - hj->r_size);
+    }
+    else
+#endif
+    if (f != NULL)
+        fclose(f);
+
+    /* the archive and the checks want the identity body */
+    if (i_body == NULL) {
+        i_body = body;
+        i_size = b_size;
+        body   = NULL;
+    }
+
+    srv_archive("RECV", NULL, req, payload, p_size, status, headers, i_body, i_size);
+
+    /* JSON validation check */
+    if (!xs_is_null(i_body) && strcmp(ctype, "application/json") == 0) {
+        xs *j = xs_json_loads(i_body);
+
+        if (j == NULL) {
+            srv_log(xs_fmt("bad JSON"));
+            srv_archive_error("bad_json", "bad JSON", req, i_body);
+        }
+    }
+
+    xs_free(body);
+}
+
+
+int job_post(const xs_val *job, int urgent)
+/* posts a job for the threads to process it */
+/* returns 0 if the fifo for this class of job is full */
+{
+    int ret = 0;
+
+    if (job != NULL) {
+        xstype t = xs_type(job);
+
+        /* sockets go to the connection fifo; queue items and
+           exit messages (so that they come after all pending
+           queue items) to the queue one */
+        int c = t == XSTYPE_DATA ? JOB_CLASS_CONN : JOB_CLASS_QUEUE;
+        job_fifo *jf = &job_fifos[c];
+
+        /* lock the mutex */
+        pthread_mutex_lock(&job_mutex);
+
+        if (jf->max == 0 || jf->size < jf->max || t == XSTYPE_FALSE) {
+            /* the job outlives any arena of the posting thread */
+            int arena = xs_arena_suspend();
+
+            job_fifo_item *i = xs_realloc(NULL, sizeof(job_fifo_item));
+            *i = (job_fifo_item){ NULL, xs_dup(job) };
+
+            xs_arena_resume(arena);
+
+            if (jf->first == NULL)
+                jf->first = jf->last = i;
+            else
+            if (urgent) {
+                /* prepend */
+                i->next = jf->first;
+                jf->first = i;
+            }
+            else {
+                /* append */
+                jf->last->next = i;
+                jf->last = i;
+            }
+
+            jf->size++;
+
+            p_state->job_fifo_size++;
+            p_state->job_fifo_class_size[c] = jf->size;
+
+            if (p_state->job_fifo_size > p_state->peak_job_fifo_size)
+                p_state->peak_job_fifo_size = p_state->job_fifo_size;
+
+            /* ask for someone to attend it */
+            if (t == XSTYPE_FALSE) {
+                pthread_cond_broadcast(&job_cond);
+                pthread_cond_broadcast(&job_reserved_cond);
+            }
+            else
+            if (c == JOB_CLASS_CONN && job_reserved_idle && !job_idle)
+                pthread_cond_signal(&job_reserved_cond);
+            else
+                pthread_cond_signal(&job_cond);
+
+            ret = 1;
+        }
+        else
+            p_state->job_fifo_rejected++;
+
+        /* unlock the mutex */
+        pthread_mutex_unlock(&job_mutex);
+    }
+
+    return ret;
+}
+
+
+static xs_val *_job_dequeue(int c)
+/* takes the first job from a fifo (job_mutex must be locked) */
+{
+    job_fifo *jf = &job_fifos[c];
+    job_fifo_item *i = jf->first;
+    xs_val *job = NULL;
+
+    if (i != NULL) {
+        jf->first = i->next;
+
+        if (jf->first == NULL)
+            jf->last = NULL;
+
+        job = i->job;
+        xs_free(i);
+
+        jf->size--;
+
+        p_state->job_fifo_size--;
+        p_state->job_fifo_class_size[c] = jf->size;
+    }
+
+    return job;
+}
+
+
+void job_wait(xs_val **job, int reserved)
+/* waits for an available job */
+/* reserved threads only attend connections (and exit messages) */
+{
+    *job = NULL;
+
+    /* lock the mutex */
+    pthread_mutex_lock(&job_mutex);
+
+    for (;;) {
+        job_fifo_item *q = job_fifos[JOB_CLASS_QUEUE].first;
+
+        /* connections first */
+        if ((*job = _job_dequeue(JOB_CLASS_CONN)) != NULL)
+            break;
+
+        if (q != NULL && (!reserved || xs_type(q->job) == XSTYPE_FALSE)) {
+            *job = _job_dequeue(JOB_CLASS_QUEUE);
+
+            /* exit messages left at the head (after the last queue items)
+               must also wake up the reserved threads, that are only
+               signaled when the messages are posted */
+            q = job_fifos[JOB_CLASS_QUEUE].first;
+
+            if (q != NULL && xs_type(q->job) == XSTYPE_FALSE && job_reserved_idle)
+                pthread_cond_broadcast(&job_reserved_cond);
+
+            break;
+        }
+
+        /* nothing to do: wait */
+        if (reserved) {
+            job_reserved_idle++;
+            pthread_cond_wait(&job_reserved_cond, &job_mutex);
+            job_reserved_idle--;
+        }
+        else {
+            job_idle++;
+            pthread_cond_wait(&job_cond, &job_mutex);
+            job_idle--;
+        }
+    }
+
+    /* unlock the mutex */
+    pthread_mutex_unlock(&job_mutex);
+}
+
+
+static void *job_thread(void *arg)
+/* job thread */
+{
+    int pid = (int)(uintptr_t)arg;
+
+    /* the last threads are reserved for connections */
+    int reserved = pid >= p_state->n_threads - p_state->n_reserved_threads;
+
+    /* draw the memory of each job from an arena? */
+    int arena = xs_is_true(xs_dict_get(srv_config, "request_arena"));
+
+    srv_debug(1, xs_fmt("job thread %d started%s", pid, reserved ? " (reserved)" : ""));
+
+    for (;;) {
+        xs *job = NULL;
+
+        p_state->th_state[pid] = THST_WAIT;
+
+        job_wait(&job, reserved);
+
+        if (job == NULL) /* corrupted message? */
+            continue;
+
+        if (xs_type(job) == XSTYPE_FALSE) /* special message: exit */
+            break;
+        else
+        if (xs_type(job) == XSTYPE_DATA) {
+            /* it's a connection, maybe with its request already read */
+            int size = xs_data_size(job);
+            char *data = xs_realloc(NULL, size);
+            httpd_job *hj = (httpd_job *)data;
+
+            p_state->th_state[pid] = THST_IN;
+
+            xs_data_get(data, job);
+
+            if (hj->f != NULL || hj->fc != NULL) {
+                if (arena)
+                    xs_arena_start();
+
+                httpd_connection(hj, data + sizeof(httpd_job), size - sizeof(httpd_job));
+
+                if (arena)
+                    xs_arena_end();
+            }
+
+            xs_free(data);
+        }
+        else {
+            /* it's a q_item */
+            p_state->th_state[pid] = THST_QUEUE;
+
+            if (arena)
+                xs_arena_start();
+
+            process_queue_item(job);
+
+            if (arena)
+                xs_arena_end();
+        }
+    }
+
+    p_state->th_state[pid] = THST_STOP;
+
+    srv_debug(1, xs_fmt("job thread %d stopped", pid));
+
+    return NULL;
+}
+
+/* background thread sleep control */
+static pthread_mutex_t sleep_mutex;
+static pthread_cond_t  sleep_cond;
+
+static void *background_thread(void *arg)
+/* background thread (queue management and other things) */
+{
+    time_t purge_time;
+
+    (void)arg;
+
+    /* first purge time */
+    purge_time = time(NULL) + 10 * 60;
+
+    srv_log(xs_fmt("background thread started"));
+
+    while (p_state->srv_running) {
+        time_t t;
+        int cnt = 0;
+
+        p_state->th_state[0] = THST_QUEUE;
+
+        {
+            xs *list = user_list();
+            char *p;
+            const char *uid;
+
+            /* process queues for all users */
+            p = list;
+            while (xs_list_iter(&p, &uid)) {
+                snac snac;
+
+                if (user_open(&snac, uid)) {
+                    cnt += process_user_queue(&snac);
+                    user_free(&snac);
+                }
+            }
+        }
+
+        /* global queue */
+        cnt += process_queue();
+
+        /* time to purge? */
+        if ((t = time(NULL)) > purge_time) {
+            xs *q_item = xs_dict_new();
+            q_item = xs_dict_append(q_item, "type", "purge");
+
+            /* next purge time is tomorrow (or retry later if it cannot be posted) */
+            if (job_post(q_item, 0))
+                purge_time = t + 24 * 60 * 60;
+        }
+
+        if (cnt == 0) {
+            /* sleep 3 seconds */
+
+            p_state->th_state[0] = THST_WAIT;
+
+#ifdef USE_POLL_FOR_SLEEP
+            poll(NULL, 0, 3 * 1000);
+#else
+            struct timespec ts;
+
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += 3;
+
+            pthread_mutex_lock(&sleep_mutex);
+            while (pthread_cond_timedwait(&sleep_cond, &sleep_mutex, &ts) == 0);
+            pthread_mutex_unlock(&sleep_mutex);
+#endif
+        }
+    }
+
+    p_state->th_state[0] = THST_STOP;
+
+    srv_log(xs_fmt("background thread stopped"));
+
+    return NULL;
+}
 
 
 void term_handler(int s)
 {
-    (void)s;
+    (void)s;
+
+    longjmp(on_break, 1);
+}
+
+
+/* the shared state holds one structure for the whole server
+   and one more for each possible worker process */
+#define SRV_STATE_SIZE (sizeof(srv_state) * (1 + MAX_PROCESSES))
+
+srv_state *srv_state_op(xs_str **fname, int op)
+/* opens or deletes the shared memory object */
+{
+    int fd;
+    srv_state *ss = NULL;
+
+    if (*fname == NULL)
+        *fname = xs_fmt("/%s_snac_state", xs_dict_get(srv_config, "host"));
+
+    switch (op) {
+    case 0: /* open for writing */
+
+#ifdef WITHOUT_SHM
+
+        errno = ENOTSUP;
+
+#else
+
+        if ((fd = shm_open(*fname, O_CREAT | O_RDWR, 0666)) != -1) {
+            ftruncate(fd, SRV_STATE_SIZE);
+
+            if ((ss = mmap(0, SRV_STATE_SIZE, PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0)) == MAP_FAILED)
+                ss = NULL;
+
+            close(fd);
+        }
+
+#endif
+
+        if (ss == NULL) {
+            /* shared memory error: just create a plain structure */
+            srv_log(xs_fmt("warning: shm object error (%s)", strerror(errno)));
+            ss = malloc(SRV_STATE_SIZE);
+        }
+
+        /* init structures (the first one, plus one per worker process) */
+        memset(ss, '\0', SRV_STATE_SIZE);
+        ss->s_size = sizeof(*ss);
+
+        break;
+
+    case 1: /* open for reading */
+
+#ifdef WITHOUT_SHM
+
+        errno = ENOTSUP;
+
+#else
+
+        if ((fd = shm_open(*fname, O_RDONLY, 0666)) != -1) {
+            if ((ss = mmap(0, SRV_STATE_SIZE, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+                ss = NULL;
+
+            close(fd);
+        }
+
+#endif
+
+        if (ss == NULL) {
+            /* shared memory error */
+            srv_log(xs_fmt("error: shm object error (%s) server not running?", strerror(errno)));
+        }
+        else
+        if (ss->s_size != sizeof(*ss)) {
+            srv_log(xs_fmt("error: struct size mismatch (%d != %d)",
+                ss->s_size, sizeof(*ss)));
+
+            munmap(ss, SRV_STATE_SIZE);
+
+            ss = NULL;
+        }
+
+        break;
+
+    case 2: /* unlink */
+
+#ifndef WITHOUT_SHM
+
+        if (*fname)
+            shm_unlink(*fname);
+
+#endif
+
+        break;
+    }
+
+    return ss;
+}
+
+
+static void httpd_post_connection(char *data, int size)
+/* posts a connection job (data starts with an httpd_job header) */
+{
+    httpd_job *hj = (httpd_job *)data;
+    xs *job = xs_data_new(data, size);
+
+    if (!job_post(job, 1)) {
+        /* too many pending connections: tell to come back later */
+#ifdef USE_EPOLL
+        if (hj->fc != NULL) {
+            xs *headers = xs_dict_new();
+            headers = xs_dict_append(headers, "retry-after", RETRY_AFTER_SECS);
+
+            httpd_fcgi_respond(hj, HTTP_STATUS_SERVICE_UNAVAILABLE, headers, NULL, 0);
+            return;
+        }
+#endif
+
+        if (!p_state->use_fcgi) {
+            xs *headers = xs_dict_new();
+            headers = xs_dict_append(headers, "retry-after", RETRY_AFTER_SECS);
+            headers = xs_dict_append(headers, "connection", "close");
+
+            xs_httpd_response(hj->f, HTTP_STATUS_SERVICE_UNAVAILABLE,
+                http_status_text(HTTP_STATUS_SERVICE_UNAVAILABLE), headers, NULL, 0);
+        }
+
+        fclose(hj->f);
+    }
+}
+
+
+static void httpd_accept_loop(int rs)
+/* accepts connections and posts them to be read by the threads */
+{
+    for (;;) {
+        int cs = xs_socket_accept(rs);
+
+        if (cs == -1)
+            break;
+
+        httpd_job hj = { .f = fdopen(cs, "r+") };
+        httpd_post_connection((char *)&hj, sizeof(hj));
+    }
+}
+
+
+#ifdef USE_EPOLL
+
+/* maximum size of a request header */
+#define HTTPD_MAX_HEADER_SIZE (64 * 1024)
+
+/* a multiplexed FastCGI connection, shared by the event loop
+   and the threads writing the responses to its requests */
+typedef struct fcgi_conn {
+    int fd;
+    int refs;               /* the event loop + the requests in process */
+    pthread_mutex_t mutex;  /* to write records and touch refs */
+} fcgi_conn;
+
+/* a FastCGI request whose params or stdin are still being read */
+typedef struct fcgi_pending {
+    struct fcgi_pending *next;
+    int id;
+    int keep;               /* FCGI_KEEP_CONN was set */
+    char *params;
+    int pa_size;
+    char *in;
+    int in_size;
+} fcgi_pending;
+
+/* maximum number of concurrent requests in a FastCGI connection */
+#define FCGI_MAX_REQS 64
+
+/* a connection whose request is still being read */
+typedef struct httpd_conn {
+    struct httpd_conn *prev;
+    struct httpd_conn *next;
+    int fd;
+    FILE *f;            /* the stream, if it was already created */
+    int n_reqs;         /* requests already served in this connection */
+    time_t t;           /* time of the last received data */
+    char *buf;          /* room for an httpd_job header + the request */
+    int b_alloc;        /* allocated size of buf */
+    int size;           /* size of the data read so far */
+    int h_size;         /* size of the header (0 if still incomplete) */
+    int r_size;         /* size of the full request (0 if still unknown) */
+    fcgi_conn *fc;      /* the FastCGI connection (raw records in buf) */
+    fcgi_pending *fp;   /* ... and its requests being received */
+} httpd_conn;
+
+/* the event loop, the connections it watches and their mutex */
+static int httpd_ep = -1;
+static httpd_conn *httpd_conns = NULL;
+static pthread_mutex_t conn_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void _httpd_conn_unlink(httpd_conn *c)
+/* stops watching a connection (conn_mutex must be locked) */
+{
+    epoll_ctl(httpd_ep, EPOLL_CTL_DEL, c->fd, NULL);
+
+    if (c->prev)
+        c->prev->next = c->next;
+    else
+        httpd_conns = c->next;
+
+    if (c->next)
+        c->next->prev = c->prev;
+
+    if (c->n_reqs && c->fc == NULL)
+        keep_alive_conns--;
+
+    p_state->n_open_connections--;
+}
+
+
+static void httpd_conn_post(httpd_conn *c)
+/* posts the request read from a connection to the threads */
+{
+    httpd_job *hj = (httpd_job *)c->buf;
+
+    /* the threads use plain blocking I/O */
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_NONBLOCK);
+
+    *hj = (httpd_job){ .f = c->f ? c->f : fdopen(c->fd, "r+"),
+                       .n_reqs = c->n_reqs, .r_size = c->r_size };
+
+    httpd_post_connection(c->buf, sizeof(httpd_job) + c->size);
+}
+
+
+static void httpd_fcgi_release(fcgi_conn *fc);
+
+static void httpd_conn_free(httpd_conn *c, int close_it)
+/* frees a connection, optionally closing its socket */
+{
+    if (c->fc != NULL) {
+        /* the socket is closed when no request uses it */
+        while (c->fp != NULL) {
+            fcgi_pending *fp = c->fp;
+            c->fp = fp->next;
+
+            xs_free(fp->params);
+            xs_free(fp->in);
+            xs_free(fp);
+        }
+
+        httpd_fcgi_release(c->fc);
+    }
+    else
+    if (close_it) {
+        if (c->f)
+            fclose(c->f);
+        else
+            close(c->fd);
+    }
+
+    xs_free(c->buf);
+    xs_free(c);
+}
+
+
+static int httpd_conn_content_length(const char *h, int h_size)
+/* returns the content-length from a request header (-1 if invalid) */
+{
+    const char *p = h;
+    const char *e = h + h_size;
+
+    while (p < e) {
+        const char *nl = memchr(p, '\n', e - p);
+
+        if (nl == NULL)
+            break;
+
+        if (nl - p > 15 && strncasecmp(p, "content-length:", 15) == 0) {
+            long l = strtol(p + 15, NULL, 10);
+
+            if (l < 0 || l > INT_MAX - HTTPD_MAX_HEADER_SIZE - 64)
+                return -1;
+
+            return (int)l;
+        }
+
+        p = nl + 1;
+    }
+
+    return 0;
+}
+
+
+static int httpd_conn_parse(httpd_conn *c, int from)
+/* checks if the data read so far (new from offset from) holds a full
+   request; returns 1 if complete, 0 if incomplete, or -1 if invalid */
+{
+    if (c->h_size == 0) {
+        /* look for the end of the header */
+        char *r  = c->buf + sizeof(httpd_job);
+        char *e1 = xs_memmem(r + from, c->size - from, "\n\r\n", 3);
+        char *e2 = xs_memmem(r + from, c->size - from, "\n\n", 2);
+
+        if (e1 != NULL && (e2 == NULL || e1 < e2))
+            c->h_size = e1 + 3 - r;
+        else
+        if (e2 != NULL)
+            c->h_size = e2 + 2 - r;
+        else
+            return c->size > HTTPD_MAX_HEADER_SIZE ? -1 : 0;
+
+        int cl = httpd_conn_content_length(r, c->h_size);
+
+        if (cl == -1)
+            return -1;
+
+        if (cl > max_request_size) {
+            /* refuse it before reading (and allocating) the body */
+            xs *rsp = xs_fmt("HTTP/1.1 %d %s\r\ncontent-length: 0\r\nconnection: close\r\n\r\n",
+                HTTP_STATUS_CONTENT_TOO_LARGE, http_status_text(HTTP_STATUS_CONTENT_TOO_LARGE));
+
+            srv_debug(1, xs_fmt("request too large (%d bytes)", cl));
+
+            write(c->fd, rsp, strlen(rsp));
+            return -1;
+        }
+
+        c->r_size = c->h_size + cl;
+    }
+
+    return c->size >= c->r_size;
+}
+
+
+static int httpd_conn_read(httpd_conn *c)
+/* reads what is available from a connection; returns 1 if the request
+   is complete, 0 if more data is needed, or -1 on error or close */
+{
+    for (;;) {
+        int want = c->r_size ? c->r_size - c->size : 4096;
+
+        /* the buffer grows as the data arrives, not to the announced size */
+        if (want > 65536)
+            want = 65536;
+
+        int need = sizeof(httpd_job) + c->size + want;
+
+        if (need > c->b_alloc) {
+            c->b_alloc = c->b_alloc * 2 > need ? c->b_alloc * 2 : need;
+
+            if (c->r_size && c->b_alloc > (int)sizeof(httpd_job) + c->r_size)
+                c->b_alloc = sizeof(httpd_job) + c->r_size;
+
+            c->buf = xs_realloc(c->buf, c->b_alloc);
+        }
+
+        ssize_t n = read(c->fd, c->buf + sizeof(httpd_job) + c->size, want);
+
+        if (n == 0)
+            return -1;
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        c->size += n;
+        c->t     = time(NULL);
+
+        /* the end of the header can start a bit before the new data */
+        int ret = httpd_conn_parse(c, c->size - n > 3 ? c->size - n - 3 : 0);
+
+        if (ret != 0)
+            return ret;
+    }
+}
+
+
+static void httpd_conn_watch(httpd_conn *c)
+/* starts watching a connection for incoming data */
+{
+    struct epoll_event ev = {0};
+
+    fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) | O_NONBLOCK);
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = c;
+
+    pthread_mutex_lock(&conn_mutex);
+
+    if (epoll_ctl(httpd_ep, EPOLL_CTL_ADD, c->fd, &ev) == -1) {
+        pthread_mutex_unlock(&conn_mutex);
+        httpd_conn_free(c, 1);
+        return;
+    }
+
+    c->prev = NULL;
+
+    if ((c->next = httpd_conns) != NULL)
+        c->next->prev = c;
+
+    httpd_conns = c;
+
+    if (c->n_reqs && c->fc == NULL)
+        keep_alive_conns++;
+
+    p_state->n_open_connections++;
+
+    pthread_mutex_unlock(&conn_mutex);
+}
+
+
+static void httpd_conn_resume(FILE *f, int n_reqs, const char *left, int l_size)
+/* takes back a kept-alive connection, with data already read after its
+   last request (from pipelining clients) */
+{
+    /* the connection outlives the request */
+    int arena = xs_arena_suspend();
+
+    httpd_conn *c = xs_realloc(NULL, sizeof(httpd_conn));
+    *c = (httpd_conn){ .fd = fileno(f), .f = f, .n_reqs = n_reqs, .t = time(NULL) };
+
+    if (l_size > 0) {
+        c->b_alloc = sizeof(httpd_job) + l_size;
+        c->buf     = xs_realloc(NULL, c->b_alloc);
+        c->size    = l_size;
+
+        memcpy(c->buf + sizeof(httpd_job), left, l_size);
+
+        int ret = httpd_conn_parse(c, 0);
+
+        if (ret != 0) {
+            /* a full request is already here: no need to wait */
+            if (ret == 1)
+                httpd_conn_post(c);
+
+            httpd_conn_free(c, ret == -1);
+            c = NULL;
+        }
+    }
+
+    if (c != NULL)
+        httpd_conn_watch(c);
+
+    xs_arena_resume(arena);
+}
+
+
+/** multiplexed FastCGI connections **/
+
+static fcgi_conn *httpd_fcgi_new(int fd)
+/* creates a FastCGI connection, referenced by the event loop */
+{
+    fcgi_conn *fc = xs_realloc(NULL, sizeof(fcgi_conn));
+
+    fc->fd   = fd;
+    fc->refs = 1;
+    pthread_mutex_init(&fc->mutex, NULL);
+
+    return fc;
+}
+
+
+static void httpd_fcgi_release(fcgi_conn *fc)
+/* drops a reference to a FastCGI connection, closing it if it was the last */
+{
+    pthread_mutex_lock(&fc->mutex);
+    int refs = --fc->refs;
+    pthread_mutex_unlock(&fc->mutex);
+
+    if (refs == 0) {
+        close(fc->fd);
+        pthread_mutex_destroy(&fc->mutex);
+        xs_free(fc);
+    }
+}
+
+
+static void httpd_fcgi_write(fcgi_conn *fc, const char *buf, int size, int close_it)
+/* writes records to a FastCGI connection, optionally closing it afterwards */
+{
+    pthread_mutex_lock(&fc->mutex);
+
+    while (size > 0) {
+        ssize_t n = write(fc->fd, buf, size);
+
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                /* the socket is non-blocking (it's also being read
+                   by the event loop): wait until it can take more */
+                struct pollfd pfd = { .fd = fc->fd, .events = POLLOUT };
+
+                if (poll(&pfd, 1, 5000) > 0)
+                    continue;
+            }
+
+            /* the web server went away: have the event loop notice */
+            close_it = 1;
+            break;
+        }
+
+        buf  += n;
+        size -= n;
+    }
+
+    /* the event loop will see the end of file and drop its reference */
+    if (close_it)
+        shutdown(fc->fd, SHUT_RDWR);
+
+    pthread_mutex_unlock(&fc->mutex);
+}
+
+
+static void httpd_fcgi_respond(const httpd_job *hj, int status, xs_dict *headers,
+                               xs_str *body, int b_size)
+/* sends the response to a request from a FastCGI connection and
+   drops the reference the request held */
+{
+    int size;
+    xs *buf = xs_fcgi_response_buf(status, headers, body, b_size, hj->fcgi_id, &size);
+
+    httpd_fcgi_write(hj->fc, buf, size, !hj->fcgi_keep);
+    httpd_fcgi_release(hj->fc);
+}
+
+
+static void httpd_fcgi_record_out(httpd_conn *c, int type, int id, const char *content, int c_size)
+/* sends a record to a FastCGI connection from the event loop */
+{
+    int size;
+    xs *buf = xs_fcgi_record_buf(type, id, content, c_size, &size);
+
+    httpd_fcgi_write(c->fc, buf, size, 0);
+}
+
+
+static void httpd_fcgi_end(httpd_conn *c, int id, int protocol_status)
+/* ends a request from the event loop (rejected or aborted) */
+{
+    int size;
+    xs *buf = xs_fcgi_end_request_buf(id, protocol_status, &size);
+
+    httpd_fcgi_write(c->fc, buf, size, 0);
+}
+
+
+static void httpd_fcgi_post(httpd_conn *c, fcgi_pending *fp)
+/* posts a fully received FastCGI request to the threads */
+{
+    int size = sizeof(httpd_job) + fp->pa_size + fp->in_size;
+    char *data = xs_realloc(NULL, size);
+    httpd_job *hj = (httpd_job *)data;
+
+    *hj = (httpd_job){ .r_size = fp->pa_size, .fc = c->fc,
+                       .fcgi_id = fp->id, .fcgi_keep = fp->keep };
+
+    memcpy(data + sizeof(httpd_job), fp->params, fp->pa_size);
+
+    if (fp->in_size)
+        memcpy(data + sizeof(httpd_job) + fp->pa_size, fp->in, fp->in_size);
+
+    /* the request holds a reference until its response is sent */
+    pthread_mutex_lock(&c->fc->mutex);
+    c->fc->refs++;
+    pthread_mutex_unlock(&c->fc->mutex);
+
+    httpd_post_connection(data, size);
+
+    xs_free(data);
+}
+
+
+static char *httpd_fcgi_append(char *buf, int *size, const char *content, int c_size)
+/* appends a record's content to a pending request stream */
+{
+    buf = xs_realloc(buf, *size + c_size);
+    memcpy(buf + *size, content, c_size);
+    *size += c_size;
+
+    return buf;
+}
+
+
+static void httpd_fcgi_values(httpd_conn *c, const char *content, int c_size)
+/* answers a FCGI_GET_VALUES management record */
+{
+    xs *vars = xs_dict_new();
+    xs *n1 = xs_fmt("%d", FCGI_MAX_REQS);
+    xs *n2 = xs_fmt("%d", p_state->n_threads);
+    xs *out = xs_str_new(NULL);
+    int o_size = 0;
+    const unsigned char *p = (const unsigned char *)content;
+    const unsigned char *e = p + c_size;
+
+    vars = xs_dict_append(vars, "FCGI_MAX_CONNS", n2);
+    vars = xs_dict_append(vars, "FCGI_MAX_REQS", n1);
+    vars = xs_dict_append(vars, "FCGI_MPXS_CONNS", "1");
+
+    /* the names come as pairs with empty values (all short) */
+    while (p + 2 <= e && p[0] < 128 && p[1] == 0 && p + 2 + p[0] <= e) {
+        xs *name = xs_str_new_sz((const char *)p + 2, p[0]);
+        const char *value = xs_dict_get(vars, name);
+
+        if (value != NULL) {
+            unsigned char l[2] = { p[0], strlen(value) };
+
+            out = xs_insert_m(out, o_size, (char *)l, 2);
+            o_size += 2;
+            out = xs_insert_m(out, o_size, name, p[0]);
+            o_size += p[0];
+            out = xs_insert_m(out, o_size, value, l[1]);
+            o_size += l[1];
+        }
+
+        p += 2 + p[0];
+    }
+
+    httpd_fcgi_record_out(c, FCGI_GET_VALUES_RESULT, 0, out, o_size);
+}
+
+
+static int httpd_fcgi_process(httpd_conn *c, int type, int id, const char *content, int c_size)
+/* processes a record received from a FastCGI connection;
+   returns 0, or -1 if the connection must be dropped */
+{
+    fcgi_pending *fp, **pfp;
+    int n = 0;
+
+    for (pfp = &c->fp; (fp = *pfp) != NULL; pfp = &fp->next, n++) {
+        if (fp->id == id)
+            break;
+    }
+
+    switch (type) {
+    case FCGI_BEGIN_REQUEST: {
+        struct fcgi_begin_request breq;
+
+        if (id == 0 || fp != NULL || c_size < (int)sizeof(breq))
+            return -1;
+
+        memcpy(&breq, content, sizeof(breq));
+
+        if (ntohs(breq.role) != FCGI_RESPONDER)
+            httpd_fcgi_end(c, id, FCGI_UNKNOWN_ROLE);
+        else
+        if (n >= FCGI_MAX_REQS)
+            httpd_fcgi_end(c, id, FCGI_OVERLOADED);
+        else {
+            fp = xs_realloc(NULL, sizeof(fcgi_pending));
+            *fp = (fcgi_pending){ .next = c->fp, .id = id, .keep = breq.flags & FCGI_KEEP_CONN };
+            c->fp = fp;
+        }
+
+        break;
+    }
+
+    case FCGI_ABORT_REQUEST:
+        /* only the requests still being received can be aborted */
+        if (fp != NULL) {
+            *pfp = fp->next;
+
+            xs_free(fp->params);
+            xs_free(fp->in);
+            xs_free(fp);
+
+            httpd_fcgi_end(c, id, FCGI_REQUEST_COMPLETE);
+        }
+
+        break;
+
+    case FCGI_PARAMS:
+        if (fp != NULL && c_size) {
+            if (fp->pa_size + c_size > HTTPD_MAX_HEADER_SIZE)
+                return -1;
+
+            fp->params = httpd_fcgi_append(fp->params, &fp->pa_size, content, c_size);
+        }
+
+        break;
+
+    case FCGI_STDIN:
+        if (fp != NULL) {
+            if (c_size) {
+                if (fp->in_size > max_request_size - c_size) {
+                    /* too big: answer now and forget the request
+                       (the rest of its records will be ignored) */
+                    int size;
+                    xs *hdrs = xs_dict_new();
+                    xs *buf  = xs_fcgi_response_buf(HTTP_STATUS_CONTENT_TOO_LARGE,
+                                hdrs, NULL, 0, fp->id, &size);
+
+                    srv_debug(1, xs_fmt("FastCGI request too large"));
+
+                    httpd_fcgi_write(c->fc, buf, size, !fp->keep);
+
+                    *pfp = fp->next;
+
+                    xs_free(fp->params);
+                    xs_free(fp->in);
+                    xs_free(fp);
+
+                    break;
+                }
+
+                fp->in = httpd_fcgi_append(fp->in, &fp->in_size, content, c_size);
+            }
+            else {
+                /* an empty stdin record ends the request */
+                *pfp = fp->next;
+
+                httpd_fcgi_post(c, fp);
+
+                xs_free(fp->params);
+                xs_free(fp->in);
+                xs_free(fp);
+            }
+        }
 
-    longjmp(on_break, 1);
+        break;
+
+    case FCGI_GET_VALUES:
+        httpd_fcgi_values(c, content, c_size);
+        break;
+
+    default:
+        if (id == 0) {
+            /* unknown management record */
+            unsigned char unk[8] = { type };
+            httpd_fcgi_record_out(c, FCGI_UNKNOWN_TYPE, 0, (char *)unk, sizeof(unk));
+        }
+
+        break;
+    }
+
+    return 0;
 }
 
 
-srv_state *srv_state_op(xs_str **fname, int op)
-/* opens or deletes the shared memory object */
+static int httpd_fcgi_read(httpd_conn *c)
+/* reads what is available from a FastCGI connection, processing the
+   complete records; returns 0, or -1 on error or close */
 {
-    int fd;
-    srv_state *ss = NULL;
+    for (;;) {
+        if (c->b_alloc - c->size < 16384) {
+            c->b_alloc = c->size + 65536;
+            c->buf = xs_realloc(c->buf, c->b_alloc);
+        }
 
-    if (*fname == NULL)
-        *fname = xs_fmt("/%s_snac_state", xs_dict_get(srv_config, "host"));
+        ssize_t n = read(c->fd, c->buf + c->size, c->b_alloc - c->size);
 
-    switch (op) {
-    case 0: /* open for writing */
+        if (n == 0)
+            return -1;
 
-#ifdef WITHOUT_SHM
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
 
-        errno = ENOTSUP;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
 
-#else
+        c->size += n;
+        c->t     = time(NULL);
 
-        if ((fd = shm_open(*fname, O_CREAT | O_RDWR, 0666)) != -1) {
-            ftruncate(fd, sizeof(*ss));
+        int off = 0;
+        int r, type, id, c_size;
+        const char *content;
 
-            if ((ss = mmap(0, sizeof(*ss), PROT_READ | PROT_WRITE,
-                 MAP_SHARED, fd, 0)) == MAP_FAILED)
-                ss = NULL;
+        while ((r = xs_fcgi_record(c->buf + off, c->size - off, &type, &id, &content, &c_size)) > 0) {
+            if (httpd_fcgi_process(c, type, id, content, c_size) == -1)
+                return -1;
 
-            close(fd);
+            off += r;
         }
 
-#endif
+        if (r == -1)
+            return -1;
 
-        if (ss == NULL) {
-            /* shared memory error: just create a plain structure */
-            srv_log(xs_fmt("warning: shm object error (%s)", strerror(errno)));
-            ss = malloc(sizeof(*ss));
+        /* keep the incomplete record for later */
+        if (off) {
+            memmove(c->buf, c->buf + off, c->size - off);
+            c->size -= off;
         }
+    }
+}
 
-        /* init structure */
-        *ss = (srv_state){0};
-        ss->s_size = sizeof(*ss);
 
-        break;
+static void httpd_event_loop(int rs)
+/* accepts connections and reads their requests without blocking,
+   posting them to the threads only when they are complete */
+{
+    struct epoll_event ev = {0};
+    struct epoll_event evs[64];
+    time_t last_sweep = time(NULL);
 
-    case 1: /* open for reading */
+    if ((httpd_ep = epoll_create1(0)) == -1) {
+        srv_log(xs_fmt("epoll_create1 error (%s); using blocking accept", strerror(errno)));
+        httpd_accept_loop(rs);
+        return;
+    }
 
-#ifdef WITHOUT_SHM
+    fcntl(rs, F_SETFL, fcntl(rs, F_GETFL) | O_NONBLOCK);
 
-        errno = ENOTSUP;
+    /* the listening socket has no connection attached */
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(httpd_ep, EPOLL_CTL_ADD, rs, &ev);
 
-#else
+    for (;;) {
+        int n, i;
 
-        if ((fd = shm_open(*fname, O_RDONLY, 0666)) != -1) {
-            if ((ss = mmap(0, sizeof(*ss), PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
-                ss = NULL;
+        n = epoll_wait(httpd_ep, evs, sizeof(evs) / sizeof(evs[0]), 1000);
 
-            close(fd);
+        if (n == -1) {
+            if (errno == EINTR)
+                continue;
+
+            srv_log(xs_fmt("epoll_wait error (%s)", strerror(errno)));
+            break;
         }
 
-#endif
+        for (i = 0; i < n; i++) {
+            httpd_conn *c = evs[i].data.ptr;
 
-        if (ss == NULL) {
-            /* shared memory error */
-            srv_log(xs_fmt("error: shm object error (%s) server not running?", strerror(errno)));
+            if (c == NULL) {
+                /* new connections */
+                int cs;
+
+                while ((cs = xs_socket_accept(rs)) != -1) {
+                    c = xs_realloc(NULL, sizeof(httpd_conn));
+                    *c = (httpd_conn){ .fd = cs, .t = time(NULL) };
+
+                    if (p_state->use_fcgi)
+                        c->fc = httpd_fcgi_new(cs);
+
+                    httpd_conn_watch(c);
+                }
+
+                if (errno != EAGAIN && errno != EWOULDBLOCK && errno != ECONNABORTED)
+                    srv_debug(1, xs_fmt("accept error (%s)", strerror(errno)));
+            }
+            else {
+                int ret = c->fc ? httpd_fcgi_read(c) : httpd_conn_read(c);
+
+                if (ret != 0) {
+                    pthread_mutex_lock(&conn_mutex);
+                    _httpd_conn_unlink(c);
+                    pthread_mutex_unlock(&conn_mutex);
+
+                    if (ret == 1)
+                        httpd_conn_post(c);
+
+                    httpd_conn_free(c, ret == -1);
+                }
+            }
         }
-        else
-        if (ss->s_size != sizeof(*ss)) {
-            srv_log(xs_fmt("error: struct size mismatch (%d != %d)",
-                ss->s_size, sizeof(*ss)));
 
-            munmap(ss, sizeof(*ss));
+        time_t t = time(NULL);
 
-            ss = NULL;
+        if (t != last_sweep) {
+            /* drop the connections that stopped sending data (the
+               same timeouts used when the threads read the requests,
+               or the keep-alive one if waiting for the next request) */
+            pthread_mutex_lock(&conn_mutex);
+
+            httpd_conn *c = httpd_conns;
+
+            while (c != NULL) {
+                httpd_conn *next = c->next;
+                int tmo = c->h_size ? 5 : c->size || !c->n_reqs ? 2 : keep_alive_timeout;
+
+                /* idle FastCGI connections are kept: the web server
+                   decides when to close them */
+                if (c->fc != NULL)
+                    tmo = c->size || c->fp ? 5 : INT_MAX;
+
+                if (t - c->t > tmo) {
+                    srv_debug(2, xs_fmt("dropped idle connection %d", c->fd));
+
+                    _httpd_conn_unlink(c);
+                    httpd_conn_free(c, 1);
+                }
+
+                c = next;
+            }
+
+            pthread_mutex_unlock(&conn_mutex);
+
+            last_sweep = t;
         }
+    }
 
-        break;
+    close(httpd_ep);
+}
 
-    case 2: /* unlink */
+#endif /* USE_EPOLL */
 
-#ifndef WITHOUT_SHM
 
-        if (*fname)
-            shm_unlink(*fname);
+static void httpd_worker(int rs, int background)
+/* runs the threads and the connection loop of a server process */
+{
+    pthread_t threads[MAX_THREADS] = {0};
+    int n;
+
+    /* show the number of usable file descriptors */
+    struct rlimit r;
+    getrlimit(RLIMIT_NOFILE, &r);
+    srv_debug(1, xs_fmt("available (rlimit) fds: %d (cur) / %d (max)",
+                        (int) r.rlim_cur, (int) r.rlim_max));
 
+    /* initialize the job control engine */
+    pthread_mutex_init(&job_mutex, NULL);
+    pthread_cond_init(&job_cond, NULL);
+    pthread_cond_init(&job_reserved_cond, NULL);
+
+    job_fifos[JOB_CLASS_CONN].max  = xs_number_get(
+        xs_dict_get_def(srv_config, "max_pending_connections", "1024"));
+    job_fifos[JOB_CLASS_QUEUE].max = xs_number_get(
+        xs_dict_get_def(srv_config, "max_pending_jobs", "2048"));
+
+    keep_alive_timeout  = xs_number_get(
+        xs_dict_get_def(srv_config, "keep_alive_timeout", "15"));
+    keep_alive_requests = xs_number_get(
+        xs_dict_get_def(srv_config, "keep_alive_requests", "100"));
+    keep_alive_max      = xs_number_get(
+        xs_dict_get_def(srv_config, "keep_alive_max_connections", "256"));
+
+    max_request_size = xs_number_get(
+        xs_dict_get_def(srv_config, "max_request_size", "64"));
+
+    /* in MiB, but also within the limits of the request buffers */
+    if (max_request_size <= 0 || max_request_size > 1024)
+        max_request_size = 1024;
+
+    max_request_size *= 1024 * 1024;
+
+    /* initialize sleep control */
+    pthread_mutex_init(&sleep_mutex, NULL);
+    pthread_cond_init(&sleep_cond, NULL);
+
+    p_state->n_threads = xs_number_get(xs_dict_get(srv_config, "num_threads"));
+
+#ifdef _SC_NPROCESSORS_ONLN
+    if (p_state->n_threads == 0) {
+        /* get number of CPUs on the machine */
+        p_state->n_threads = sysconf(_SC_NPROCESSORS_ONLN);
+    }
 #endif
 
-        break;
+    if (p_state->n_threads < 4)
+        p_state->n_threads = 4;
+
+    if (p_state->n_threads > MAX_THREADS)
+        p_state->n_threads = MAX_THREADS;
+
+    /* threads reserved for attending connections
+       (by default, a quarter of the job threads) */
+    const char *nrt = xs_dict_get(srv_config, "num_reserved_threads");
+
+    if (nrt != NULL)
+        p_state->n_reserved_threads = xs_number_get(nrt);
+    else
+        p_state->n_reserved_threads = (p_state->n_threads - 1) / 4;
+
+    /* at least one thread must process the queue */
+    if (p_state->n_reserved_threads > p_state->n_threads - 2)
+        p_state->n_reserved_threads = p_state->n_threads - 2;
+
+    if (p_state->n_reserved_threads < 0)
+        p_state->n_reserved_threads = 0;
+
+    srv_debug(0, xs_fmt("using %d threads (%d reserved for connections)",
+        p_state->n_threads, p_state->n_reserved_threads));
+
+    /* termination signals must only be attended by this thread
+       (the handler longjmps into it), so block them in the rest */
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    /* thread #0 is the background thread (only in one of the processes) */
+    if (background)
+        pthread_create(&threads[0], NULL, background_thread, NULL);
+
+    srv_archive_start();
+
+    /* create the lazily allocated stock values now, before the threads race for them */
+    xs_stock(XSTYPE_LIST);
+    xs_stock(XSTYPE_DICT);
+
+    /* the rest of threads are for job processing */
+    char *ptr = (char *) 0x1;
+    for (n = 1; n < p_state->n_threads; n++)
+        pthread_create(&threads[n], NULL, job_thread, ptr++);
+
+    if (setjmp(on_break) == 0) {
+        pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+
+#ifdef USE_EPOLL
+        httpd_event_loop(rs);
+#else
+        httpd_accept_loop(rs);
+#endif
     }
 
-    return ss;
+    p_state->srv_running = 0;
+
+    /* send as many exit jobs as working threads */
+    for (n = 1; n < p_state->n_threads; n++)
+        job_post(xs_stock(XSTYPE_FALSE), 0);
+
+    /* wait for all the threads to exit */
+    for (n = background ? 0 : 1; n < p_state->n_threads; n++)
+        pthread_join(threads[n], NULL);
+
+    srv_archive_stop();
+}
+
+
+static pid_t httpd_spawn(int rs, int num, int reuseport)
+/* starts a worker process (multi-process mode) */
+{
+    pid_t pid = fork();
+
+    if (pid == 0) {
+        /* the worker has its own slot in the shared state */
+        srv_state *ss = &p_state[1 + num];
+
+        *ss = (srv_state){
+            .s_size         = sizeof(*ss),
+            .srv_running    = 1,
+            .use_fcgi       = p_state->use_fcgi,
+            .srv_start_time = p_state->srv_start_time,
+            .n_routes       = p_state->n_routes,
+            .pid            = getpid()
+        };
+
+        p_state = ss;
+
+        /* with SO_REUSEPORT, each worker listens on its own socket
+           and the kernel spreads the connections among them */
+        if (reuseport && num > 0) {
+            const char *address = xs_dict_get(srv_config, "address");
+            const char *port    = xs_number_str(xs_dict_get(srv_config, "port"));
+            int ns = xs_socket_server_opt(address, port, XS_SOCKET_REUSEPORT);
+
+            if (ns != -1) {
+                close(rs);
+                rs = ns;
+            }
+        }
+
+        srv_debug(0, xs_fmt("worker #%d started", num));
+
+        httpd_worker(rs, num == 0);
+
+        srv_debug(0, xs_fmt("worker #%d stopped", num));
+
+        exit(0);
+    }
+
+    if (pid == -1)
+        srv_log(xs_fmt("cannot fork worker #%d: %s", num, strerror(errno)));
+
+    return pid;
+}
+
+
+static void httpd_master(int rs, int n_procs, int reuseport)
+/* starts the worker processes and restarts them if they die */
+{
+    pid_t pids[MAX_PROCESSES] = {0};
+    int n;
+
+    sigset_t sigs;
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGINT);
+
+    /* forked workers start with termination signals blocked
+       until they have their own place to longjmp to */
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+
+    for (n = 0; n < n_procs; n++)
+        pids[n] = httpd_spawn(rs, n, reuseport);
+
+    if (setjmp(on_break) == 0) {
+        pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+
+        for (;;) {
+            int status;
+            pid_t pid = wait(&status);
+
+            if (pid == -1) {
+                if (errno == EINTR)
+                    continue;
+
+                break;
+            }
+
+            for (n = 0; n < n_procs && pids[n] != pid; n++);
+
+            if (n == n_procs)
+                continue;
+
+            srv_log(xs_fmt("worker #%d (pid %d) died (status %d); restarting",
+                n, (int)pid, status));
+
+            p_state[1 + n].srv_running = 0;
+
+            /* the input messages it had accepted go to the disk queue */
+            input_journal_replay(pid);
+
+            /* don't restart in a tight loop */
+            sleep(1);
+
+            pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+            pids[n] = httpd_spawn(rs, n, reuseport);
+            pthread_sigmask(SIG_UNBLOCK, &sigs, NULL);
+        }
+    }
+
+    p_state->srv_running = 0;
+
+    for (n = 0; n < n_procs; n++) {
+        if (pids[n] > 0)
+            kill(pids[n], SIGTERM);
+    }
+
+    for (n = 0; n < n_procs; n++) {
+        if (pids[n] > 0)
+            waitpid(pids[n], NULL, 0);
+    }
 }
 
 
@@ -769,16 +2754,18 @@ void httpd(void)
     const char *port = NULL;
     xs *full_address = NULL;
     int rs;
-    pthread_t threads[MAX_THREADS] = {0};
-    int n;
-    xs *sem_name = NULL;
     xs *shm_name = NULL;
-    sem_t anon_job_sem;
     xs *pidfile = xs_fmt("%s/server.pid", srv_basedir);
+    int n_procs = xs_number_get(xs_dict_get(srv_config, "num_processes"));
+    int reuseport = 0;
+
+    if (n_procs > MAX_PROCESSES)
+        n_procs = MAX_PROCESSES;
 
     address = xs_dict_get(srv_config, "address");
 
     if (*address == '/') {
+        /* all workers share the same unix socket */
         rs = xs_unix_socket_server(address, NULL);
         full_address = xs_fmt("unix:%s", address);
     }
@@ -786,7 +2773,11 @@ void httpd(void)
         port = xs_number_str(xs_dict_get(srv_config, "port"));
         full_address = xs_fmt("%s:%s", address, port);
 
-        rs = xs_socket_server(address, port);
+#ifdef SO_REUSEPORT
+        reuseport = n_procs > 1;
+#endif
+
+        rs = xs_socket_server_opt(address, port, reuseport ? XS_SOCKET_REUSEPORT : 0);
     }
 
     if (rs == -1) {
@@ -798,9 +2789,14 @@ void httpd(void)
     p_state = srv_state_op(&shm_name, 0);
 
     p_state->srv_start_time = time(NULL);
+    p_state->pid = getpid();
 
     p_state->use_fcgi = xs_type(xs_dict_get(srv_config, "fastcgi")) == XSTYPE_TRUE;
 
+    httpd_router_init();
+
+    rcache_max_size = xs_number_get(xs_dict_get_def(srv_config, "response_cache_size", "16")) * 1024 * 1024;
+
     p_state->srv_running = 1;
 
     signal(SIGPIPE, SIG_IGN);
@@ -821,83 +2817,23 @@ void httpd(void)
             srv_log(xs_fmt("Cannot create %s: %s", pidfile, strerror(errno)));
     }
 
-    /* show the number of usable file descriptors */
-    struct rlimit r;
-    getrlimit(RLIMIT_NOFILE, &r);
-    srv_debug(1, xs_fmt("available (rlimit) fds: %d (cur) / %d (max)",
-                        (int) r.rlim_cur, (int) r.rlim_max));
-
-    /* initialize the job control engine */
-    pthread_mutex_init(&job_mutex, NULL);
-    sem_name = xs_fmt("/job_%d", getpid());
-    job_sem = sem_open(sem_name, O_CREAT, 0644, 0);
-
-    if (job_sem == NULL) {
-        /* error opening a named semaphore; try with an anonymous one */
-        if (sem_init(&anon_job_sem, 0, 0) != -1)
-            job_sem = &anon_job_sem;
-    }
-
-    if (job_sem == NULL) {
-        srv_log(xs_fmt("fatal error: cannot create semaphore -- cannot continue"));
-        return;
-    }
-
-    /* initialize sleep control */
-    pthread_mutex_init(&sleep_mutex, NULL);
-    pthread_cond_init(&sleep_cond, NULL);
-
-    p_state->n_threads = xs_number_get(xs_dict_get(srv_config, "num_threads"));
-
-#ifdef _SC_NPROCESSORS_ONLN
-    if (p_state->n_threads == 0) {
-        /* get number of CPUs on the machine */
-        p_state->n_threads = sysconf(_SC_NPROCESSORS_ONLN);
-    }
-#endif
-
-    if (p_state->n_threads < 4)
-        p_state->n_threads = 4;
-
-    if (p_state->n_threads > MAX_THREADS)
-        p_state->n_threads = MAX_THREADS;
+    /* recover the input messages not processed in the previous run */
+    input_journal_replay(0);
 
-    srv_debug(0, xs_fmt("using %d threads", p_state->n_threads));
+    if (n_procs > 1) {
+        /* the storage serializer must be shared among the workers */
+        if (!data_mutex_share())
+            srv_log(xs_fmt("warning: cannot share the data mutex (%s)", strerror(errno)));
 
-    /* thread #0 is the background thread */
-    pthread_create(&threads[0], NULL, background_thread, NULL);
-
-    /* the rest of threads are for job processing */
-    char *ptr = (char *) 0x1;
-    for (n = 1; n < p_state->n_threads; n++)
-        pthread_create(&threads[n], NULL, job_thread, ptr++);
+        p_state->n_procs = n_procs;
 
-    if (setjmp(on_break) == 0) {
-        for (;;) {
-            int cs = xs_socket_accept(rs);
+        srv_log(xs_fmt("using %d worker processes%s", n_procs,
+            reuseport ? " (SO_REUSEPORT)" : ""));
 
-            if (cs != -1) {
-                FILE *f = fdopen(cs, "r+");
-                xs *job = xs_data_new(&f, sizeof(FILE *));
-                job_post(job, 1);
-            }
-            else
-                break;
-        }
+        httpd_master(rs, n_procs, reuseport);
     }
-
-    p_state->srv_running = 0;
-
-    /* send as many exit jobs as working threads */
-    for (n = 1; n < p_state->n_threads; n++)
-        job_post(xs_stock(XSTYPE_FALSE), 0);
-
-    /* wait for all the threads to exit */
-    for (n = 0; n < p_state->n_threads; n++)
-        pthread_join(threads[n], NULL);
-
-    sem_close(job_sem);
-    sem_unlink(sem_name);
+    else
+        httpd_worker(rs, 1);
 
     srv_state_op(&shm_name, 2);
 
@@ -25,6 +25,7 @@ int usage(void)
     printf("httpd {basedir}                      Starts the HTTPD daemon\n");
     printf("purge {basedir}                      Purges old data\n");
     printf("state {basedir}                      Prints server state\n");
+    printf("archive {basedir} [{n}]              Lists the archived exchanges or extracts one\n");
     printf("webfinger {basedir} {account}        Queries about an account (@user@host or actor url)\n");
     printf("queue {basedir} {uid}                Processes a user queue\n");
     printf("follow {basedir} {uid} {actor}       Follows an actor\n");
@@ -150,21 +151,78 @@ int main(int argc, char *argv[])
             return 1;
 
         srv_state ss = *p_state;
-        int n;
+        int n, w;
+
+        /* in multi-process mode, add up the counters of the workers */
+        for (w = 1; w <= ss.n_procs && w <= MAX_PROCESSES; w++) {
+            const srv_state *ws = &p_state[w];
+
+            ss.job_fifo_size          += ws->job_fifo_size;
+            ss.peak_job_fifo_size     += ws->peak_job_fifo_size;
+            ss.job_fifo_class_size[0] += ws->job_fifo_class_size[0];
+            ss.job_fifo_class_size[1] += ws->job_fifo_class_size[1];
+            ss.job_fifo_rejected      += ws->job_fifo_rejected;
+            ss.n_open_connections     += ws->n_open_connections;
+            ss.inbox_dedupe_checked   += ws->inbox_dedupe_checked;
+            ss.inbox_dedupe_hits      += ws->inbox_dedupe_hits;
+            ss.archive_dropped        += ws->archive_dropped;
+            ss.rcache_hits            += ws->rcache_hits;
+            ss.rcache_misses          += ws->rcache_misses;
+
+            for (n = 0; n < ws->n_routes && n < MAX_ROUTES; n++) {
+                ss.route_hits[n] += ws->route_hits[n];
+                ss.route_time[n] += ws->route_time[n];
+            }
+        }
 
         printf("server: %s (%s)\n", xs_dict_get(srv_config, "host"), USER_AGENT);
         xs *uptime = xs_str_time_diff(time(NULL) - ss.srv_start_time);
         printf("uptime: %s\n", uptime);
         printf("job fifo size (cur): %d\n", ss.job_fifo_size);
         printf("job fifo size (peak): %d\n", ss.peak_job_fifo_size);
+        printf("job fifo size (connections): %d\n", ss.job_fifo_class_size[0]);
+        printf("job fifo size (queue): %d\n", ss.job_fifo_class_size[1]);
+        printf("job fifo rejected: %d\n", ss.job_fifo_rejected);
+        printf("connections being read: %d\n", ss.n_open_connections);
+        printf("inbox duplicates: %d of %d\n", ss.inbox_dedupe_hits, ss.inbox_dedupe_checked);
+        printf("archive records dropped: %d\n", ss.archive_dropped);
+        printf("response cache: %d hits, %d misses\n", ss.rcache_hits, ss.rcache_misses);
+
+        for (n = 0; n < ss.n_routes && n < MAX_ROUTES; n++) {
+            if (ss.route_hits[n])
+                printf("route %s: %d hits, %.3f ms avg\n", httpd_route_name(n),
+                    ss.route_hits[n], ss.route_time[n] * 1000.0 / ss.route_hits[n]);
+        }
+
         char *th_states[] = { "stopped", "waiting", "input", "output" };
 
-        for (n = 0; n < ss.n_threads; n++)
-            printf("thread #%d state: %s\n", n, th_states[ss.th_state[n]]);
+        if (ss.n_procs == 0) {
+            for (n = 0; n < ss.n_threads; n++)
+                printf("thread #%d state: %s%s\n", n, th_states[ss.th_state[n]],
+                    n >= ss.n_threads - ss.n_reserved_threads ? " (reserved)" : "");
+        }
+
+        for (w = 1; w <= ss.n_procs && w <= MAX_PROCESSES; w++) {
+            const srv_state *ws = &p_state[w];
+
+            printf("worker #%d (pid %d): %s\n", w - 1, ws->pid,
+                ws->srv_running ? "running" : "stopped");
+
+            for (n = 0; n < ws->n_threads; n++)
+                printf("worker #%d thread #%d state: %s%s\n", w - 1, n,
+                    th_states[ws->th_state[n]],
+                    n >= ws->n_threads - ws->n_reserved_threads ? " (reserved)" : "");
+        }
 
         return 0;
     }
 
+    if (strcmp(cmd, "archive") == 0) { /** **/
+        const char *n = GET_ARGV();
+
+        return srv_archive_extract(n ? atoi(n) : -1);
+    }
+
     if ((user = GET_ARGV()) == NULL)
         return usage();
 
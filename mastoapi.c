@@ -45,7 +45,7 @@ int app_add(const char *id, const xs_dict *app)
     fn = xs_str_cat(fn, ".json");
 
     if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(app, 4, f);
+        xs_json_dump(app, 0, f);
         fclose(f);
     }
     else
@@ -108,7 +108,7 @@ int token_add(const char *id, const xs_dict *token)
     fn = xs_str_cat(fn, ".json");
 
     if ((f = fopen(fn, "w")) != NULL) {
-        xs_json_dump(token, 4, f);
+        xs_json_dump(token, 0, f);
         fclose(f);
     }
     else
@@ -1303,7 +1303,8 @@ void credentials_get(char **body, char **ctype, int *status, snac snac)
 }
 
 
-xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn)
+static xs_list *mastoapi_timeline_md5s(snac *user, const xs_dict *args, const char *index_fn)
+/* returns the md5s of the entries of a timeline */
 {
     xs_list *out = xs_list_new();
     FILE *f;
@@ -1417,13 +1418,13 @@ xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn
             if (!xs_is_null(xs_dict_get(msg, "name")) && !xs_match(type, "Page|Video"))
                 continue;
 
-            /* convert the Note into a Mastodon status */
-            xs *st = mastoapi_status(user, msg);
+            /* if the author is not here, mastoapi_status() would discard it */
+            const char *atto = get_atto(msg);
+            if (xs_is_null(atto) || (!xs_startswith(atto, srv_baseurl) && !object_here(atto)))
+                continue;
 
-            if (st != NULL) {
-                out = xs_list_append(out, st);
-                cnt++;
-            }
+            out = xs_list_append(out, md5);
+            cnt++;
 
         } while (cnt < limit && index_desc_next(f, md5));
     }
@@ -1438,8 +1439,71 @@ xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn
 }
 
 
+static xs_list *mastoapi_timeline_statuses(snac *user, const xs_list *md5s)
+/* converts the entries of a timeline to Mastodon statuses */
+{
+    xs_list *out = xs_list_new();
+    const char *md5;
+
+    xs_list_foreach(md5s, md5) {
+        xs *msg = NULL;
+
+        if (user) {
+            if (!valid_status(timeline_get_by_md5(user, md5, &msg)))
+                continue;
+        }
+        else {
+            if (!valid_status(object_get_by_md5(md5, &msg)))
+                continue;
+        }
+
+        xs *st = mastoapi_status(user, msg);
+
+        if (st != NULL)
+            out = xs_list_append(out, st);
+    }
+
+    return out;
+}
+
+
+xs_list *mastoapi_timeline(snac *user, const xs_dict *args, const char *index_fn)
+{
+    xs *md5s = mastoapi_timeline_md5s(user, args, index_fn);
+
+    return mastoapi_timeline_statuses(user, md5s);
+}
+
+
+static int mastoapi_etag(snac *user, const xs_dict *req, const char *q_path,
+                         const char *index_fn, const xs_list *md5s, xs_str **etag)
+/* builds the etag of a timeline-like response (from its index and,
+   if given, the listed entries); returns true if the client
+   already has this version */
+{
+    xs *fns = xs_list_new();
+
+    fns = xs_list_append(fns, index_fn);
+
+    /* the private timeline index is touched on likes, boosts, etc. */
+    if (user) {
+        xs *p_fn = user_index_fn(user, "private");
+        fns = xs_list_append(fns, p_fn);
+    }
+
+    xs *args  = xs_json_dumps(xs_dict_get_def(req, "q_vars", xs_stock(XSTYPE_NULL)), 0);
+    xs *extra = xs_fmt("%s %s %s", q_path, user ? user->uid : "", args);
+
+    *etag = files_etag(fns, md5s, extra);
+
+    const char *inm = xs_dict_get(req, "if-none-match");
+
+    return !xs_is_null(inm) && strcmp(inm, *etag) == 0;
+}
+
+
 int mastoapi_get_handler(const xs_dict *req, const char *q_path,
-                         char **body, int *b_size, char **ctype)
+                         char **body, int *b_size, char **ctype, xs_str **etag)
 {
     (void)b_size;
 
@@ -1697,13 +1761,20 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
         /* the private timeline */
         if (logged_in) {
             xs *ifn = user_index_fn(&snac1, "private");
-            xs *out = mastoapi_timeline(&snac1, args, ifn);
 
-            *body  = xs_json_dumps(out, 4);
-            *ctype = "application/json";
-            status = HTTP_STATUS_OK;
+            xs *md5s = mastoapi_timeline_md5s(&snac1, args, ifn);
+
+            if (mastoapi_etag(&snac1, req, q_path, ifn, md5s, etag))
+                status = HTTP_STATUS_NOT_MODIFIED;
+            else {
+                xs *out = mastoapi_timeline_statuses(&snac1, md5s);
+
+                *body  = xs_json_dumps(out, 4);
+                *ctype = "application/json";
+                status = HTTP_STATUS_OK;
 
-            srv_debug(2, xs_fmt("mastoapi timeline: returned %d entries", xs_list_len(out)));
+                srv_debug(2, xs_fmt("mastoapi timeline: returned %d entries", xs_list_len(out)));
+            }
         }
         else {
             status = HTTP_STATUS_UNAUTHORIZED;
@@ -1713,11 +1784,18 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     if (strcmp(cmd, "/v1/timelines/public") == 0) { /** **/
         /* the instance public timeline (public timelines for all users) */
         xs *ifn = instance_index_fn();
-        xs *out = mastoapi_timeline(NULL, args, ifn);
 
-        *body  = xs_json_dumps(out, 4);
-        *ctype = "application/json";
-        status = HTTP_STATUS_OK;
+        xs *md5s = mastoapi_timeline_md5s(NULL, args, ifn);
+
+        if (mastoapi_etag(NULL, req, q_path, ifn, md5s, etag))
+            status = HTTP_STATUS_NOT_MODIFIED;
+        else {
+            xs *out = mastoapi_timeline_statuses(NULL, md5s);
+
+            *body  = xs_json_dumps(out, 4);
+            *ctype = "application/json";
+            status = HTTP_STATUS_OK;
+        }
     }
     else
     if (xs_startswith(cmd, "/v1/timelines/tag/")) { /** **/
@@ -1726,11 +1804,18 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
         const char *tag = xs_list_get(l, -1);
 
         xs *ifn = tag_fn(tag);
-        xs *out = mastoapi_timeline(NULL, args, ifn);
 
-        *body  = xs_json_dumps(out, 4);
-        *ctype = "application/json";
-        status = HTTP_STATUS_OK;
+        xs *md5s = mastoapi_timeline_md5s(NULL, args, ifn);
+
+        if (mastoapi_etag(NULL, req, q_path, ifn, md5s, etag))
+            status = HTTP_STATUS_NOT_MODIFIED;
+        else {
+            xs *out = mastoapi_timeline_statuses(NULL, md5s);
+
+            *body  = xs_json_dumps(out, 4);
+            *ctype = "application/json";
+            status = HTTP_STATUS_OK;
+        }
     }
     else
     if (xs_startswith(cmd, "/v1/timelines/list/")) { /** **/
@@ -1740,11 +1825,18 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
             const char *list = xs_list_get(l, -1);
 
             xs *ifn = list_timeline_fn(&snac1, list);
-            xs *out = mastoapi_timeline(NULL, args, ifn);
 
-            *body  = xs_json_dumps(out, 4);
-            *ctype = "application/json";
-            status = HTTP_STATUS_OK;
+            xs *md5s = mastoapi_timeline_md5s(NULL, args, ifn);
+
+            if (mastoapi_etag(&snac1, req, q_path, ifn, md5s, etag))
+                status = HTTP_STATUS_NOT_MODIFIED;
+            else {
+                xs *out = mastoapi_timeline_statuses(NULL, md5s);
+
+                *body  = xs_json_dumps(out, 4);
+                *ctype = "application/json";
+                status = HTTP_STATUS_OK;
+            }
         }
         else
             status = HTTP_STATUS_MISDIRECTED_REQUEST;
@@ -1758,6 +1850,11 @@ int mastoapi_get_handler(const xs_dict *req, const char *q_path,
     }
     else
     if (strcmp(cmd, "/v1/notifications") == 0) { /** **/
+        xs *ifn = logged_in ? user_index_fn(&snac1, "notify") : NULL;
+
+        if (logged_in && mastoapi_etag(&snac1, req, q_path, ifn, NULL, etag))
+            status = HTTP_STATUS_NOT_MODIFIED;
+        else
         if (logged_in) {
             xs *l      = notify_list(&snac1, 0, 64);
             xs *out    = xs_list_new();
@@ -9,6 +9,7 @@
 #include "xs_unicode_tbl.h"
 #include "xs_unicode.h"
 #include "xs_json.h"
+#include "xs_bin.h"
 #include "xs_curl.h"
 #include "xs_openssl.h"
 #include "xs_socket.h"
@@ -18,12 +19,14 @@
 #include "xs_mime.h"
 #include "xs_regex.h"
 #include "xs_set.h"
+#include "xs_hmap.h"
 #include "xs_time.h"
 #include "xs_glob.h"
 #include "xs_random.h"
 #include "xs_match.h"
 #include "xs_fcgi.h"
 #include "xs_html.h"
+#include "xs_zlib.h"
 
 #include "snac.h"
 
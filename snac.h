@@ -22,6 +22,9 @@
 
 #define MD5_HEX_SIZE 33
 
+#define MAX_ROUTES 32
+#define MAX_PROCESSES 16
+
 extern double disk_layout;
 extern xs_str *srv_basedir;
 extern xs_dict *srv_config;
@@ -34,6 +37,8 @@ extern int dbglevel;
 
 #define POSTLIKE_OBJECT_TYPE "Note|Question|Page|Article|Video|Event"
 
+#define IGNORED_ACTIVITY_TYPE "Add|View|Reject|Read|Remove"
+
 int mkdirx(const char *pathname);
 
 int valid_status(int status);
@@ -60,9 +65,23 @@ typedef struct {
     int srv_running;        /* server running on/off */
     int use_fcgi;           /* FastCGI use on/off */
     time_t srv_start_time;  /* start time */
+    int pid;                /* process id */
+    int n_procs;            /* number of worker processes (multi-process mode) */
     int job_fifo_size;      /* job fifo size */
     int peak_job_fifo_size; /* maximum job fifo size seen */
+    int n_open_connections; /* connections with requests being read */
     int n_threads;          /* number of configured threads */
+    int n_reserved_threads; /* number of threads reserved for connections */
+    int job_fifo_class_size[2]; /* job fifo size (connections, queue) */
+    int job_fifo_rejected;  /* jobs rejected because of full fifos */
+    int inbox_dedupe_checked; /* inbox messages checked for duplicates */
+    int inbox_dedupe_hits;  /* inbox messages acknowledged as duplicates */
+    int archive_dropped;    /* archive records dropped because of a full ring */
+    int rcache_hits;        /* responses served from the response cache */
+    int rcache_misses;      /* cacheable responses that had to be built */
+    int n_routes;           /* number of request routes */
+    int route_hits[MAX_ROUTES]; /* requests dispatched by each route */
+    double route_time[MAX_ROUTES]; /* seconds spent in each route's handlers */
     enum { THST_STOP, THST_WAIT, THST_IN, THST_QUEUE } th_state[MAX_THREADS];
 } srv_state;
 
@@ -73,6 +92,7 @@ void snac_log(snac *user, xs_str *str);
     { snac_log((user), (str)); } } while (0)
 
 int srv_open(const char *basedir, int auto_upgrade);
+int data_mutex_share(void);
 void srv_free(void);
 
 int user_open(snac *snac, const char *uid);
@@ -93,6 +113,9 @@ void srv_archive(const char *direction, const char *url, xs_dict *req,
 void srv_archive_error(const char *prefix, const xs_str *err,
                        const xs_dict *req, const xs_val *data);
 void srv_archive_qitem(const char *prefix, xs_dict *q_item);
+void srv_archive_start(void);
+void srv_archive_stop(void);
+int srv_archive_extract(int num);
 
 double mtime_nl(const char *fn, int *n_link);
 #define mtime(fn) mtime_nl(fn, NULL)
@@ -108,11 +131,16 @@ int index_desc_next(FILE *f, char md5[MD5_HEX_SIZE]);
 int index_desc_first(FILE *f, char md5[MD5_HEX_SIZE], int skip);
 xs_list *index_list_desc(const char *fn, int skip, int show);
 
+xs_val *storage_load(FILE *f, const char *fields[]);
+int storage_dump(const xs_val *data, FILE *f);
+
 int object_add(const char *id, const xs_dict *obj);
 int object_add_ow(const char *id, const xs_dict *obj);
 int object_here_by_md5(const char *id);
 int object_here(const char *id);
 int object_get_by_md5(const char *md5, xs_dict **obj);
+int _object_get_by_md5_fields(const char *md5, xs_dict **obj, const char *fields[]);
+#define object_get_by_md5_fields(md5, obj, ...) _object_get_by_md5_fields(md5, obj, (const char *[]){ __VA_ARGS__, NULL })
 int object_get(const char *id, xs_dict **obj);
 int object_del(const char *id);
 int object_del_if_unref(const char *id);
@@ -169,6 +197,11 @@ int following_check(snac *snac, const char *actor);
 int following_get(snac *snac, const char *actor, xs_dict **data);
 xs_list *following_list(snac *snac);
 
+void relation_add(snac *user, const char *actor);
+void relation_del(snac *user, const char *actor);
+void relation_purge(snac *user);
+xs_list *relation_list(const char *actor);
+
 void mute(snac *snac, const char *actor);
 void unmute(snac *snac, const char *actor);
 int is_muted(snac *snac, const char *actor);
@@ -213,7 +246,11 @@ int actor_add(const char *actor, const xs_dict *msg);
 int actor_get(const char *actor, xs_dict **data);
 int actor_get_refresh(snac *user, const char *actor, xs_dict **data);
 
+xs_str *files_etag(const xs_list *fns, const xs_list *md5s, const char *extra);
+xs_str *object_etag(const char *id, const xs_list *fns, const char *extra);
+
 int static_get(snac *snac, const char *id, xs_val **data, int *size, const char *inm, xs_str **etag);
+int static_file(snac *snac, const char *id, xs_str **file, const char *inm, xs_str **etag);
 void static_put(snac *snac, const char *id, const char *data, int size);
 void static_put_meta(snac *snac, const char *id, const char *str);
 xs_str *static_get_meta(snac *snac, const char *id);
@@ -223,6 +260,10 @@ void history_add(snac *snac, const char *id, const char *content, int size,
                     xs_str **etag);
 int history_get(snac *snac, const char *id, xs_str **content, int *size,
                 const char *inm, xs_str **etag);
+int history_file(snac *snac, const char *id, xs_str **file,
+                const char *inm, xs_str **etag);
+int history_regen_start(snac *snac, const char *id);
+void history_regen_end(snac *snac, const char *id);
 int history_del(snac *snac, const char *id);
 xs_list *history_list(snac *snac);
 
@@ -250,6 +291,11 @@ xs_list *content_search(snac *user, const char *regex,
 
 void enqueue_input(snac *snac, const xs_dict *msg, const xs_dict *req, int retries);
 void enqueue_shared_input(const xs_dict *msg, const xs_dict *req, int retries);
+int enqueue_input_raw(snac *user, const xs_dict *msg, const xs_dict *req,
+                      const char *payload, int p_size,
+                      const char *dd_key, const char *dd_chk);
+void input_journal_done(const xs_dict *q_item);
+int input_journal_replay(int pid);
 void enqueue_output_raw(const char *keyid, const char *seckey,
                         const xs_dict *msg, const xs_str *inbox,
                         int retries, int p_status);
@@ -290,6 +336,7 @@ int check_signature(const xs_dict *req, xs_str **err);
 
 srv_state *srv_state_op(xs_str **fname, int op);
 void httpd(void);
+const char *httpd_route_name(int n);
 
 int webfinger_request_signed(snac *snac, const char *qs, xs_str **actor, xs_str **user);
 int webfinger_request(const char *qs, xs_str **actor, xs_str **user);
@@ -337,13 +384,14 @@ int send_to_actor(snac *snac, const char *actor, const xs_dict *msg,
 int is_msg_public(const xs_dict *msg);
 int is_msg_from_private_user(const xs_dict *msg);
 int is_msg_for_me(snac *snac, const xs_dict *msg);
+xs_list *msg_candidate_users(const xs_dict *msg);
 
 int process_user_queue(snac *snac);
 void process_queue_item(xs_dict *q_item);
 int process_queue(void);
 
 int activitypub_get_handler(const xs_dict *req, const char *q_path,
-                            char **body, int *b_size, char **ctype);
+                            char **body, int *b_size, char **ctype, xs_str **etag);
 int activitypub_post_handler(const xs_dict *req, const char *q_path,
                              char *payload, int p_size,
                              char **body, int *b_size, char **ctype);
@@ -359,7 +407,7 @@ xs_str *html_timeline(snac *user, const xs_list *list, int read_only,
 
 int html_get_handler(const xs_dict *req, const char *q_path,
                      char **body, int *b_size, char **ctype,
-                     xs_str **etag, xs_str **last_modified);
+                     xs_str **etag, xs_str **last_modified, xs_str **file);
 
 int html_post_handler(const xs_dict *req, const char *q_path,
                       char *payload, int p_size,
@@ -375,8 +423,8 @@ int deluser(snac *user);
 
 extern const char *snac_blurb;
 
-void job_post(const xs_val *job, int urgent);
-void job_wait(xs_val **job);
+int job_post(const xs_val *job, int urgent);
+void job_wait(xs_val **job, int reserved);
 
 int oauth_get_handler(const xs_dict *req, const char *q_path,
                       char **body, int *b_size, char **ctype);
@@ -384,7 +432,7 @@ int oauth_post_handler(const xs_dict *req, const char *q_path,
                        const char *payload, int p_size,
                        char **body, int *b_size, char **ctype);
 int mastoapi_get_handler(const xs_dict *req, const char *q_path,
-                         char **body, int *b_size, char **ctype);
+                         char **body, int *b_size, char **ctype, xs_str **etag);
 int mastoapi_post_handler(const xs_dict *req, const char *q_path,
                           const char *payload, int p_size,
                           char **body, int *b_size, char **ctype);
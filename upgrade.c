@@ -4,6 +4,7 @@
 #include "xs.h"
 #include "xs_io.h"
 #include "xs_json.h"
+#include "xs_bin.h"
 #include "xs_glob.h"
 
 #include "snac.h"
@@ -11,6 +12,50 @@
 #include <sys/stat.h>
 
 
+static void upgrade_storage_format(void)
+/* converts the stored objects to the configured format (JSON or binary) */
+{
+    int binary = xs_is_true(xs_dict_get(srv_config, "binary_storage"));
+    xs *spec   = xs_fmt("%s/object/??" "/" "*.json", srv_basedir);
+    xs *list   = xs_glob(spec, 0, 0);
+    const char *fn;
+    int cnt = 0;
+
+    xs_list_foreach(list, fn) {
+        FILE *f;
+        struct stat st;
+        xs *o = NULL;
+
+        if ((f = fopen(fn, "r")) == NULL)
+            continue;
+
+        if (fstat(fileno(f), &st) == 0
+            && (fgetc(f) == (XS_BIN_MAGIC[0] & 0xff)) != binary) {
+            rewind(f);
+            o = storage_load(f, NULL);
+        }
+
+        fclose(f);
+
+        /* rewritten in place to keep the hard links from the timelines,
+           and with the same mtime, as purging and searching depend on it */
+        if (o != NULL && (f = fopen(fn, "w")) != NULL) {
+            struct timespec ts[2] = { st.st_atim, st.st_mtim };
+
+            storage_dump(o, f);
+            fflush(f);
+            futimens(fileno(f), ts);
+            fclose(f);
+
+            cnt++;
+        }
+    }
+
+    if (cnt)
+        srv_log(xs_fmt("%d objects converted to %s format", cnt, binary ? "binary" : "JSON"));
+}
+
+
 int snac_upgrade(xs_str **error)
 {
     int ret = 1;
@@ -313,6 +358,58 @@ int snac_upgrade(xs_str **error)
 
             nf = 2.7;
         }
+        else
+        if (f < 2.8) {
+            /* build the relation index from followers and following */
+            xs *dir = xs_fmt("%s/relation", srv_basedir);
+            mkdirx(dir);
+
+            xs *users = user_list();
+            const char *uid;
+
+            xs_list_foreach(users, uid) {
+                snac snac;
+
+                if (user_open(&snac, uid)) {
+                    xs *fwers = follower_list(&snac);
+                    const char *actor;
+
+                    xs_list_foreach(fwers, actor)
+                        relation_add(&snac, actor);
+
+                    xs *spec = xs_fmt("%s/following/" "*.json", snac.basedir);
+                    xs *list = xs_glob(spec, 0, 0);
+                    const char *fn;
+
+                    xs_list_foreach(list, fn) {
+                        FILE *f;
+
+                        if ((f = fopen(fn, "r")) != NULL) {
+                            xs *o = xs_json_load(f);
+                            fclose(f);
+
+                            /* it's either our Follow or their Accept */
+                            const char *type = xs_dict_get(o, "type");
+                            const char *a    = NULL;
+
+                            if (xs_type(type) == XSTYPE_STRING) {
+                                if (strcmp(type, "Accept") == 0)
+                                    a = xs_dict_get(o, "actor");
+                                else
+                                    a = xs_dict_get(o, "object");
+                            }
+
+                            if (xs_type(a) == XSTYPE_STRING)
+                                relation_add(&snac, a);
+                        }
+                    }
+
+                    user_free(&snac);
+                }
+            }
+
+            nf = 2.8;
+        }
 
         if (f < nf) {
             f          = nf;
@@ -331,6 +428,9 @@ int snac_upgrade(xs_str **error)
         ret    = 0;
     }
 
+    if (ret)
+        upgrade_storage_format();
+
     if (changed) {
         /* upgrade the configuration file */
         xs *fn = xs_fmt("%s/server.json", srv_basedir);
@@ -437,6 +437,8 @@ int deluser(snac *user)
         }
     }
 
+    relation_purge(user);
+
     rm_rf(user->basedir);
 
     return ret;
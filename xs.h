@@ -12,6 +12,7 @@
 #include <stdarg.h>
 #include <signal.h>
 #include <errno.h>
+#include <fcntl.h>
 
 typedef enum {
     XSTYPE_STRING = 0x02,       /* C string (\0 delimited) (NOT STORED) */
@@ -52,7 +53,12 @@ typedef char xs_data;
 void *xs_free(void *ptr);
 void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char *func);
 #define xs_realloc(ptr, size) _xs_realloc(ptr, size, __FILE__, __LINE__, __func__)
+void xs_arena_start(void);
+void xs_arena_end(void);
+int xs_arena_suspend(void);
+void xs_arena_resume(int active);
 int _xs_blk_size(int sz);
+xs_val *xs_reserve(xs_val *data, int size);
 void _xs_destroy(char **var);
 #define xs_debug() raise(SIGTRAP)
 xstype xs_type(const xs_val *data);
@@ -70,6 +76,7 @@ xs_val *xs_stock(int type);
 
 xs_str *xs_str_new(const char *str);
 xs_str *xs_str_new_sz(const char *mem, int sz);
+xs_str *xs_str_new_cap(int cap);
 xs_str *xs_str_wrap_i(const char *prefix, xs_str *str, const char *suffix);
 #define xs_str_prepend_i(str, prefix) xs_str_wrap_i(prefix, str, NULL)
 xs_str *_xs_str_cat(xs_str *str, const char *strs[]);
@@ -90,7 +97,19 @@ xs_str *xs_strip_chars_i(xs_str *str, const char *chars);
 #define xs_strip_i(str) xs_strip_chars_i(str, " \r\n\t\v\f")
 xs_str *xs_tolower_i(xs_str *str);
 
+/* string builder: keeps the length, so that appending doesn't need a strlen() */
+typedef struct {
+    xs_str *str;        /* the string being built */
+    int len;            /* its length */
+} xs_str_bld;
+
+void xs_str_bld_init(xs_str_bld *b, int cap);
+void xs_str_bld_cat_m(xs_str_bld *b, const char *mem, int sz);
+#define xs_str_bld_cat(b, s) xs_str_bld_cat_m(b, s, strlen(s))
+xs_str *xs_str_bld_result(xs_str_bld *b);
+
 xs_list *xs_list_new(void);
+xs_list *xs_list_new_cap(int cap);
 xs_list *xs_list_append_m(xs_list *list, const char *mem, int dsz);
 xs_list *_xs_list_append(xs_list *list, const xs_val *vals[]);
 #define xs_list_append(list, ...) _xs_list_append(list, (const xs_val *[]){ __VA_ARGS__, NULL })
@@ -116,10 +135,12 @@ xs_val *xs_keyval_value(const xs_keyval *keyval);
 xs_keyval *xs_keyval_make(xs_keyval *keyval, const xs_str *key, const xs_val *value);
 
 xs_dict *xs_dict_new(void);
+xs_dict *xs_dict_new_cap(int cap);
 xs_dict *xs_dict_append(xs_dict *dict, const xs_str *key, const xs_val *value);
 xs_dict *xs_dict_prepend(xs_dict *dict, const xs_str *key, const xs_val *value);
 int xs_dict_next(const xs_dict *dict, const xs_str **key, const xs_val **value, int *ctxt);
 const xs_val *xs_dict_get(const xs_dict *dict, const xs_str *key);
+void xs_rehash(xs_val *data);
 #define xs_dict_get_def(dict, key, def) xs_or(xs_dict_get(dict, key), def)
 xs_dict *xs_dict_del(xs_dict *dict, const xs_str *key);
 xs_dict *xs_dict_set(xs_dict *dict, const xs_str *key, const xs_val *data);
@@ -142,6 +163,7 @@ void xs_data_get(void *data, const xs_data *value);
 void *xs_memmem(const char *haystack, int h_size, const char *needle, int n_size);
 
 unsigned int xs_hash_func(const char *data, int size);
+int xs_hash_key_file(const char *fn);
 
 #ifdef XS_ASSERT
 #include <assert.h>
@@ -164,9 +186,180 @@ unsigned int xs_hash_func(const char *data, int size);
 
 #ifdef XS_IMPLEMENTATION
 
+#ifdef __linux__
+#include <malloc.h> /* for malloc_usable_size() */
+#endif
+
+/** per-thread arenas **/
+
+/* while an arena is active, small allocations are carved from big
+   chunks and freeing them is a no-op (except for the last one); all
+   of them are released at once by xs_arena_end(). Values that must
+   outlive the arena have to be allocated between xs_arena_suspend()
+   and xs_arena_resume(). */
+
+#define XS_ARENA_CHUNK      (256 * 1024)
+#define XS_ARENA_MAX_CHUNKS 64
+#define XS_ARENA_MAX_ALLOC  (16 * 1024)
+#define XS_ARENA_HDR        16
+#define XS_ARENA_ALIGN(sz)  (((sz) + XS_ARENA_HDR - 1) & ~(size_t)(XS_ARENA_HDR - 1))
+
+typedef struct {
+    int active;             /* allocations are drawn from it */
+    int n_chunks;           /* 0: there is no arena */
+    size_t used;            /* used bytes of the last chunk */
+    char *chunk[XS_ARENA_MAX_CHUNKS];
+} xs_arena;
+
+static _Thread_local xs_arena _xs_arena;
+
+
+void xs_arena_start(void)
+/* starts drawing this thread's allocations from an arena */
+{
+    xs_arena *a = &_xs_arena;
+
+    if (a->n_chunks == 0 && (a->chunk[0] = malloc(XS_ARENA_CHUNK)) != NULL) {
+        a->n_chunks = 1;
+        a->used     = 0;
+        a->active   = 1;
+    }
+}
+
+
+void xs_arena_end(void)
+/* releases everything allocated from this thread's arena */
+{
+    xs_arena *a = &_xs_arena;
+    int n;
+
+    for (n = 0; n < a->n_chunks; n++)
+        free(a->chunk[n]);
+
+    a->n_chunks = 0;
+    a->active   = 0;
+}
+
+
+int xs_arena_suspend(void)
+/* allocates from the heap until xs_arena_resume() */
+{
+    int active = _xs_arena.active;
+
+    _xs_arena.active = 0;
+
+    return active;
+}
+
+
+void xs_arena_resume(int active)
+/* goes back to the state before xs_arena_suspend() */
+{
+    _xs_arena.active = active;
+}
+
+
+static int _xs_arena_chunk(const xs_arena *a, const char *ptr)
+/* returns the chunk holding ptr (-1 if it's not from the arena) */
+{
+    int n;
+
+    for (n = a->n_chunks - 1; n >= 0; n--) {
+        if (ptr > a->chunk[n] && ptr < a->chunk[n] + XS_ARENA_CHUNK)
+            return n;
+    }
+
+    return -1;
+}
+
+
+static int _xs_arena_is_last(const xs_arena *a, const char *ptr, int c)
+/* true if ptr is the latest allocation from the arena */
+{
+    return c == a->n_chunks - 1 &&
+        ptr + XS_ARENA_ALIGN(*(size_t *)(ptr - XS_ARENA_HDR)) == a->chunk[c] + a->used;
+}
+
+
+static char *_xs_arena_alloc(xs_arena *a, size_t size)
+/* returns room from the arena (NULL if it must come from the heap) */
+{
+    size_t sz = XS_ARENA_HDR + XS_ARENA_ALIGN(size);
+    char *p;
+
+    if (!a->active || size > XS_ARENA_MAX_ALLOC)
+        return NULL;
+
+    if (a->used + sz > XS_ARENA_CHUNK) {
+        if (a->n_chunks == XS_ARENA_MAX_CHUNKS ||
+            (a->chunk[a->n_chunks] = malloc(XS_ARENA_CHUNK)) == NULL)
+            return NULL;
+
+        a->n_chunks++;
+        a->used = 0;
+    }
+
+    p = a->chunk[a->n_chunks - 1] + a->used;
+    a->used += sz;
+
+    *(size_t *)p = size;
+
+    return p + XS_ARENA_HDR;
+}
+
+
+static char *_xs_arena_realloc(xs_arena *a, char *ptr, int c, size_t size)
+/* resizes an arena allocation (it may move to the heap) */
+{
+    size_t o_size = *(size_t *)(ptr - XS_ARENA_HDR);
+    char *chunk = a->chunk[c];
+    char *ndata;
+
+    if (_xs_arena_is_last(a, ptr, c) && a->active && size <= XS_ARENA_MAX_ALLOC &&
+        (size_t)(ptr - chunk) + XS_ARENA_ALIGN(size) <= XS_ARENA_CHUNK) {
+        /* the latest one: grow or shrink in place */
+        a->used = ptr - chunk + XS_ARENA_ALIGN(size);
+        *(size_t *)(ptr - XS_ARENA_HDR) = size;
+        return ptr;
+    }
+
+    if (size <= o_size)
+        return ptr;
+
+    if ((ndata = _xs_arena_alloc(a, size)) == NULL) {
+        /* too big (or no more chunks): move it to the heap */
+        if ((ndata = malloc(size)) == NULL)
+            return NULL;
+
+        if (_xs_arena_is_last(a, ptr, c))
+            a->used = ptr - XS_ARENA_HDR - chunk;
+    }
+
+    memcpy(ndata, ptr, o_size);
+
+    return ndata;
+}
+
+
 void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char *func)
 {
-    xs_val *ndata = realloc(ptr, size);
+    xs_val *ndata;
+    xs_arena *a = &_xs_arena;
+    int c;
+
+    if (a->n_chunks && (ptr == NULL || (c = _xs_arena_chunk(a, ptr)) != -1)) {
+        ndata = ptr == NULL ? _xs_arena_alloc(a, size) : _xs_arena_realloc(a, ptr, c, size);
+
+        if (ndata != NULL)
+            return ndata;
+
+        if (ptr != NULL) {
+            fprintf(stderr, "ERROR: out of memory at %s:%d: %s()\n", file, line, func);
+            abort();
+        }
+    }
+
+    ndata = realloc(ptr, size);
 
     if (ndata == NULL) {
         fprintf(stderr, "ERROR: out of memory at %s:%d: %s()\n", file, line, func);
@@ -210,6 +403,17 @@ void *_xs_realloc(void *ptr, size_t size, const char *file, int line, const char
 
 void *xs_free(void *ptr)
 {
+    xs_arena *a = &_xs_arena;
+    int c;
+
+    if (a->n_chunks && ptr != NULL && (c = _xs_arena_chunk(a, ptr)) != -1) {
+        /* only the latest allocation can be given back */
+        if (_xs_arena_is_last(a, ptr, c))
+            a->used = (char *)ptr - XS_ARENA_HDR - a->chunk[c];
+
+        return NULL;
+    }
+
 #ifdef XS_DEBUG
     if (ptr != NULL) {
         FILE *f = fopen("xs_memory.out", "a");
@@ -243,11 +447,51 @@ int _xs_blk_size(int sz)
     else
     if (sz < 4096)
         blk_size = 256;
+    else
+    if (sz >= 65536) {
+        /* big ones grow geometrically (in steps of a quarter of the
+           previous power of 2), so that appending to them is linear */
+        blk_size = 65536 / 4;
+
+        while (blk_size <= sz / 8)
+            blk_size *= 2;
+    }
 
     return ((((sz) + blk_size) / blk_size) * blk_size);
 }
 
 
+static int _xs_capacity(const xs_val *data)
+/* returns the allocated size of data (0 if unknown) */
+{
+    xs_arena *a = &_xs_arena;
+
+    if (data == NULL)
+        return 0;
+
+    if (a->n_chunks && _xs_arena_chunk(a, data) != -1)
+        return (int)*(size_t *)(data - XS_ARENA_HDR);
+
+#ifdef __linux__
+    return (int)malloc_usable_size((void *)data);
+#else
+    return 0;
+#endif
+}
+
+
+xs_val *xs_reserve(xs_val *data, int size)
+/* makes room for size more bytes, to avoid reallocations while growing */
+{
+    int sz = xs_size(data) + size;
+
+    if (sz > _xs_capacity(data))
+        data = xs_realloc(data, sz);
+
+    return data;
+}
+
+
 xstype xs_type(const xs_val *data)
 /* return the type of data */
 {
@@ -398,8 +642,9 @@ xs_val *xs_expand(xs_val *data, int offset, int size)
 
     sz += size;
 
-    /* open room */
-    data = xs_realloc(data, _xs_blk_size(sz));
+    /* open room (unless there is already enough) */
+    if (sz > _xs_capacity(data))
+        data = xs_realloc(data, _xs_blk_size(sz));
 
     /* move up the rest of the data */
     for (n = sz - 1; n >= offset + size; n--)
@@ -468,13 +713,20 @@ xs_val *xs_stock(int type)
     case XSTYPE_FALSE: return stock_false;
 
     case XSTYPE_LIST:
-        if (stock_list == NULL)
+        if (stock_list == NULL) {
+            /* it lives forever: never from an arena */
+            int arena = xs_arena_suspend();
             stock_list = xs_list_new();
+            xs_arena_resume(arena);
+        }
         return stock_list;
 
     case XSTYPE_DICT:
-        if (stock_dict == NULL)
+        if (stock_dict == NULL) {
+            int arena = xs_arena_suspend();
             stock_dict = xs_dict_new();
+            xs_arena_resume(arena);
+        }
         return stock_dict;
     }
 
@@ -491,6 +743,16 @@ xs_str *xs_str_new(const char *str)
 }
 
 
+xs_str *xs_str_new_cap(int cap)
+/* creates a new, empty string with room for cap bytes */
+{
+    xs_str *s = xs_realloc(NULL, _xs_blk_size(cap + 1));
+    s[0] = '\0';
+
+    return s;
+}
+
+
 xs_str *xs_str_new_sz(const char *mem, int sz)
 /* creates a new string from a memory block, adding an asciiz */
 {
@@ -533,6 +795,38 @@ xs_str *_xs_str_cat(xs_str *str, const char *strs[])
 }
 
 
+void xs_str_bld_init(xs_str_bld *b, int cap)
+/* starts building a string (cap is a hint of its final length) */
+{
+    b->str = xs_str_new_cap(cap);
+    b->len = 0;
+}
+
+
+void xs_str_bld_cat_m(xs_str_bld *b, const char *mem, int sz)
+/* appends a memory block to the string being built */
+{
+    if (b->len + sz + 1 > _xs_capacity(b->str))
+        b->str = xs_realloc(b->str, _xs_blk_size(b->len + sz + 1));
+
+    memcpy(b->str + b->len, mem, sz);
+    b->len += sz;
+    b->str[b->len] = '\0';
+}
+
+
+xs_str *xs_str_bld_result(xs_str_bld *b)
+/* returns the built string (the builder is no longer usable) */
+{
+    xs_str *s = b->str;
+
+    b->str = NULL;
+    b->len = 0;
+
+    return s;
+}
+
+
 xs_str *xs_replace_in(xs_str *str, const char *sfrom, const char *sto, int times)
 /* replaces inline all sfrom with sto */
 {
@@ -703,6 +997,13 @@ xs_list *xs_list_new(void)
 }
 
 
+xs_list *xs_list_new_cap(int cap)
+/* creates a new list with room for cap bytes of items */
+{
+    return xs_reserve(xs_list_new(), cap);
+}
+
+
 xs_list *_xs_list_write_litem(xs_list *list, int offset, const char *mem, int dsz)
 /* writes a list item */
 {
@@ -947,40 +1248,29 @@ xs_str *xs_join(const xs_list *list, const char *sep)
 {
     XS_ASSERT_TYPE(list, XSTYPE_LIST);
 
-    xs_str *s = NULL;
+    xs_str_bld b;
     const xs_val *v;
     int c = 0;
-    int offset = 0;
     int ssz = strlen(sep);
 
+    /* the list size is a good guess of the final one */
+    xs_str_bld_init(&b, xs_size(list));
+
     xs_list_foreach(list, v) {
         /* refuse to join non-string values */
         if (xs_type(v) == XSTYPE_STRING) {
-            int sz;
-
             /* add the separator */
-            if (c != 0 && ssz) {
-                s = xs_realloc(s, offset + ssz);
-                memcpy(s + offset, sep, ssz);
-                offset += ssz;
-            }
+            if (c != 0 && ssz)
+                xs_str_bld_cat_m(&b, sep, ssz);
 
             /* add the element */
-            if ((sz = strlen(v)) > 0) {
-                s = xs_realloc(s, offset + sz);
-                memcpy(s + offset, v, sz);
-                offset += sz;
-            }
+            xs_str_bld_cat(&b, v);
 
             c++;
         }
     }
 
-    /* null-terminate */
-    s = xs_realloc(s, _xs_blk_size(offset + 1));
-    s[offset] = '\0';
-
-    return s;
+    return xs_str_bld_result(&b);
 }
 
 
@@ -1089,6 +1379,13 @@ xs_dict *xs_dict_new(void)
     return d;
 }
 
+
+xs_dict *xs_dict_new_cap(int cap)
+/* creates a new dict with room for cap bytes of keys and values */
+{
+    return xs_reserve(xs_dict_new(), cap);
+}
+
 static int *_xs_dict_locate(const xs_dict *dict, const char *key)
 /* locates a ditem */
 {
@@ -1242,6 +1539,53 @@ const xs_val *xs_dict_get(const xs_dict *dict, const xs_str *key)
 }
 
 
+void xs_rehash(xs_val *data)
+/* rebuilds the search trees of all dicts inside a value
+   (needed when it was built by another process, as the hash is seeded) */
+{
+    if (xs_type(data) == XSTYPE_LIST) {
+        const xs_val *v;
+        int c = 0;
+
+        while (xs_list_next(data, &v, &c))
+            xs_rehash((xs_val *)v);
+    }
+    else
+    if (xs_type(data) == XSTYPE_DICT) {
+        dict_hdr *dh = (dict_hdr *)(data + 1);
+        int n = 0, o, *offs;
+
+        for (o = dh->first; o; o = ((ditem_hdr *)(data + o))->next)
+            n++;
+
+        if (n == 0 || (offs = malloc(n * sizeof(int))) == NULL)
+            return;
+
+        /* unlink everything */
+        dh->root = 0;
+
+        for (n = 0, o = dh->first; o; o = ((ditem_hdr *)(data + o))->next) {
+            ditem_hdr *di = (ditem_hdr *)(data + o);
+
+            memset(di->child, '\0', sizeof(di->child));
+            offs[n++] = o;
+        }
+
+        /* link them again, from the oldest one (so children stay further) */
+        while (n--) {
+            ditem_hdr *di = (ditem_hdr *)(data + offs[n]);
+
+            *_xs_dict_locate(data, di->key) = offs[n];
+
+            /* deleted values can be recovered, so they are also done */
+            xs_rehash(data + (di->value_offset < 0 ? -di->value_offset : di->value_offset));
+        }
+
+        free(offs);
+    }
+}
+
+
 int xs_dict_next(const xs_dict *dict, const xs_str **key, const xs_val **value, int *ctxt)
 /* dict iterator, with context */
 {
@@ -1473,18 +1817,136 @@ void *xs_memmem(const char *haystack, int h_size, const char *needle, int n_size
 }
 
 
+/* the hash is SipHash-1-3 with a random key, so the shape of the dict
+   search trees cannot be predicted (and attacked) from outside; the key
+   is per-process unless it's kept in a private file with xs_hash_key_file(),
+   and values stored with a different one need xs_rehash() */
+
+static unsigned long long _xs_hash_key[2] = {
+    0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL
+};
+
+#ifdef __GNUC__
+__attribute__((constructor))
+#endif
+static void _xs_hash_seed(void)
+/* initializes the hash key at startup */
+{
+#ifdef __OpenBSD__
+
+    arc4random_buf(_xs_hash_key, sizeof(_xs_hash_key));
+
+#else
+
+    FILE *f;
+    int done = 0;
+
+    if ((f = fopen("/dev/urandom", "r")) != NULL) {
+        if (fread(_xs_hash_key, sizeof(_xs_hash_key), 1, f) == 1)
+            done = 1;
+
+        fclose(f);
+    }
+
+    if (!done) {
+        /* poor, but at least different between processes */
+        _xs_hash_key[0] ^= (unsigned long long)getpid() << 32 ^ (size_t)&f;
+        _xs_hash_key[1] ^= (unsigned long long)(size_t)&_xs_hash_key;
+    }
+
+#endif /* __OpenBSD__ */
+}
+
+
+int xs_hash_key_file(const char *fn)
+/* sets the hash key from a file, storing the current one there if it
+   does not exist yet; it must be called before building any dict */
+/* returns 1 if the key was loaded, 2 if created, 0 on error */
+{
+    unsigned long long k[2];
+    FILE *f;
+    int n;
+
+    for (n = 0; n < 2; n++) {
+        if ((f = fopen(fn, "r")) != NULL) {
+            int ok = fread(k, sizeof(k), 1, f) == 1;
+
+            fclose(f);
+
+            if (!ok)
+                return 0;
+
+            memcpy(_xs_hash_key, k, sizeof(k));
+            return 1;
+        }
+
+        /* not there: create it (exclusively, as others may be doing it) */
+        int fd = open(fn, O_WRONLY | O_CREAT | O_EXCL, 0600);
+
+        if (fd != -1) {
+            int ok = write(fd, _xs_hash_key, sizeof(_xs_hash_key)) == sizeof(_xs_hash_key);
+
+            if (close(fd) != 0 || !ok) {
+                unlink(fn);
+                return 0;
+            }
+
+            return 2;
+        }
+
+        if (errno != EEXIST)
+            return 0;
+    }
+
+    return 0;
+}
+
+
+#define _XS_ROTL64(x, b) (((x) << (b)) | ((x) >> (64 - (b))))
+
+#define _XS_SIPROUND(v0, v1, v2, v3) do { \
+    v0 += v1; v1 = _XS_ROTL64(v1, 13); v1 ^= v0; v0 = _XS_ROTL64(v0, 32); \
+    v2 += v3; v3 = _XS_ROTL64(v3, 16); v3 ^= v2; \
+    v0 += v3; v3 = _XS_ROTL64(v3, 21); v3 ^= v0; \
+    v2 += v1; v1 = _XS_ROTL64(v1, 17); v1 ^= v2; v2 = _XS_ROTL64(v2, 32); \
+} while (0)
+
 unsigned int xs_hash_func(const char *data, int size)
 /* a general purpose hashing function */
 {
-    unsigned int hash = 0x666;
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned long long v0 = _xs_hash_key[0] ^ 0x736f6d6570736575ULL;
+    unsigned long long v1 = _xs_hash_key[1] ^ 0x646f72616e646f6dULL;
+    unsigned long long v2 = _xs_hash_key[0] ^ 0x6c7967656e657261ULL;
+    unsigned long long v3 = _xs_hash_key[1] ^ 0x7465646279746573ULL;
+    unsigned long long m, b = (unsigned long long)size << 56;
     int n;
 
-    for (n = 0; n < size; n++) {
-        hash ^= (unsigned char)data[n];
-        hash *= 111111111;
+    /* full words (in native order: the key is random anyway) */
+    for (; size >= 8; p += 8, size -= 8) {
+        memcpy(&m, p, sizeof(m));
+
+        v3 ^= m;
+        _XS_SIPROUND(v0, v1, v2, v3);
+        v0 ^= m;
     }
 
-    return hash ^ hash >> 16;
+    /* the tail, along with the length */
+    for (n = 0; n < size; n++)
+        b |= (unsigned long long)p[n] << (n * 8);
+
+    v3 ^= b;
+    _XS_SIPROUND(v0, v1, v2, v3);
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    _XS_SIPROUND(v0, v1, v2, v3);
+    _XS_SIPROUND(v0, v1, v2, v3);
+    _XS_SIPROUND(v0, v1, v2, v3);
+
+    b = v0 ^ v1 ^ v2 ^ v3;
+
+    return (unsigned int)(b ^ b >> 32);
 }
 
 
@@ -0,0 +1,297 @@
+/* copyright (c) 2022 - 2024 grunfink et al. / MIT license */
+
+#ifndef _XS_BIN_H
+
+#define _XS_BIN_H
+
+/* binary serialization: the xs value itself, after a small header;
+   the dict search trees depend on the (seeded) hash of the writer,
+   so they are rebuilt on load if it was another process */
+
+#define XS_BIN_MAGIC "\x89xsb"
+#define XS_BIN_VERSION 2
+
+int xs_bin_dump(const xs_val *data, FILE *f);
+xs_val *xs_bin_load(FILE *f);
+int xs_bin_check(const xs_val *data, int size);
+
+
+#ifdef XS_IMPLEMENTATION
+
+typedef struct {
+    char magic[4];              /* XS_BIN_MAGIC */
+    unsigned char version;      /* XS_BIN_VERSION */
+    unsigned char int_size;     /* sizeof(int) of the writer */
+    unsigned char little;       /* 1 if the writer is little endian */
+    unsigned char reserved;
+    unsigned int size;          /* size of the value */
+    unsigned int csum;          /* checksum of the value */
+    unsigned long long hash_tag; /* identifies the hash of the writer (version 2) */
+} xs_bin_hdr;
+
+
+static unsigned char _xs_bin_little(void)
+/* returns 1 if this is a little endian machine */
+{
+    union { int i; unsigned char c; } u = { 1 };
+    return u.c;
+}
+
+
+static unsigned int _xs_bin_csum(const char *data, int size)
+/* FNV-1a, but over 64 bit words (the file format is native-endian anyway) */
+{
+    unsigned long long h = 0xcbf29ce484222325ULL;
+
+    for (; size >= 8; data += 8, size -= 8) {
+        unsigned long long w;
+
+        memcpy(&w, data, sizeof(w));
+        h = (h ^ w) * 0x100000001b3ULL;
+        h ^= h >> 32;
+    }
+
+    while (size--) {
+        h ^= (unsigned char)*data++;
+        h *= 0x100000001b3ULL;
+    }
+
+    return (unsigned int)(h ^ (h >> 32));
+}
+
+
+static unsigned long long _xs_bin_hash_tag(void)
+/* returns a fingerprint of this process' hash function */
+{
+    return (unsigned long long)xs_hash_func(XS_BIN_MAGIC, 4) << 32
+        | xs_hash_func(XS_BIN_MAGIC XS_BIN_MAGIC, 8);
+}
+
+
+static int _xs_bin_check(const char *p, int size, int depth);
+
+static int _xs_bin_check_dict(const char *p, int size, int depth)
+/* checks a dict: its items, the hashed search tree and the values */
+{
+    int sz, o, n = 0, i;
+    int hsz = 1 + (int)sizeof(dict_hdr);
+    int isz = (int)sizeof(ditem_hdr);
+    dict_hdr dh;
+    int *offs;
+    int ret = -1;
+
+    if (size < hsz)
+        return -1;
+
+    memcpy(&dh, p + 1, sizeof(dh));
+    sz = dh.size;
+
+    if (sz < hsz || sz > size)
+        return -1;
+
+    /* the sequential chain goes backwards: count and bound it */
+    for (o = dh.first; o; n++) {
+        ditem_hdr di;
+
+        if (o < hsz || o > sz - isz - 1)
+            return -1;
+
+        memcpy(&di, p + o, sizeof(di));
+
+        if (di.next != 0 && di.next >= o)
+            return -1;
+
+        o = di.next;
+    }
+
+    if ((offs = malloc((n + 1) * sizeof(int))) == NULL)
+        return -1;
+
+    for (i = 0, o = dh.first; o; i++) {
+        ditem_hdr di;
+
+        memcpy(&di, p + o, sizeof(di));
+        offs[i] = o;
+        o = di.next;
+    }
+
+    for (i = 0; i < n; i++) {
+        ditem_hdr di;
+        const char *key = p + offs[i] + isz;
+        int vo, k;
+
+        memcpy(&di, p + offs[i], sizeof(di));
+
+        /* the key must end inside the dict */
+        if (memchr(key, '\0', sz - offs[i] - isz) == NULL)
+            goto end;
+
+        /* deleted values have a negative offset */
+        vo = di.value_offset < 0 ? -di.value_offset : di.value_offset;
+
+        if (vo < offs[i] + isz || vo >= sz
+            || _xs_bin_check(p + vo, sz - vo, depth + 1) < 0)
+            goto end;
+
+        /* children are always newer (further) items */
+        for (k = 0; k < 4; k++) {
+            int c = di.child[k], lo = 0, hi = n - 1;
+
+            if (c == 0)
+                continue;
+
+            if (c <= offs[i])
+                goto end;
+
+            /* binary search (offsets are in descending order) */
+            while (lo <= hi) {
+                int m = (lo + hi) / 2;
+
+                if (offs[m] == c)
+                    break;
+
+                if (offs[m] > c)
+                    lo = m + 1;
+                else
+                    hi = m - 1;
+            }
+
+            if (lo > hi)
+                goto end;
+        }
+    }
+
+    /* the root must be an item, if any */
+    if (dh.root != 0) {
+        for (i = 0; i < n && offs[i] != dh.root; i++);
+
+        if (i == n)
+            goto end;
+    }
+
+    ret = sz;
+
+end:
+    free(offs);
+
+    return ret;
+}
+
+
+static int _xs_bin_check(const char *p, int size, int depth)
+/* checks that a value is well formed and fits in size bytes; returns its size or -1 */
+{
+    const char *e;
+    int sz, o, n;
+
+    if (size < 1 || depth > 1024)
+        return -1;
+
+    switch (xs_type(p)) {
+    case XSTYPE_STRING:
+        return (e = memchr(p, '\0', size)) != NULL ? e - p + 1 : -1;
+
+    case XSTYPE_NUMBER:
+        return (e = memchr(p + 1, '\0', size - 1)) != NULL ? e - p + 1 : -1;
+
+    case XSTYPE_NULL:
+    case XSTYPE_TRUE:
+    case XSTYPE_FALSE:
+        return 1;
+
+    case XSTYPE_DATA:
+        if (size < 1 + _XS_TYPE_SIZE)
+            return -1;
+
+        sz = _xs_get_size(p);
+
+        return sz >= 1 + _XS_TYPE_SIZE && sz <= size ? sz : -1;
+
+    case XSTYPE_LIST:
+        if (size < 1 + _XS_TYPE_SIZE + 1)
+            return -1;
+
+        sz = _xs_get_size(p);
+
+        if (sz < 1 + _XS_TYPE_SIZE + 1 || sz > size)
+            return -1;
+
+        /* items until the end mark, that must be inside */
+        for (o = 1 + _XS_TYPE_SIZE; p[o] == XSTYPE_LITEM; o += 1 + n) {
+            if ((n = _xs_bin_check(p + o + 1, sz - o - 2, depth + 1)) < 0)
+                return -1;
+        }
+
+        return sz;
+
+    case XSTYPE_DICT:
+        return _xs_bin_check_dict(p, size, depth);
+
+    default:
+        return -1;
+    }
+}
+
+
+int xs_bin_check(const xs_val *data, int size)
+/* checks that data is a well formed value of exactly size bytes */
+{
+    return _xs_bin_check(data, size, 0) == size;
+}
+
+
+int xs_bin_dump(const xs_val *data, FILE *f)
+/* dumps a value into a file in binary format */
+{
+    xs_bin_hdr h = {0};
+
+    memcpy(h.magic, XS_BIN_MAGIC, sizeof(h.magic));
+    h.version  = XS_BIN_VERSION;
+    h.int_size = sizeof(int);
+    h.little   = _xs_bin_little();
+    h.size     = xs_size(data);
+    h.csum     = _xs_bin_csum(data, h.size);
+    h.hash_tag = _xs_bin_hash_tag();
+
+    return fwrite(&h, sizeof(h), 1, f) == 1 && fwrite(data, 1, h.size, f) == h.size;
+}
+
+
+xs_val *xs_bin_load(FILE *f)
+/* loads a value in binary format from a file (NULL if invalid) */
+{
+    xs_bin_hdr h;
+    xs_val *v;
+
+    /* version 1 headers lack the hash tag */
+    if (fread(&h, sizeof(h) - sizeof(h.hash_tag), 1, f) != 1
+        || memcmp(h.magic, XS_BIN_MAGIC, sizeof(h.magic)) != 0
+        || h.version < 1 || h.version > XS_BIN_VERSION
+        || h.int_size != sizeof(int)
+        || h.little != _xs_bin_little()
+        || h.size == 0 || h.size > 0x7fffffff - 1)
+        return NULL;
+
+    if (h.version == 1)
+        h.hash_tag = 0;
+    else
+    if (fread(&h.hash_tag, sizeof(h.hash_tag), 1, f) != 1)
+        return NULL;
+
+    v = xs_realloc(NULL, _xs_blk_size(h.size));
+
+    if (fread(v, 1, h.size, f) != h.size
+        || _xs_bin_csum(v, h.size) != h.csum
+        || !xs_bin_check(v, h.size))
+        v = xs_free(v);
+    else
+    if (h.hash_tag != _xs_bin_hash_tag())
+        xs_rehash(v);
+
+    return v;
+}
+
+
+#endif /* XS_IMPLEMENTATION */
+
+#endif /* _XS_BIN_H */
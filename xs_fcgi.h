@@ -2,9 +2,19 @@
 
 /*
     This is an intentionally-dead-simple FastCGI implementation;
-    only FCGI_RESPONDER type with *no* FCGI_KEEP_CON flag is supported.
-    This means only one simultaneous connection and no multiplexing.
-    It seems it's enough for nginx and OpenBSD's httpd, so here it goes.
+    only FCGI_RESPONDER type is supported.
+
+    xs_fcgi_request() reads a single request from a stream and does
+    *not* support the FCGI_KEEP_CON flag, so one request is served
+    per connection and there is no multiplexing. It seems it's enough
+    for nginx and OpenBSD's httpd, so here it goes.
+
+    For kept-alive and multiplexed connections, the caller must split
+    the stream into records with xs_fcgi_record(), collect the params
+    and stdin data of each request id and build the request with
+    xs_fcgi_request_buf(); responses are then serialized with
+    xs_fcgi_response_buf() and written as they are ready.
+
     Almost fully compatible with xs_httpd.h
 */
 
@@ -14,10 +24,14 @@
 
  xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *id);
  void xs_fcgi_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b_size, int id);
+ int xs_fcgi_record(const char *buf, int size, int *type, int *id, const char **content, int *c_size);
+ xs_dict *xs_fcgi_request_buf(const char *params, int pa_size, const char *in, int in_size,
+                              xs_str **payload, int *p_size);
+ xs_str *xs_fcgi_response_buf(int status, xs_dict *headers, xs_str *body, int b_size, int id, int *size);
+ xs_str *xs_fcgi_record_buf(int type, int id, const char *content, int c_size, int *size);
+ xs_str *xs_fcgi_end_request_buf(int id, int protocol_status, int *size);
 
 
-#ifdef XS_IMPLEMENTATION
-
 struct fcgi_record_header {
     unsigned char  version;
     unsigned char  type;
@@ -76,6 +90,109 @@ struct fcgi_end_request {
 #define FCGI_UNKNOWN_ROLE     3
 
 
+#ifdef XS_IMPLEMENTATION
+
+static xs_dict *_xs_fcgi_params(const unsigned char *buf, int b_size, xs_dict **q_vars)
+/* creates a request from the FCGI_PARAMS name-value pairs */
+{
+    xs *cgi_vars = xs_dict_new();
+    xs_dict *req = xs_dict_new();
+
+    int offset = 0;
+    while (offset < b_size) {
+        unsigned int ksz = buf[offset++];
+
+        if (ksz & 0x80) {
+            ksz &= 0x7f;
+            ksz = (ksz << 8) | buf[offset++];
+            ksz = (ksz << 8) | buf[offset++];
+            ksz = (ksz << 8) | buf[offset++];
+        }
+
+        unsigned int vsz = buf[offset++];
+        if (vsz & 0x80) {
+            vsz &= 0x7f;
+            vsz = (vsz << 8) | buf[offset++];
+            vsz = (vsz << 8) | buf[offset++];
+            vsz = (vsz << 8) | buf[offset++];
+        }
+
+        /* truncated? */
+        if (offset + ksz + vsz > (unsigned int)b_size)
+            break;
+
+        /* get the key */
+        xs *k = xs_str_new_sz((char *)&buf[offset], ksz);
+        offset += ksz;
+
+        /* get the value */
+        xs *v = xs_str_new_sz((char *)&buf[offset], vsz);
+        offset += vsz;
+
+        cgi_vars = xs_dict_append(cgi_vars, k, v);
+
+        if (strcmp(k, "REQUEST_METHOD") == 0)
+            req = xs_dict_append(req, "method", v);
+        else
+        if (strcmp(k, "REQUEST_URI") == 0) {
+            req = xs_dict_append(req, "raw_path", v);
+
+            xs *pnv = xs_split_n(v, "?", 1);
+
+            /* store the path */
+            req = xs_dict_append(req, "path", xs_list_get(pnv, 0));
+
+            /* get the variables */
+            xs_free(*q_vars);
+            *q_vars = xs_url_vars(xs_list_get(pnv, 1));
+        }
+        else
+        if (xs_match(k, "CONTENT_TYPE|CONTENT_LENGTH|HTTP_*")) {
+            if (xs_startswith(k, "HTTP_"))
+                k = xs_crop_i(k, 5, 0);
+
+            k = xs_tolower_i(k);
+            k = xs_replace_i(k, "_", "-");
+
+            req = xs_dict_append(req, k, v);
+        }
+    }
+
+    req = xs_dict_append(req, "cgi_vars", cgi_vars);
+
+    return req;
+}
+
+
+static xs_dict *_xs_fcgi_vars(xs_dict *req, const xs_dict *q_vars, const xs_str *payload, int p_size)
+/* adds the query and payload variables to a request */
+{
+    xs *p_vars = NULL;
+    const char *ct = xs_dict_get(req, "content-type");
+
+    if (payload && ct && strcmp(ct, "application/x-www-form-urlencoded") == 0) {
+        p_vars  = xs_url_vars(payload);
+    }
+    else
+    if (payload && ct && xs_startswith(ct, "multipart/form-data")) {
+        p_vars = xs_multipart_form_data(payload, p_size, ct);
+    }
+    else
+        p_vars = xs_dict_new();
+
+    if (q_vars != NULL)
+        req = xs_dict_append(req, "q_vars", q_vars);
+    else {
+        xs *d = xs_dict_new();
+        req = xs_dict_append(req, "q_vars", d);
+    }
+
+    req = xs_dict_append(req, "p_vars", p_vars);
+
+    return req;
+}
+
+
 xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *fcgi_id)
 /* keeps receiving FCGI packets until a complete request is finished */
 {
@@ -87,7 +204,6 @@ xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *fcgi_id)
     xs_dict *req = NULL;
     unsigned char p_status = FCGI_REQUEST_COMPLETE;
     xs *q_vars = NULL;
-    xs *p_vars = NULL;
 
     *fcgi_id = -1;
 
@@ -123,13 +239,13 @@ xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *fcgi_id)
             }
 
             /* store the id for later */
-            *fcgi_id = (int) hdr.id;
+            *fcgi_id = ntohs(hdr.id);
 
             break;
 
         case FCGI_PARAMS:
             /* unknown id? fail */
-            if (hdr.id != *fcgi_id) {
+            if (ntohs(hdr.id) != *fcgi_id) {
                 p_status = FCGI_CANT_MPX_CONN;
                 goto end;
             }
@@ -142,66 +258,7 @@ xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *fcgi_id)
             }
             else {
                 /* no size, so the packet is complete; process it */
-                xs *cgi_vars = xs_dict_new();
-
-                req = xs_dict_new();
-
-                int offset = 0;
-                while (offset < b_size) {
-                    unsigned int ksz = buf[offset++];
-
-                    if (ksz & 0x80) {
-                        ksz &= 0x7f;
-                        ksz = (ksz << 8) | buf[offset++];
-                        ksz = (ksz << 8) | buf[offset++];
-                        ksz = (ksz << 8) | buf[offset++];
-                    }
-
-                    unsigned int vsz = buf[offset++];
-                    if (vsz & 0x80) {
-                        vsz &= 0x7f;
-                        vsz = (vsz << 8) | buf[offset++];
-                        vsz = (vsz << 8) | buf[offset++];
-                        vsz = (vsz << 8) | buf[offset++];
-                    }
-
-                    /* get the key */
-                    xs *k = xs_str_new_sz((char *)&buf[offset], ksz);
-                    offset += ksz;
-
-                    /* get the value */
-                    xs *v = xs_str_new_sz((char *)&buf[offset], vsz);
-                    offset += vsz;
-
-                    cgi_vars = xs_dict_append(cgi_vars, k, v);
-
-                    if (strcmp(k, "REQUEST_METHOD") == 0)
-                        req = xs_dict_append(req, "method", v);
-                    else
-                    if (strcmp(k, "REQUEST_URI") == 0) {
-                        req = xs_dict_append(req, "raw_path", v);
-
-                        xs *pnv = xs_split_n(v, "?", 1);
-
-                        /* store the path */
-                        req = xs_dict_append(req, "path", xs_list_get(pnv, 0));
-
-                        /* get the variables */
-                        q_vars = xs_url_vars(xs_list_get(pnv, 1));
-                    }
-                    else
-                    if (xs_match(k, "CONTENT_TYPE|CONTENT_LENGTH|HTTP_*")) {
-                        if (xs_startswith(k, "HTTP_"))
-                            k = xs_crop_i(k, 5, 0);
-
-                        k = xs_tolower_i(k);
-                        k = xs_replace_i(k, "_", "-");
-
-                        req = xs_dict_append(req, k, v);
-                    }
-                }
-
-                req = xs_dict_append(req, "cgi_vars", cgi_vars);
+                req = _xs_fcgi_params(buf, b_size, &q_vars);
 
                 buf    = xs_free(buf);
                 b_size = 0;
@@ -211,7 +268,7 @@ xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *fcgi_id)
 
         case FCGI_STDIN:
             /* unknown id? fail */
-            if (hdr.id != *fcgi_id) {
+            if (ntohs(hdr.id) != *fcgi_id) {
                 p_status = FCGI_CANT_MPX_CONN;
                 goto end;
             }
@@ -231,23 +288,7 @@ xs_dict *xs_fcgi_request(FILE *f, xs_str **payload, int *p_size, int *fcgi_id)
                 *payload = (xs_str *)buf;
                 *p_size  = b_size;
 
-                const char *ct = xs_dict_get(req, "content-type");
-
-                if (*payload && ct && strcmp(ct, "application/x-www-form-urlencoded") == 0) {
-                    p_vars  = xs_url_vars(*payload);
-                }
-                else
-                if (*payload && ct && xs_startswith(ct, "multipart/form-data")) {
-                    p_vars = xs_multipart_form_data(*payload, *p_size, ct);
-                }
-                else
-                    p_vars = xs_dict_new();
-
-                if (q_vars == NULL)
-                    q_vars = xs_dict_new();
-
-                req = xs_dict_append(req, "q_vars", q_vars);
-                req = xs_dict_append(req, "p_vars", p_vars);
+                req = _xs_fcgi_vars(req, q_vars, *payload, *p_size);
 
                 /* disconnect the payload from the buf variable */
                 buf = NULL;
@@ -287,8 +328,42 @@ end:
 }
 
 
-void xs_fcgi_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b_size, int fcgi_id)
-/* writes an FCGI response */
+xs_str *xs_fcgi_record_buf(int type, int id, const char *content, int c_size, int *size)
+/* serializes an FCGI record (content must fit in one) */
+{
+    struct fcgi_record_header hdr = {0};
+    xs_str *out = xs_realloc(NULL, sizeof(hdr) + c_size + 1);
+
+    hdr.version     = FCGI_VERSION_1;
+    hdr.type        = type;
+    hdr.id          = htons(id);
+    hdr.content_len = htons(c_size);
+
+    memcpy(out, &hdr, sizeof(hdr));
+
+    if (c_size)
+        memcpy(out + sizeof(hdr), content, c_size);
+
+    *size = sizeof(hdr) + c_size;
+    out[*size] = '\0';
+
+    return out;
+}
+
+
+xs_str *xs_fcgi_end_request_buf(int id, int protocol_status, int *size)
+/* serializes an FCGI_END_REQUEST record */
+{
+    struct fcgi_end_request ereq = {0};
+
+    ereq.protocol_status = protocol_status;
+
+    return xs_fcgi_record_buf(FCGI_END_REQUEST, id, (char *)&ereq, sizeof(ereq), size);
+}
+
+
+xs_str *xs_fcgi_response_buf(int status, xs_dict *headers, xs_str *body, int b_size, int fcgi_id, int *size)
+/* serializes an FCGI response (STDOUT records + END_REQUEST) */
 {
     struct fcgi_record_header hdr = {0};
     struct fcgi_end_request ereq = {0};
@@ -296,10 +371,6 @@ void xs_fcgi_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b
     const xs_str *k;
     const xs_str *v;
 
-    /* no previous id? it's an error */
-    if (fcgi_id == -1)
-        return;
-
     /* create the headers */
     {
         xs *s1 = xs_fmt("status: %d\r\n", status);
@@ -319,49 +390,121 @@ void xs_fcgi_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b
     out = xs_str_cat(out, "\r\n");
 
     /* everything is text by now */
-    int size = strlen(out);
+    int o_size = strlen(out);
 
     /* add the body */
     if (body != NULL && b_size > 0) {
         out = xs_append_m(out, body, b_size);
-        size += b_size;
+        o_size += b_size;
     }
 
-    /* now send all the STDOUT in packets */
+    /* now split all the STDOUT in packets */
+    int n_recs = o_size / 0xffff + 3;
+    xs_str *rsp = xs_realloc(NULL, o_size + n_recs * sizeof(hdr) + sizeof(ereq) + 1);
+    int r_size = 0;
+
     hdr.version = FCGI_VERSION_1;
     hdr.type    = FCGI_STDOUT;
-    hdr.id      = fcgi_id;
+    hdr.id      = htons(fcgi_id);
 
     int offset = 0;
 
-    while (offset < size) {
-        size_t sz = size - offset;
+    while (offset < o_size) {
+        int sz = o_size - offset;
         if (sz > 0xffff)
             sz = 0xffff;
 
         hdr.content_len = htons(sz);
 
-        /* write or fail */
-        if (!fwrite(&hdr, sizeof(hdr), 1, f) || fwrite(out + offset, 1, sz, f) != sz)
-            return;
+        memcpy(rsp + r_size, &hdr, sizeof(hdr));
+        r_size += sizeof(hdr);
+        memcpy(rsp + r_size, out + offset, sz);
+        r_size += sz;
 
         offset += sz;
     }
 
     /* final STDOUT packet with 0 size */
     hdr.content_len = 0;
-    if (!fwrite(&hdr, sizeof(hdr), 1, f))
-        return;
+    memcpy(rsp + r_size, &hdr, sizeof(hdr));
+    r_size += sizeof(hdr);
 
-    /* complete the connection */
+    /* complete the request */
     ereq.app_status      = 0;
     ereq.protocol_status = FCGI_REQUEST_COMPLETE;
 
     hdr.type        = FCGI_END_REQUEST;
     hdr.content_len = htons(sizeof(ereq));
 
-    if (fwrite(&hdr, sizeof(hdr), 1, f))
-        fwrite(&ereq, sizeof(ereq), 1, f);
+    memcpy(rsp + r_size, &hdr, sizeof(hdr));
+    r_size += sizeof(hdr);
+    memcpy(rsp + r_size, &ereq, sizeof(ereq));
+    r_size += sizeof(ereq);
+
+    rsp[r_size] = '\0';
+    *size = r_size;
+
+    return rsp;
+}
+
+
+void xs_fcgi_response(FILE *f, int status, xs_dict *headers, xs_str *body, int b_size, int fcgi_id)
+/* writes an FCGI response */
+{
+    /* no previous id? it's an error */
+    if (fcgi_id == -1)
+        return;
+
+    int size;
+    xs *rsp = xs_fcgi_response_buf(status, headers, body, b_size, fcgi_id, &size);
+
+    fwrite(rsp, size, 1, f);
+}
+
+
+int xs_fcgi_record(const char *buf, int size, int *type, int *id, const char **content, int *c_size)
+/* splits the first FCGI record from a buffer; returns its full size
+   (including padding), 0 if it's still incomplete or -1 if invalid */
+{
+    struct fcgi_record_header hdr;
+
+    if (size < (int)sizeof(hdr))
+        return 0;
+
+    memcpy(&hdr, buf, sizeof(hdr));
+
+    if (hdr.version != FCGI_VERSION_1)
+        return -1;
+
+    int r_size = sizeof(hdr) + ntohs(hdr.content_len) + hdr.padding_len;
+
+    if (size < r_size)
+        return 0;
+
+    *type    = hdr.type;
+    *id      = ntohs(hdr.id);
+    *content = buf + sizeof(hdr);
+    *c_size  = ntohs(hdr.content_len);
+
+    return r_size;
+}
+
+
+xs_dict *xs_fcgi_request_buf(const char *params, int pa_size, const char *in, int in_size,
+                             xs_str **payload, int *p_size)
+/* creates a request from the already received FCGI_PARAMS and FCGI_STDIN data */
+{
+    xs *q_vars = NULL;
+    xs_dict *req = _xs_fcgi_params((const unsigned char *)params, pa_size, &q_vars);
+
+    if (in_size) {
+        *payload = xs_realloc(NULL, _xs_blk_size(in_size + 1));
+        memcpy(*payload, in, in_size);
+        (*payload)[in_size] = '\0';
+        *p_size = in_size;
+    }
+
+    return _xs_fcgi_vars(req, q_vars, *payload, *p_size);
 }
 
 
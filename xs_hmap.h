@@ -0,0 +1,219 @@
+/* copyright (c) 2022 - 2024 grunfink et al. / MIT license */
+
+#ifndef _XS_HMAP_H
+
+#define _XS_HMAP_H
+
+/* hash map (or set, with no values) of fixed size binary keys
+   (like md5s), with open addressing and linear probing; keys of
+   up to 64 bytes in whole words are hashed with NH (as in UMAC),
+   much faster than the general hash and also randomly keyed,
+   so its collisions cannot be predicted from outside */
+
+#define XS_HMAP_NH_WORDS 16
+
+typedef struct _xs_hmap {
+    int key_size;           /* size of the keys */
+    int val_size;           /* size of the values (0 for sets) */
+    int stride;             /* size of a slot (key + value, aligned) */
+    int elems;              /* number of slots (a power of 2) */
+    int used;               /* number of used slots */
+    unsigned int nh[XS_HMAP_NH_WORDS]; /* NH key (if used) */
+    unsigned int *hash;     /* hash of each slot (0 if empty) */
+    char *data;             /* keys and values */
+} xs_hmap;
+
+void xs_hmap_init(xs_hmap *m, int key_size, int val_size);
+void xs_hmap_free(xs_hmap *m);
+void *xs_hmap_get(const xs_hmap *m, const void *key);
+void *xs_hmap_put(xs_hmap *m, const void *key, int *added);
+int xs_hmap_add(xs_hmap *m, const void *key);
+int xs_hmap_next(const xs_hmap *m, const void **key, void **value, int *ctxt);
+
+
+#ifdef XS_IMPLEMENTATION
+
+#define _XS_HMAP_VOFF(m) (((m)->key_size + 7) & ~7)
+
+
+void xs_hmap_init(xs_hmap *m, int key_size, int val_size)
+/* initializes a map */
+{
+    m->key_size = key_size;
+    m->val_size = val_size;
+    m->stride   = (_XS_HMAP_VOFF(m) + val_size + 7) & ~7;
+
+    /* the NH key is derived from the (randomly keyed) general hash */
+    if (key_size % 8 == 0 && key_size / 4 <= XS_HMAP_NH_WORDS) {
+        int n;
+
+        for (n = 0; n < key_size / 4; n++)
+            m->nh[n] = xs_hash_func((char *)&n, sizeof(n));
+    }
+
+    /* arbitrary default */
+    m->elems = 64;
+    m->used  = 0;
+    m->hash  = xs_realloc(NULL, m->elems * sizeof(unsigned int));
+    m->data  = xs_realloc(NULL, m->elems * m->stride);
+
+    memset(m->hash, '\0', m->elems * sizeof(unsigned int));
+}
+
+
+void xs_hmap_free(xs_hmap *m)
+/* frees a map */
+{
+    m->hash = xs_free(m->hash);
+    m->data = xs_free(m->data);
+}
+
+
+static unsigned int _xs_hmap_hash(const xs_hmap *m, const void *key)
+/* hashes a key (0 means an empty slot, so it's never returned) */
+{
+    unsigned int h;
+
+    if (m->key_size % 8 == 0 && m->key_size / 4 <= XS_HMAP_NH_WORDS) {
+        const char *p = key;
+        unsigned long long s = 0;
+        unsigned int w[2];
+        int n;
+
+        for (n = 0; n < m->key_size / 4; n += 2) {
+            memcpy(w, p + n * 4, sizeof(w));
+            s += (unsigned long long)(w[0] + m->nh[n]) * (w[1] + m->nh[n + 1]);
+        }
+
+        h = s >> 32;
+    }
+    else
+        h = xs_hash_func(key, m->key_size);
+
+    return h ? h : 1;
+}
+
+
+static int _xs_hmap_find(const xs_hmap *m, const void *key, unsigned int h)
+/* returns the slot of the key, or the empty one where it would go */
+{
+    int i = h & (m->elems - 1);
+
+    while (m->hash[i]) {
+        if (m->hash[i] == h && memcmp(m->data + i * m->stride, key, m->key_size) == 0)
+            break;
+
+        i = (i + 1) & (m->elems - 1);
+    }
+
+    return i;
+}
+
+
+void *xs_hmap_get(const xs_hmap *m, const void *key)
+/* returns a pointer to the value of the key, or NULL */
+{
+    int i = _xs_hmap_find(m, key, _xs_hmap_hash(m, key));
+
+    if (m->hash[i] == 0)
+        return NULL;
+
+    return m->data + i * m->stride + _XS_HMAP_VOFF(m);
+}
+
+
+void *xs_hmap_put(xs_hmap *m, const void *key, int *added)
+/* returns a pointer to the value of the key, creating it
+   (zero filled) if it's not there; added is set accordingly */
+{
+    unsigned int h = _xs_hmap_hash(m, key);
+    int i;
+
+    /* is it 'full'? (the hashes are stored, so probing is cheap) */
+    if (m->used >= m->elems / 4 * 3) {
+        xs_hmap n = *m;
+        int j;
+
+        /* expand! (the old hashes are reused) */
+        n.elems = m->elems * 2;
+        n.hash  = xs_realloc(NULL, n.elems * sizeof(unsigned int));
+        n.data  = xs_realloc(NULL, n.elems * n.stride);
+
+        memset(n.hash, '\0', n.elems * sizeof(unsigned int));
+
+        for (j = 0; j < m->elems; j++) {
+            if (m->hash[j]) {
+                i = m->hash[j] & (n.elems - 1);
+
+                while (n.hash[i])
+                    i = (i + 1) & (n.elems - 1);
+
+                n.hash[i] = m->hash[j];
+                memcpy(n.data + i * n.stride, m->data + j * m->stride, m->stride);
+            }
+        }
+
+        xs_hmap_free(m);
+        *m = n;
+    }
+
+    i = _xs_hmap_find(m, key, h);
+
+    char *p = m->data + i * m->stride;
+
+    if (m->hash[i] == 0) {
+        /* store the new key */
+        m->hash[i] = h;
+        memset(p, '\0', m->stride);
+        memcpy(p, key, m->key_size);
+
+        m->used++;
+
+        if (added)
+            *added = 1;
+    }
+    else
+    if (added)
+        *added = 0;
+
+    return p + _XS_HMAP_VOFF(m);
+}
+
+
+int xs_hmap_add(xs_hmap *m, const void *key)
+/* adds the key to the map */
+/* returns: 1 if added, 0 if already there */
+{
+    int added;
+
+    xs_hmap_put(m, key, &added);
+
+    return added;
+}
+
+
+int xs_hmap_next(const xs_hmap *m, const void **key, void **value, int *ctxt)
+/* map iterator, with context (in no particular order) */
+{
+    while (*ctxt < m->elems) {
+        int i = (*ctxt)++;
+
+        if (m->hash[i]) {
+            char *p = m->data + i * m->stride;
+
+            if (key)
+                *key = p;
+
+            if (value)
+                *value = p + _XS_HMAP_VOFF(m);
+
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#endif /* XS_IMPLEMENTATION */
+
+#endif /* _XS_HMAP_H */
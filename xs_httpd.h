@@ -5,11 +5,18 @@
 #define _XS_HTTPD_H
 
 xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size);
+xs_dict *xs_httpd_request_buf(const char *buf, int b_size, xs_str **payload, int *p_size);
 void xs_httpd_response(FILE *f, int status, const char *status_text, xs_dict *headers, xs_str *body, int b_size);
+void xs_httpd_response_fd(FILE *f, int status, const char *status_text, xs_dict *headers, int fd, off_t offset, int size);
+int xs_httpd_keep_alive(const xs_dict *req);
 
 
 #ifdef XS_IMPLEMENTATION
 
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
 xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
 /* processes an httpd connection */
 {
@@ -95,6 +102,133 @@ xs_dict *xs_httpd_request(FILE *f, xs_str **payload, int *p_size)
 }
 
 
+static char *_xs_httpd_line(char **p)
+/* returns the next line from a header buffer, stripped in place */
+{
+    char *l = *p;
+    char *e;
+
+    if (*l == '\0')
+        return NULL;
+
+    if ((e = strchr(l, '\n')) != NULL) {
+        *e = '\0';
+        *p = e + 1;
+    }
+    else
+        *p = l + strlen(l);
+
+    while (*l && strchr(" \r\t\v\f", *l))
+        l++;
+
+    for (e = l + strlen(l); e > l && strchr(" \r\t\v\f", e[-1]); e--);
+    *e = '\0';
+
+    return l;
+}
+
+
+xs_dict *xs_httpd_request_buf(const char *buf, int b_size, xs_str **payload, int *p_size)
+/* processes an httpd request already read into memory: the header is
+   copied once and split in place, and the request is built from it */
+{
+    const char *end = buf + b_size;
+    const char *p = buf;
+    int h_size = b_size;
+    char *l, *h, *v1, *v2, *q;
+
+    /* find the end of the header (the first blank line) */
+    while (p < end) {
+        const char *nl = memchr(p, '\n', end - p);
+
+        if (nl == NULL)
+            break;
+
+        while (p < nl && strchr(" \r\t\v\f", *p))
+            p++;
+
+        if (p == nl) {
+            h_size = nl + 1 - buf;
+            break;
+        }
+
+        p = nl + 1;
+    }
+
+    xs *hdr = xs_str_new_sz(buf, h_size);
+    h = hdr;
+
+    /* the first line has exactly three words */
+    if ((l = _xs_httpd_line(&h)) == NULL ||
+        (v1 = strchr(l, ' ')) == NULL || (v2 = strchr(v1 + 1, ' ')) == NULL ||
+        strchr(v2 + 1, ' ') != NULL)
+        return NULL;
+
+    *v1++ = '\0';
+    *v2++ = '\0';
+
+    xs_dict *req = xs_dict_new();
+
+    req = xs_dict_append(req, "method", l);
+    req = xs_dict_append(req, "raw_path", v1);
+    req = xs_dict_append(req, "proto", v2);
+
+    /* the path, without its optional variables */
+    if ((q = strchr(v1, '?')) != NULL)
+        *q++ = '\0';
+
+    req = xs_dict_append(req, "path", v1);
+
+    xs *q_vars = xs_url_vars(q);
+    xs *p_vars = NULL;
+
+    /* the headers */
+    while ((l = _xs_httpd_line(&h)) != NULL && *l) {
+        if ((v1 = strstr(l, ": ")) != NULL) {
+            *v1 = '\0';
+
+            for (v2 = l; *v2; v2++)
+                *v2 = tolower((unsigned char)*v2);
+
+            req = xs_dict_append(req, l, v1 + 2);
+        }
+    }
+
+    const char *v;
+
+    if ((v = xs_dict_get(req, "content-length")) != NULL) {
+        /* the payload is what follows the header (if it's all there) */
+        int size = atoi(v);
+
+        if (size > b_size - h_size)
+            size = b_size - h_size;
+
+        if (size < 0)
+            size = 0;
+
+        *p_size  = size;
+        *payload = xs_str_new_sz(buf + h_size, size);
+    }
+
+    v = xs_dict_get(req, "content-type");
+
+    if (*payload && v && strcmp(v, "application/x-www-form-urlencoded") == 0) {
+        p_vars  = xs_url_vars(*payload);
+    }
+    else
+    if (*payload && v && xs_startswith(v, "multipart/form-data")) {
+        p_vars = xs_multipart_form_data(*payload, *p_size, v);
+    }
+    else
+        p_vars = xs_dict_new();
+
+    req = xs_dict_append(req, "q_vars",  q_vars);
+    req = xs_dict_append(req, "p_vars",  p_vars);
+
+    return req;
+}
+
+
 void xs_httpd_response(FILE *f, int status, const char *status_text, xs_dict *headers, xs_str *body, int b_size)
 /* sends an httpd response */
 {
@@ -109,7 +243,8 @@ void xs_httpd_response(FILE *f, int status, const char *status_text, xs_dict *he
         fprintf(f, "%s: %s\r\n", k, v);
     }
 
-    if (b_size != 0)
+    /* always send it (unless forbidden), as the connection may be kept alive */
+    if (status >= 200 && status != 204 && status != 304)
         fprintf(f, "content-length: %d\r\n", b_size);
 
     fprintf(f, "\r\n");
@@ -119,6 +254,68 @@ void xs_httpd_response(FILE *f, int status, const char *status_text, xs_dict *he
 }
 
 
+void xs_httpd_response_fd(FILE *f, int status, const char *status_text, xs_dict *headers, int fd, off_t offset, int size)
+/* sends an httpd response with size bytes of a file as the body */
+{
+    xs_httpd_response(f, status, status_text, headers, NULL, size);
+
+    /* the header must be out before the body goes directly to the socket */
+    fflush(f);
+
+#ifdef __linux__
+
+    while (size > 0) {
+        ssize_t n = sendfile(fileno(f), fd, &offset, size);
+
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        if (n <= 0)
+            break;
+
+        size -= n;
+    }
+
+#else
+
+    char buf[16384];
+
+    while (size > 0) {
+        ssize_t n = pread(fd, buf, size < (int)sizeof(buf) ? size : (int)sizeof(buf), offset);
+
+        if (n <= 0 || fwrite(buf, n, 1, f) != 1)
+            break;
+
+        offset += n;
+        size   -= n;
+    }
+
+    fflush(f);
+
+#endif
+}
+
+
+int xs_httpd_keep_alive(const xs_dict *req)
+/* returns true if the client wants the connection kept alive */
+{
+    const char *proto = xs_dict_get(req, "proto");
+    const char *v     = xs_dict_get(req, "connection");
+
+    if (v != NULL) {
+        xs *conn = xs_tolower_i(xs_dup(v));
+
+        if (strstr(conn, "close"))
+            return 0;
+
+        if (strstr(conn, "keep-alive"))
+            return 1;
+    }
+
+    /* persistent by default since HTTP/1.1 */
+    return proto != NULL && strcmp(proto, "HTTP/1.1") == 0;
+}
+
 #endif /* XS_IMPLEMENTATION */
 
 #endif /* XS_HTTPD_H */
@@ -16,62 +16,92 @@ int xs_json_load_object_iter(FILE *f, xs_str **key, xs_val **value, xstype *pt,
 xs_list *xs_json_load_array(FILE *f);
 xs_dict *xs_json_load_object(FILE *f);
 
+xs_dict *_xs_json_loads_fields(const xs_str *json, const char *fields[]);
+#define xs_json_loads_fields(json, ...) _xs_json_loads_fields(json, (const char *[]){ __VA_ARGS__, NULL })
+xs_dict *_xs_json_load_fields(FILE *f, const char *fields[]);
+#define xs_json_load_fields(f, ...) _xs_json_load_fields(f, (const char *[]){ __VA_ARGS__, NULL })
+
 
 #ifdef XS_IMPLEMENTATION
 
+#include <sys/stat.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 /** IMPLEMENTATION **/
 
 /** JSON dumps **/
 
-static void _xs_json_dump_str(const char *data, FILE *f)
+/* string escaping: 0 is verbatim, 'u' is \u00xx, anything else goes after a backslash;
+   the asciiz also stops the verbatim runs */
+static const char _xs_json_esc[256] = {
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 't', 'n', 'u', 'u', 'r', 'u', 'u',
+    'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u', 'u',
+    ['"'] = '"', ['\\'] = '\\'
+};
+
+
+static void _xs_json_dump_str(const char *data, xs_str_bld *b)
 /* dumps a string in JSON format */
 {
-    unsigned char c;
-    fputs("\"", f);
+    xs_str_bld_cat_m(b, "\"", 1);
 
-    while ((c = *data)) {
-        if (c == '\n')
-            fputs("\\n", f);
-        else
-        if (c == '\r')
-            fputs("\\r", f);
-        else
-        if (c == '\t')
-            fputs("\\t", f);
-        else
-        if (c == '\\')
-            fputs("\\\\", f);
-        else
-        if (c == '"')
-            fputs("\\\"", f);
-        else
-        if (c < 32)
-            fprintf(f, "\\u%04x", (unsigned int) c);
+    for (;;) {
+        const char *s = data;
+        char e, tmp[6];
+
+        while (!_xs_json_esc[(unsigned char)*data])
+            data++;
+
+        xs_str_bld_cat_m(b, s, data - s);
+
+        if (*data == '\0')
+            break;
+
+        e = _xs_json_esc[(unsigned char)*data];
+
+        tmp[0] = '\\';
+        tmp[1] = e;
+
+        if (e == 'u') {
+            tmp[2] = '0';
+            tmp[3] = '0';
+            tmp[4] = "0123456789abcdef"[(*data >> 4) & 0xf];
+            tmp[5] = "0123456789abcdef"[*data & 0xf];
+            xs_str_bld_cat_m(b, tmp, 6);
+        }
         else
-            fputc(c, f);
+            xs_str_bld_cat_m(b, tmp, 2);
 
         data++;
     }
 
-    fputs("\"", f);
+    xs_str_bld_cat_m(b, "\"", 1);
 }
 
 
-static void _xs_json_indent(int level, int indent, FILE *f)
+static void _xs_json_indent(int level, int indent, xs_str_bld *b)
 /* adds indentation */
 {
     if (indent) {
-        int n;
+        static const char spaces[] = "                                ";
+        int n = level * indent;
 
-        fputc('\n', f);
+        xs_str_bld_cat_m(b, "\n", 1);
 
-        for (n = 0; n < level * indent; n++)
-            fputc(' ', f);
+        while (n > 0) {
+            int c = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+
+            xs_str_bld_cat_m(b, spaces, c);
+            n -= c;
+        }
     }
 }
 
 
-static void _xs_json_dump(const xs_val *data, int level, int indent, FILE *f)
+static void _xs_json_dump(const xs_val *data, int level, int indent, xs_str_bld *b)
 /* dumps partial data as JSON */
 {
     int c = 0;
@@ -79,67 +109,68 @@ static void _xs_json_dump(const xs_val *data, int level, int indent, FILE *f)
 
     switch (xs_type(data)) {
     case XSTYPE_NULL:
-        fputs("null", f);
+        xs_str_bld_cat_m(b, "null", 4);
         break;
 
     case XSTYPE_TRUE:
-        fputs("true", f);
+        xs_str_bld_cat_m(b, "true", 4);
         break;
 
     case XSTYPE_FALSE:
-        fputs("false", f);
+        xs_str_bld_cat_m(b, "false", 5);
         break;
 
     case XSTYPE_NUMBER:
-        fputs(xs_number_str(data), f);
+        xs_str_bld_cat(b, xs_number_str(data));
         break;
 
     case XSTYPE_LIST:
-        fputc('[', f);
+        xs_str_bld_cat_m(b, "[", 1);
 
         xs_list_foreach(data, v) {
             if (c != 0)
-                fputc(',', f);
+                xs_str_bld_cat_m(b, ",", 1);
 
-            _xs_json_indent(level + 1, indent, f);
-            _xs_json_dump(v, level + 1, indent, f);
+            _xs_json_indent(level + 1, indent, b);
+            _xs_json_dump(v, level + 1, indent, b);
 
             c++;
         }
 
-        _xs_json_indent(level, indent, f);
-        fputc(']', f);
+        _xs_json_indent(level, indent, b);
+        xs_str_bld_cat_m(b, "]", 1);
 
         break;
 
     case XSTYPE_DICT:
-        fputc('{', f);
+        xs_str_bld_cat_m(b, "{", 1);
 
         const xs_str *k;
 
         xs_dict_foreach(data, k, v) {
             if (c != 0)
-                fputc(',', f);
+                xs_str_bld_cat_m(b, ",", 1);
 
-            _xs_json_indent(level + 1, indent, f);
+            _xs_json_indent(level + 1, indent, b);
 
-            _xs_json_dump_str(k, f);
-            fputc(':', f);
+            _xs_json_dump_str(k, b);
 
             if (indent)
-                fputc(' ', f);
+                xs_str_bld_cat_m(b, ": ", 2);
+            else
+                xs_str_bld_cat_m(b, ":", 1);
 
-            _xs_json_dump(v, level + 1, indent, f);
+            _xs_json_dump(v, level + 1, indent, b);
 
             c++;
         }
 
-        _xs_json_indent(level, indent, f);
-        fputc('}', f);
+        _xs_json_indent(level, indent, b);
+        xs_str_bld_cat_m(b, "}", 1);
         break;
 
     case XSTYPE_STRING:
-        _xs_json_dump_str(data, f);
+        _xs_json_dump_str(data, b);
         break;
 
     default:
@@ -151,33 +182,32 @@ static void _xs_json_dump(const xs_val *data, int level, int indent, FILE *f)
 xs_str *xs_json_dumps(const xs_val *data, int indent)
 /* dumps data as a JSON string */
 {
-    xs_str *s = NULL;
-    size_t sz;
-    FILE *f;
+    xstype t = xs_type(data);
+    xs_str_bld b;
 
-    if ((f = open_memstream(&s, &sz)) != NULL) {
-        int r = xs_json_dump(data, indent, f);
-        fclose(f);
+    if (t != XSTYPE_LIST && t != XSTYPE_DICT)
+        return NULL;
 
-        if (!r)
-            s = xs_free(s);
-    }
+    /* the JSON text is usually a bit bigger than the packed data */
+    xs_str_bld_init(&b, xs_size(data) + xs_size(data) / 4);
+
+    _xs_json_dump(data, 0, indent, &b);
 
-    return s;
+    return xs_str_bld_result(&b);
 }
 
 
 int xs_json_dump(const xs_val *data, int indent, FILE *f)
 /* dumps data into a file as JSON */
 {
-    xstype t = xs_type(data);
+    xs *s = xs_json_dumps(data, indent);
 
-    if (t == XSTYPE_LIST || t == XSTYPE_DICT) {
-        _xs_json_dump(data, 0, indent, f);
-        return 1;
-    }
+    if (s == NULL)
+        return 0;
 
-    return 0;
+    fwrite(s, 1, strlen(s), f);
+
+    return 1;
 }
 
 
@@ -494,21 +524,6 @@ xs_dict *xs_json_load_object(FILE *f)
 }
 
 
-xs_val *xs_json_loads(const xs_str *json)
-/* loads a string in JSON format and converts to a multiple data */
-{
-    FILE *f;
-    xs_val *v = NULL;
-
-    if ((f = fmemopen((char *)json, strlen(json), "r")) != NULL) {
-        v = xs_json_load(f);
-        fclose(f);
-    }
-
-    return v;
-}
-
-
 xstype xs_json_load_type(FILE *f)
 /* identifies the type of a JSON stream */
 {
@@ -527,22 +542,598 @@ xstype xs_json_load_type(FILE *f)
 }
 
 
+/** JSON buffer loads **/
+
+static const char *_xs_json_scan_str(const char *p, const char *e)
+/* returns the first quote or backslash in [p, e), or e */
+{
+#ifdef __SSE2__
+    const __m128i qt = _mm_set1_epi8('"');
+    const __m128i bs = _mm_set1_epi8('\\');
+
+    while (e - p >= 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        int m = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, qt), _mm_cmpeq_epi8(v, bs)));
+
+        if (m)
+            return p + __builtin_ctz(m);
+
+        p += 16;
+    }
+#else
+    /* word at a time: stop at the first word holding a quote or backslash */
+#define _XS_HASZERO(x) (((x) - 0x0101010101010101ULL) & ~(x) & 0x8080808080808080ULL)
+
+    while (e - p >= 8) {
+        unsigned long long w;
+
+        memcpy(&w, p, 8);
+
+        if (_XS_HASZERO(w ^ 0x2222222222222222ULL) || _XS_HASZERO(w ^ 0x5c5c5c5c5c5c5c5cULL))
+            break;
+
+        p += 8;
+    }
+
+#undef _XS_HASZERO
+#endif
+
+    while (p < e && *p != '"' && *p != '\\')
+        p++;
+
+    return p;
+}
+
+
+static int _xs_json_hex4(const char **pp, const char *e, unsigned int *cp)
+/* reads up to 4 hex digits (like fscanf("%04x")) */
+{
+    const char *p = *pp;
+    unsigned int v = 0;
+    int n;
+
+    for (n = 0; n < 4 && p < e; n++, p++) {
+        int c = *p;
+
+        if (c >= '0' && c <= '9')
+            v = v * 16 + c - '0';
+        else
+        if (c >= 'a' && c <= 'f')
+            v = v * 16 + c - 'a' + 10;
+        else
+        if (c >= 'A' && c <= 'F')
+            v = v * 16 + c - 'A' + 10;
+        else
+            break;
+    }
+
+    *pp = p;
+    *cp = v;
+
+    return n > 0;
+}
+
+
+static xs_str *_xs_json_parse_str(const char **pp, const char *e, js_type *t)
+/* parses a JSON string (after the opening quote), copying unescaped runs at once */
+{
+    const char *p = *pp;
+    const char *q = _xs_json_scan_str(p, e);
+    xs_str_bld b;
+
+    /* no escapes: a single copy */
+    if (q < e && *q == '"') {
+        *pp = q + 1;
+        *t = JS_STRING;
+        return xs_str_new_sz(p, q - p);
+    }
+
+    xs_str_bld_init(&b, q - p + 32);
+
+    for (;;) {
+        unsigned int cp;
+        char tmp[4];
+
+        xs_str_bld_cat_m(&b, p, q - p);
+        p = q;
+
+        if (p == e)
+            break;
+
+        if (*p == '"') {
+            p++;
+            *t = JS_STRING;
+            break;
+        }
+
+        /* a backslash */
+        if (++p == e)
+            break;
+
+        cp = (unsigned char)*p++;
+
+        switch (cp) {
+        case 'n': cp = '\n'; break;
+        case 'r': cp = '\r'; break;
+        case 't': cp = '\t'; break;
+        case 'u': /* Unicode codepoint as an hex char */
+            if (!_xs_json_hex4(&p, e, &cp))
+                goto error;
+
+            if (xs_is_surrogate(cp)) {
+                /* \u must follow */
+                unsigned int p2;
+
+                if (e - p < 2 || p[0] != '\\' || p[1] != 'u')
+                    goto error;
+
+                p += 2;
+
+                if (!_xs_json_hex4(&p, e, &p2))
+                    goto error;
+
+                cp = xs_surrogate_dec(cp, p2);
+            }
+
+            /* replace dangerous control codes with their visual representations
+               (\u0000 included, as a NUL would truncate the string) */
+            if (cp < ' ' && cp != '\r' && cp != '\n' && cp != '\t')
+                cp += 0x2400;
+
+            break;
+        }
+
+        xs_str_bld_cat_m(&b, tmp, xs_utf8_enc(tmp, cp));
+
+        q = _xs_json_scan_str(p, e);
+    }
+
+    if (*t == JS_STRING) {
+        *pp = p;
+        return xs_str_bld_result(&b);
+    }
+
+error:
+    *t = JS_ERROR;
+    return xs_free(xs_str_bld_result(&b));
+}
+
+
+static xs_val *_xs_json_parse_lexer(const char **pp, const char *e, js_type *t)
+/* like _xs_json_load_lexer(), but from a memory buffer */
+{
+    const char *p = *pp;
+    xs_val *v = NULL;
+    int c;
+
+    *t = JS_ERROR;
+
+    /* skip blanks */
+    while (p < e && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+
+    if (p == e) {
+        *pp = p;
+        return NULL;
+    }
+
+    c = (unsigned char)*p++;
+
+    if (c == '{')
+        *t = JS_OCURLY;
+    else
+    if (c == '}')
+        *t = JS_CCURLY;
+    else
+    if (c == '[')
+        *t = JS_OBRACK;
+    else
+    if (c == ']')
+        *t = JS_CBRACK;
+    else
+    if (c == ',')
+        *t = JS_COMMA;
+    else
+    if (c == ':')
+        *t = JS_COLON;
+    else
+    if (c == '"')
+        v = _xs_json_parse_str(&p, e, t);
+    else
+    if (c == '-' || (c >= '0' && c <= '9') || c == '.') {
+        /* the buffer is always followed by a non-number (at least, an asciiz) */
+        char *ep;
+        double d = strtod(p - 1, &ep);
+
+        if (ep > p - 1 && ep <= e) {
+            *t = JS_NUMBER;
+            v = xs_number_new(d);
+            p = ep;
+        }
+    }
+    else
+    if (c == 't') {
+        if (e - p >= 3 && memcmp(p, "rue", 3) == 0) {
+            *t = JS_TRUE;
+            v = xs_val_new(XSTYPE_TRUE);
+            p += 3;
+        }
+    }
+    else
+    if (c == 'f') {
+        if (e - p >= 4 && memcmp(p, "alse", 4) == 0) {
+            *t = JS_FALSE;
+            v = xs_val_new(XSTYPE_FALSE);
+            p += 4;
+        }
+    }
+    else
+    if (c == 'n') {
+        if (e - p >= 3 && memcmp(p, "ull", 3) == 0) {
+            *t = JS_NULL;
+            v = xs_val_new(XSTYPE_NULL);
+            p += 3;
+        }
+    }
+
+    *pp = p;
+
+    return v;
+}
+
+
+static xs_dict *_xs_json_parse_object(const char **pp, const char *e);
+
+static xs_list *_xs_json_parse_array(const char **pp, const char *e)
+/* parses a full JSON array (after the initial OBRACK) */
+{
+    xs_list *l = xs_list_new();
+    int c = 0;
+
+    for (;;) {
+        js_type t;
+        xs *v = _xs_json_parse_lexer(pp, e, &t);
+
+        if (t == JS_CBRACK)
+            break;
+
+        if (c > 0) {
+            if (t != JS_COMMA)
+                return xs_free(l);
+
+            v = _xs_json_parse_lexer(pp, e, &t);
+        }
+
+        /* compound type ahead? */
+        if (v == NULL) {
+            if (t == JS_OBRACK)
+                v = _xs_json_parse_array(pp, e);
+            else
+            if (t == JS_OCURLY)
+                v = _xs_json_parse_object(pp, e);
+        }
+
+        if (v == NULL)
+            return xs_free(l);
+
+        l = xs_list_append(l, v);
+        c++;
+    }
+
+    return l;
+}
+
+
+static xs_dict *_xs_json_parse_object(const char **pp, const char *e)
+/* parses a full JSON object (after the initial OCURLY) */
+{
+    xs_dict *d = xs_dict_new();
+    int c = 0;
+
+    for (;;) {
+        js_type t;
+        xs *k = _xs_json_parse_lexer(pp, e, &t);
+
+        if (t == JS_CCURLY)
+            break;
+
+        if (c > 0) {
+            if (t != JS_COMMA)
+                return xs_free(d);
+
+            k = _xs_json_parse_lexer(pp, e, &t);
+        }
+
+        if (t != JS_STRING)
+            return xs_free(d);
+
+        xs_free(_xs_json_parse_lexer(pp, e, &t));
+
+        if (t != JS_COLON)
+            return xs_free(d);
+
+        xs *v = _xs_json_parse_lexer(pp, e, &t);
+
+        /* compound type ahead? */
+        if (v == NULL) {
+            if (t == JS_OBRACK)
+                v = _xs_json_parse_array(pp, e);
+            else
+            if (t == JS_OCURLY)
+                v = _xs_json_parse_object(pp, e);
+        }
+
+        if (v == NULL)
+            return xs_free(d);
+
+        /* like xs_json_load_object(), duplicated keys are kept */
+        d = xs_dict_append(d, k, v);
+        c++;
+    }
+
+    return d;
+}
+
+
+static xs_val *_xs_json_load_mem(const char *json, int sz, int *used)
+/* loads a JSON array or object from a memory buffer */
+{
+    const char *p = json;
+    const char *e = json + sz;
+    xs_val *v = NULL;
+    js_type t;
+
+    xs_free(_xs_json_parse_lexer(&p, e, &t));
+
+    if (t == JS_OBRACK)
+        v = _xs_json_parse_array(&p, e);
+    else
+    if (t == JS_OCURLY)
+        v = _xs_json_parse_object(&p, e);
+
+    if (used)
+        *used = p - json;
+
+    return v;
+}
+
+
+xs_val *xs_json_loads(const xs_str *json)
+/* loads a string in JSON format and converts to a multiple data */
+{
+    return _xs_json_load_mem(json, strlen(json), NULL);
+}
+
+
+static char *_xs_json_read(FILE *f, int *sz)
+/* reads the rest of a file into an asciiz-terminated malloc()'ed buffer */
+{
+    struct stat st;
+    int cap = 4096;
+    char *buf;
+
+    /* regular files are read with a single fread() */
+    if (fstat(fileno(f), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 && st.st_size < 0x7fffffff - 1)
+        cap = st.st_size + 1;
+
+    if ((buf = malloc(cap)) == NULL)
+        return NULL;
+
+    *sz = 0;
+
+    for (;;) {
+        int r = fread(buf + *sz, 1, cap - *sz - 1, f);
+
+        *sz += r;
+
+        if (*sz < cap - 1 || cap > 0x3fffffff)
+            break;
+
+        char *nb = realloc(buf, cap * 2);
+
+        if (nb == NULL)
+            break;
+
+        buf = nb;
+        cap *= 2;
+    }
+
+    /* strtod() needs the buffer terminated */
+    buf[*sz] = '\0';
+
+    return buf;
+}
+
+
 xs_val *xs_json_load(FILE *f)
 /* loads a JSON file */
 {
     xs_val *v = NULL;
-    xstype t = xs_json_load_type(f);
+    int sz, used;
+    char *buf;
 
-    if (t == XSTYPE_LIST)
-        v = xs_json_load_array(f);
-    else
-    if (t == XSTYPE_DICT)
-        v = xs_json_load_object(f);
+    if ((buf = _xs_json_read(f, &sz)) == NULL)
+        return NULL;
+
+    v = _xs_json_load_mem(buf, sz, &used);
+
+    /* leave the stream after the value, as the streaming loader does */
+    if (used < sz)
+        fseek(f, (long)used - sz, SEEK_CUR);
+
+    free(buf);
 
     return v;
 }
 
 
+/** JSON field peeking **/
+
+static const char *_xs_json_skip_blanks(const char *p)
+/* skips JSON whitespace */
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+
+    return p;
+}
+
+
+static const char *_xs_json_skip_str(const char *p)
+/* skips a JSON string (p points to the opening quote) */
+{
+    for (p++; *p && *p != '"'; p++) {
+        if (*p == '\\' && *++p == '\0')
+            break;
+    }
+
+    return *p == '"' ? p + 1 : NULL;
+}
+
+
+static const char *_xs_json_skip_value(const char *p)
+/* skips a full JSON value without decoding it (compound ones included) */
+{
+    int level = 0;
+
+    do {
+        p = _xs_json_skip_blanks(p);
+
+        if (*p == '"') {
+            if ((p = _xs_json_skip_str(p)) == NULL)
+                return NULL;
+        }
+        else
+        if (*p == '{' || *p == '[') {
+            level++;
+            p++;
+        }
+        else
+        if (*p == '}' || *p == ']') {
+            if (--level < 0)
+                return NULL;
+            p++;
+        }
+        else
+        if (*p == '\0')
+            return NULL;
+        else
+        if (level == 0) {
+            /* a scalar: number, true, false or null */
+            const char *s = p;
+
+            while (*p && !strchr(" \t\r\n,:{}[]\"", *p))
+                p++;
+
+            if (p == s)
+                return NULL;
+        }
+        else
+            p++;
+
+    } while (level > 0);
+
+    return p;
+}
+
+
+xs_dict *_xs_json_loads_fields(const xs_str *json, const char *fields[])
+/* decodes only some of the top level fields of a JSON object,
+   skipping everything else without decoding nor allocating memory */
+{
+    const char *p = _xs_json_skip_blanks(json);
+    xs_dict *d;
+
+    if (*p != '{')
+        return NULL;
+
+    d = xs_dict_new();
+
+    p = _xs_json_skip_blanks(p + 1);
+    if (*p == '}')
+        return d;
+
+    for (;;) {
+        const char *k, *v;
+        int n, ksz;
+
+        /* the key */
+        if (*(p = _xs_json_skip_blanks(p)) != '"')
+            break;
+
+        k = p + 1;
+
+        if ((p = _xs_json_skip_str(p)) == NULL)
+            break;
+
+        ksz = p - k - 1;
+
+        if (*(p = _xs_json_skip_blanks(p)) != ':')
+            break;
+
+        /* the value */
+        v = _xs_json_skip_blanks(p + 1);
+
+        if ((p = _xs_json_skip_value(v)) == NULL)
+            break;
+
+        /* is it a wanted field? */
+        for (n = 0; fields[n]; n++) {
+            if ((int)strlen(fields[n]) == ksz && memcmp(fields[n], k, ksz) == 0) {
+                const char *q = v + 1;
+                js_type t;
+                xs *sv = NULL;
+
+                if (*v == '{')
+                    sv = _xs_json_parse_object(&q, p);
+                else
+                if (*v == '[')
+                    sv = _xs_json_parse_array(&q, p);
+                else {
+                    q = v;
+                    sv = _xs_json_parse_lexer(&q, p, &t);
+                }
+
+                /* like in xs_json_load_object(), the last one wins */
+                if (sv != NULL)
+                    d = xs_dict_set(d, fields[n], sv);
+
+                break;
+            }
+        }
+
+        p = _xs_json_skip_blanks(p);
+
+        if (*p == '}')
+            return d;
+
+        if (*p != ',')
+            break;
+
+        p++;
+    }
+
+    /* malformed */
+    return xs_free(d);
+}
+
+
+xs_dict *_xs_json_load_fields(FILE *f, const char *fields[])
+/* like _xs_json_loads_fields(), but from the rest of a file */
+{
+    xs_dict *d = NULL;
+    int sz;
+    char *buf;
+
+    if ((buf = _xs_json_read(f, &sz)) != NULL) {
+        d = _xs_json_loads_fields(buf, fields);
+        free(buf);
+    }
+
+    return d;
+}
+
+
 #endif /* XS_IMPLEMENTATION */
 
 #endif /* _XS_JSON_H */
@@ -5,7 +5,9 @@
 #define _XS_SOCKET_H
 
 int xs_socket_timeout(int s, double rto, double sto);
-int xs_socket_server(const char *addr, const char *serv);
+int xs_socket_server_opt(const char *addr, const char *serv, int flags);
+#define xs_socket_server(addr, serv) xs_socket_server_opt(addr, serv, 0)
+#define XS_SOCKET_REUSEPORT 1
 int xs_socket_accept(int rs);
 int _xs_socket_peername(int s, char *buf, int buf_size);
 int xs_socket_connect(const char *addr, const char *serv);
@@ -50,7 +52,7 @@ int xs_socket_timeout(int s, double rto, double sto)
 }
 
 
-int xs_socket_server(const char *addr, const char *serv)
+int xs_socket_server_opt(const char *addr, const char *serv, int flags)
 /* opens a server socket by service name (or port as string) */
 {
     int rs = -1;
@@ -81,6 +83,14 @@ int xs_socket_server(const char *addr, const char *serv)
         int i = 1;
         setsockopt(rs, SOL_SOCKET, SO_REUSEADDR, (char *)&i, sizeof(i));
 
+#ifdef SO_REUSEPORT
+        /* let other processes bind the same address */
+        if (flags & XS_SOCKET_REUSEPORT)
+            setsockopt(rs, SOL_SOCKET, SO_REUSEPORT, (char *)&i, sizeof(i));
+#else
+        (void)flags;
+#endif
+
         if (bind(rs, (struct sockaddr *)&host, sizeof(host)) == -1) {
             close(rs);
             rs = -1;
@@ -0,0 +1,48 @@
+/* copyright (c) 2022 - 2024 grunfink et al. / MIT license */
+
+#ifndef _XS_ZLIB_H
+
+#define _XS_ZLIB_H
+
+xs_str *xs_zlib_deflate(const char *data, int size, int gzip, int *z_size);
+
+
+#ifdef XS_IMPLEMENTATION
+
+#include <zlib.h>
+
+xs_str *xs_zlib_deflate(const char *data, int size, int gzip, int *z_size)
+/* compresses data in zlib format (or gzip, if set); returns NULL on error */
+{
+    z_stream zs = {0};
+    xs_str *z = NULL;
+
+    /* window bits + 16 means a gzip header and trailer */
+    if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                    gzip ? 15 + 16 : 15, 8, Z_DEFAULT_STRATEGY) == Z_OK) {
+        int bound = deflateBound(&zs, size);
+
+        z = xs_realloc(NULL, bound + 1);
+
+        zs.next_in   = (Bytef *)data;
+        zs.avail_in  = size;
+        zs.next_out  = (Bytef *)z;
+        zs.avail_out = bound;
+
+        if (deflate(&zs, Z_FINISH) == Z_STREAM_END) {
+            *z_size = zs.total_out;
+            z[*z_size] = '\0';
+        }
+        else
+            z = xs_free(z);
+
+        deflateEnd(&zs);
+    }
+
+    return z;
+}
+
+
+#endif /* XS_IMPLEMENTATION */
+
+#endif /* _XS_ZLIB_H */